@@ -15,8 +15,29 @@
 #include <cnn/solver.hpp>
 
 #include <cnn/util.hpp>
+#include <cnn/thread_pool.hpp>
+#include <cnn/parallel.hpp>
+#include <cnn/sampler.hpp>
 #include <cnn/neural_network.hpp>
+#include <cnn/model_file.hpp>
+#include <cnn/snapshot.hpp>
+#include <cnn/checkpoint.hpp>
+#include <cnn/evaluator.hpp>
+#include <cnn/test_evaluation.hpp>
+#include <cnn/trace.hpp>
+#include <cnn/perf_counters.hpp>
+#include <cnn/pipeline.hpp>
+#include <cnn/augmentation.hpp>
+#include <cnn/image_cache.hpp>
+#include <cnn/async_reader.hpp>
 #include <cnn/image_loader.hpp>
+#include <cnn/dataset_cache.hpp>
+#include <cnn/prefetching_loader.hpp>
+#include <cnn/binary_loaders.hpp>
+#include <cnn/tar_loader.hpp>
+#include <cnn/distributed.hpp>
+#include <cnn/inference_server.hpp>
+#include <cnn/benchmark.hpp>
 
 #include <cnn/activation_function.hpp>
 #include <cnn/cost_function.hpp>
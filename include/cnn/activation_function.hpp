@@ -13,6 +13,7 @@
 // limitations under the License.
 #pragma once
 #include "util.hpp"
+#include "parallel.hpp"
 #include <memory>
 #include <cmath>
 
@@ -58,14 +59,18 @@ namespace cnn
 			assert(src->n_slices == dst->n_slices && src->n_rows == dst->n_rows);
 #endif
 
-			for (arma::uword s = 0; s < src->n_slices; ++s) {
-				// arma store data in column-major order
-				for (arma::uword c = 0; c < src->n_cols; ++c) {
-					for (arma::uword r = 0; r < src->n_rows; ++r) {
-						(*dst)(r, c, s) = std::max(0.0, (*src)(r, c, s));
+			// channels are independent
+			ParallelFor(0, src->n_slices, [&](std::size_t first, std::size_t last)
+			{
+				for (arma::uword s = first; s < last; ++s) {
+					// arma store data in column-major order
+					for (arma::uword c = 0; c < src->n_cols; ++c) {
+						for (arma::uword r = 0; r < src->n_rows; ++r) {
+							(*dst)(r, c, s) = std::max(0.0, (*src)(r, c, s));
+						}
 					}
 				}
-			}
+			});
 		}
 
 		inline double ReLU::Derivative(double value) const noexcept
@@ -75,14 +80,17 @@ namespace cnn
 
 		inline void Tanh::Compute(const std::shared_ptr<arma::Cube<double>>& src, const std::shared_ptr<arma::Cube<double>>& dst) const noexcept
 		{
-			for (arma::uword s = 0; s < src->n_slices; ++s) {
-				// arma store data in column-major order
-				for (arma::uword c = 0; c < src->n_cols; ++c) {
-					for (arma::uword r = 0; r < src->n_rows; ++r) {
-						(*dst)(r, c, s) = std::tanh((*src)(r, c, s));
+			ParallelFor(0, src->n_slices, [&](std::size_t first, std::size_t last)
+			{
+				for (arma::uword s = first; s < last; ++s) {
+					// arma store data in column-major order
+					for (arma::uword c = 0; c < src->n_cols; ++c) {
+						for (arma::uword r = 0; r < src->n_rows; ++r) {
+							(*dst)(r, c, s) = std::tanh((*src)(r, c, s));
+						}
 					}
 				}
-			}
+			});
 		}
 
 		inline double Tanh::Derivative(double value) const noexcept
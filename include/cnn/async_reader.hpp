@@ -0,0 +1,92 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "thread_pool.hpp"
+#include <boost/filesystem.hpp>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+namespace cnn
+{
+	struct ReadResult
+	{
+		// tag passed to Submit
+		std::size_t tag;
+		bool ok;
+		// contents of the whole file
+		std::vector<unsigned char> data;
+	};
+
+	// reads whole files keeping up to depth reads in flight. reads go through
+	// io_uring on linux, a pool of threads doing blocking reads is used elsewhere
+	// or if the kernel refuses io_uring. results come in completion order
+	class AsyncFileReader
+	{
+	public:
+		explicit AsyncFileReader(std::size_t depth = 32);
+		// waits for reads in flight, files which aren't read yet are dropped
+		~AsyncFileReader();
+		AsyncFileReader(const AsyncFileReader&) = delete;
+		AsyncFileReader& operator=(const AsyncFileReader&) = delete;
+
+		// the file is opened on the calling thread, the read goes on in the background
+		void Submit(const boost::filesystem::path& path, std::size_t tag);
+		// waits for the next completed read.
+		// false if every submitted read has been taken already
+		bool Wait(ReadResult& result);
+
+		std::size_t Depth() const noexcept;
+		bool UsesIoUring() const noexcept;
+
+	private:
+		struct Request;
+		struct Ring;
+
+		// under the mutex
+		void complete(std::unique_ptr<Request> request, bool ok);
+		// starts waiting reads while there is room in the ring, under the mutex
+		void submitWaiting();
+		void reap();
+
+	private:
+		std::size_t depth_;
+		std::mutex mutex_;
+		std::condition_variable completed_;
+		// submitted reads which aren't in the ring yet
+		std::deque<std::unique_ptr<Request>> waiting_;
+		std::deque<ReadResult> done_;
+		// submitted and not taken by Wait
+		std::size_t outstanding_;
+		std::size_t inflight_;
+		bool stop_;
+		std::unique_ptr<Ring> ring_;
+		std::thread reaper_;
+		std::unique_ptr<ThreadPool> pool_;
+	};
+
+	inline std::size_t AsyncFileReader::Depth() const noexcept
+	{
+		return depth_;
+	}
+
+	inline bool AsyncFileReader::UsesIoUring() const noexcept
+	{
+		return static_cast<bool>(ring_);
+	}
+}
@@ -0,0 +1,69 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <opencv2/core.hpp>
+#include <random>
+
+namespace cnn
+{
+	struct AugmentOptions
+	{
+		// random shift of the crop center as a fraction of the region size
+		double shift = 0.08;
+		// the crop is scaled by a random factor in [1 - scale, 1 + scale]
+		double scale = 0.1;
+		// random rotation in [-rotation, rotation] degrees
+		double rotation = 10.0;
+		// mirror half of the images horizontally
+		bool flip = true;
+		// pixel values in [0, 1] become (x - 0.5) * c + 0.5 + b, where
+		// c is in [1 - contrast, 1 + contrast] and b in [-brightness, brightness]
+		double contrast = 0.2;
+		double brightness = 0.1;
+	};
+
+	struct ColorJitter
+	{
+		double contrast;
+		double brightness;
+	};
+
+	// random geometric and color transformations of train images.
+	// all geometric ones are one affine map, so crop, resize, flip and rotation
+	// are a single cv::warpAffine pass over the pixels. color jitter is applied
+	// by ImageConverter while the image is converted to a cube
+	class Augmenter
+	{
+	public:
+		explicit Augmenter(const AugmentOptions& options = AugmentOptions());
+
+		// randomly transformed region roi of src resized to size
+		void Warp(const cv::Mat& src, const cv::Rect& roi, cv::Size size,
+		          std::mt19937& gen, cv::Mat& dst) const;
+		ColorJitter Jitter(std::mt19937& gen) const;
+		const AugmentOptions& Options() const noexcept;
+
+	private:
+		AugmentOptions options_;
+	};
+
+	inline Augmenter::Augmenter(const AugmentOptions& options)
+		: options_(options)
+	{}
+
+	inline const AugmentOptions& Augmenter::Options() const noexcept
+	{
+		return options_;
+	}
+}
@@ -13,6 +13,7 @@
 // limitations under the License.
 #pragma once
 #include "activation_function.hpp"
+#include "execution_context.hpp"
 #include "util.hpp"
 #include <armadillo>
 #include <memory>
@@ -29,18 +30,24 @@ namespace cnn
 			BaseLayer(arma::uword height, arma::uword width, arma::uword depth,
 					  std::size_t amount, std::unique_ptr<BaseActivationFunction> activFunc);
 			virtual ~BaseLayer() = default;
+			// all results of the call are stored in ctx, the layer itself isn't changed.
 			// propagate signal from bottom to top
-			virtual void Forward(std::shared_ptr<arma::Cube<double>> input) = 0;
+			virtual void Forward(std::shared_ptr<arma::Cube<double>> input,
+								 LayerContext& ctx) const = 0;
 			// propagate error from top to bottom and compute gradient
 			virtual std::pair<tensor4d, tensor4d> Backward(
-				const std::shared_ptr<arma::Cube<double>> &prevLocalLoss) = 0;
+				const std::shared_ptr<arma::Cube<double>> &prevLocalLoss,
+				LayerContext& ctx) const = 0;
 			// propagate error from top to bottom and compute hessian
 			virtual std::pair<tensor4d, tensor4d> Backward2nd(
-				const std::shared_ptr<arma::Cube<double>> &prevLocalLoss) = 0;
-			// get propagated local error to for previous layer
-			const std::shared_ptr<arma::Cube<double>>& LocalLoss() const noexcept;
-			std::shared_ptr<arma::Cube<double>> Output() const noexcept;
-			std::shared_ptr<arma::Cube<double>> ReceptiveField() const noexcept;
+				const std::shared_ptr<arma::Cube<double>> &prevLocalLoss,
+				LayerContext& ctx) const = 0;
+			// name of the layer kind stored in model files
+			virtual const char* Type() const noexcept = 0;
+			// replaces the input shape by the shape of the output.
+			// false if the layer can't take an input of this shape
+			virtual bool OutputShape(arma::uword& rows, arma::uword& cols,
+									 arma::uword& slices) const noexcept = 0;
 
 			tensor4d& Weights() noexcept
 			{
@@ -50,6 +57,14 @@ namespace cnn
 			{
 				return biasWeights_;
 			}
+			const tensor4d& Weights() const noexcept
+			{
+				return weights_;
+			}
+			const tensor4d& BiasWeights() const noexcept
+			{
+				return biasWeights_;
+			}
 
 			//const tensor4d& GetWeights() const noexcept;
 			//const tensor4d& GetBiasWeights() const noexcept;
@@ -60,6 +75,10 @@ namespace cnn
 
 			bool LoadWeights(std::ifstream& in);
 			bool SaveWeights(std::ofstream& out) const;
+			// weights and bias weights use external memory holding their cubes one
+			// after another, nothing is copied. the memory must outlive the layer
+			// or the next assignment of the tensors
+			void MapWeights(double* weights, double* biasWeights);
 			// initialize all weights in this layer using Gaussian distribution
 			void InitWeights() noexcept;
 			bool is_initialized() const noexcept;
@@ -67,14 +86,6 @@ namespace cnn
 			tensor4d weights_;
 			tensor4d biasWeights_;
 
-			// propagated local error to the next layer
-			std::shared_ptr<arma::Cube<double>> localLoss_;
-			// y = f(v)
-			std::shared_ptr<arma::Cube<double>> output_;
-			// v = operator(input, weights)
-			std::shared_ptr<arma::Cube<double>> receptiveField_;
-			// forwarded signal from previous layer
-			std::shared_ptr<arma::Cube<double>> input_;
 			// nonlinearity
 			std::unique_ptr<BaseActivationFunction> activFunc_;
 
@@ -99,21 +110,6 @@ namespace cnn
 		{}
 
 
-		inline const std::shared_ptr<arma::Cube<double>>& BaseLayer::LocalLoss() const noexcept
-		{
-			return localLoss_;
-		}
-
-		inline std::shared_ptr<arma::Cube<double>> BaseLayer::Output() const noexcept
-		{
-			return output_;
-		}
-
-		inline std::shared_ptr<arma::Cube<double>> BaseLayer::ReceptiveField() const noexcept
-		{
-			return receptiveField_;
-		}
-
 		/*inline const tensor4d& BaseLayer::GetWeights() const noexcept
 		{
 			return weights_;
@@ -178,6 +174,22 @@ namespace cnn
 			return true;
 		}
 
+		inline void BaseLayer::MapWeights(double* weights, double* biasWeights)
+		{
+			for (tensor4d* tensor : { &weights_, &biasWeights_ }) {
+				double*& pos = tensor == &weights_ ? weights : biasWeights;
+				// cubes are constructed in place, moving a cube with external memory copies it
+				std::vector<arma::Cube<double>> cubes;
+				cubes.reserve(tensor->data.size());
+				for (const arma::Cube<double>& cube : tensor->data) {
+					cubes.emplace_back(pos, cube.n_rows, cube.n_cols, cube.n_slices, false, true);
+					pos += cube.n_elem;
+				}
+				tensor->data.swap(cubes);
+			}
+			initialized_ = true;
+		}
+
 		inline void BaseLayer::InitWeights() noexcept
 		{
 			if (weights_.n_size == 0)
@@ -0,0 +1,76 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "inference_server.hpp"
+#include "image_loader.hpp"
+#include <armadillo>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <cstddef>
+
+namespace cnn
+{
+	namespace benchmark
+	{
+		struct LoadOptions
+		{
+			// concurrent closed-loop clients, each waits for the answer
+			// before it sends the next request
+			std::size_t clients = 4;
+			// requests sent by every client
+			std::size_t requests = 1000;
+			std::size_t top_k = 5;
+		};
+
+		struct LoadReport
+		{
+			std::size_t requests;
+			std::size_t failed;
+			double seconds;
+			// completed requests per second
+			double throughput;
+			std::chrono::microseconds p50;
+			std::chrono::microseconds p95;
+			std::chrono::microseconds p99;
+			std::chrono::microseconds max;
+		};
+
+		// load generator for the in-process front end
+		LoadReport RunLoad(serving::InferenceServer& server,
+		                   std::shared_ptr<arma::Cube<double>> image,
+		                   const LoadOptions& options = LoadOptions());
+		// load generator for the socket front end, every client has its own connection
+		LoadReport RunLoad(const std::string& socketPath,
+		                   const arma::Cube<double>& image,
+		                   const LoadOptions& options = LoadOptions());
+
+		struct DecodeReport
+		{
+			std::size_t images;
+			// train images per second with full and with reduced jpeg decoding
+			double full;
+			double reduced;
+		};
+
+		// load the amount of train images with reduced decoding switched off and on.
+		// the image cache and async reading are detached while it runs, so every
+		// image is read and decoded. loader settings are restored afterwards
+		DecodeReport BenchmarkDecode(LfwLoader& loader, std::size_t images);
+
+		std::ostream& operator<<(std::ostream& os, const LoadReport& report);
+		std::ostream& operator<<(std::ostream& os, const DecodeReport& report);
+	}
+}
@@ -0,0 +1,220 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "image_loader.hpp"
+#include "sampler.hpp"
+#include <boost/interprocess/mapped_region.hpp>
+#include <armadillo>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	// loaders of standard benchmark datasets stored as packed binary files.
+	// files are mapped read-only and pixels are converted straight from the
+	// mapping to the destination, without reading files or temporary images.
+	// cubes have cvMat2armaCube layout (width, height, channels), colors in BGR order
+	class MappedDatasetLoader : public BaseImageLoader
+	{
+	public:
+		bool LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                   arma::Col<double>& labels) override;
+		bool LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::Col<double>& labels) override;
+		bool LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+		                    arma::Col<arma::uword>& labels) override;
+		const std::wstring& LabelName(std::size_t id) const override;
+		std::size_t Labels() const noexcept override;
+		void Seed(std::uint32_t seed) override;
+		std::string State() const override;
+		bool SetState(const std::string& state) override;
+		// train samples without replacement in epochs of the sampler, every rank
+		// gets a disjoint shard, see EpochSampler. Seed() doesn't change the order
+		void SetEpochSampling(std::uint32_t seed, std::size_t rank = 0, std::size_t ranks = 1);
+		const EpochSampler& Sampler() const noexcept;
+
+		bool is_open() const noexcept;
+		std::size_t TrainImages() const noexcept;
+		std::size_t TestImages() const noexcept override;
+		bool LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::uword& label) const override;
+		// sample idx of the set without randomness
+		bool LoadImage(bool test, std::size_t idx, arma::Cube<double>& dst,
+		               arma::uword& label) const;
+
+	protected:
+		struct Part
+		{
+			std::vector<boost::interprocess::mapped_region> regions;
+			// first byte of pixels and the label of every sample
+			std::vector<std::pair<const unsigned char*, std::uint32_t>> samples;
+		};
+
+		MappedDatasetLoader(arma::uword width, arma::uword height, arma::uword channels);
+		// pixels of one sample to width * height * channels values
+		virtual void decode(const unsigned char* pixels, double* dst) const noexcept = 0;
+		static bool map(const std::wstring& path, Part& part, const unsigned char*& begin,
+		                std::size_t& size);
+		void setLabels(std::uint32_t label, arma::Col<double>& labels) const;
+		// train samples come from the sampler if it is set
+		std::size_t pick(const Part& part);
+
+	protected:
+		Part train_;
+		Part test_;
+		std::vector<std::wstring> labels_;
+		arma::uword width_;
+		arma::uword height_;
+		arma::uword channels_;
+		bool open_;
+		EpochSampler sampler_;
+		std::mt19937 gen_;
+	};
+
+	// MNIST (and Fashion-MNIST) IDX files: 8-bit gray images with 1-byte labels
+	class MnistLoader final : public MappedDatasetLoader
+	{
+	public:
+		MnistLoader(const std::wstring& trainImages, const std::wstring& trainLabels,
+		            const std::wstring& testImages, const std::wstring& testLabels);
+
+	private:
+		bool load(const std::wstring& images, const std::wstring& labels, Part& part);
+		void decode(const unsigned char* pixels, double* dst) const noexcept override;
+	};
+
+	enum class CifarLabels
+	{
+		cifar10,
+		cifar100_coarse,
+		cifar100_fine
+	};
+
+	// CIFAR-10/100 binary batches: records of label byte(s) and 32x32 RGB planes
+	class CifarLoader final : public MappedDatasetLoader
+	{
+	public:
+		// labelNames is a text file with one name per line
+		// (batches.meta.txt, coarse_label_names.txt, fine_label_names.txt).
+		// labels are named by their numbers without it
+		CifarLoader(const std::vector<std::wstring>& trainFiles,
+		            const std::vector<std::wstring>& testFiles,
+		            CifarLabels variant = CifarLabels::cifar10,
+		            const std::wstring& labelNames = L"");
+
+	private:
+		bool load(const std::wstring& path, Part& part);
+		void decode(const unsigned char* pixels, double* dst) const noexcept override;
+
+	private:
+		CifarLabels variant_;
+	};
+
+	// random tensors with random labels, measures compute without any i/o.
+	// a small pool of tensors is generated once and served round robin
+	class SyntheticLoader final : public BaseImageLoader
+	{
+	public:
+		SyntheticLoader(arma::uword rows, arma::uword cols, arma::uword slices,
+		                std::size_t classes, std::size_t poolSize = 16,
+		                std::uint32_t seed = 0);
+
+		bool LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                   arma::Col<double>& labels) override;
+		bool LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::Col<double>& labels) override;
+		const std::wstring& LabelName(std::size_t id) const override;
+		std::size_t Labels() const noexcept override;
+		void Seed(std::uint32_t seed) override;
+		std::string State() const override;
+		bool SetState(const std::string& state) override;
+
+	private:
+		std::vector<std::shared_ptr<arma::Cube<double>>> pool_;
+		std::vector<std::wstring> labels_;
+		std::size_t next_;
+		std::mt19937 gen_;
+	};
+
+	inline bool MappedDatasetLoader::is_open() const noexcept
+	{
+		return open_;
+	}
+
+	inline std::size_t MappedDatasetLoader::TrainImages() const noexcept
+	{
+		return train_.samples.size();
+	}
+
+	inline std::size_t MappedDatasetLoader::TestImages() const noexcept
+	{
+		return test_.samples.size();
+	}
+
+	inline const EpochSampler& MappedDatasetLoader::Sampler() const noexcept
+	{
+		return sampler_;
+	}
+
+	inline void MappedDatasetLoader::Seed(std::uint32_t seed)
+	{
+		gen_.seed(seed);
+	}
+
+	inline std::string MappedDatasetLoader::State() const
+	{
+		return SamplingState(gen_, sampler_);
+	}
+
+	inline bool MappedDatasetLoader::SetState(const std::string& state)
+	{
+		return SetSamplingState(state, gen_, sampler_);
+	}
+
+	inline const std::wstring& MappedDatasetLoader::LabelName(std::size_t id) const
+	{
+#ifndef NDEBUG
+		assert(id < labels_.size());
+#endif
+		return labels_[id];
+	}
+
+	inline std::size_t MappedDatasetLoader::Labels() const noexcept
+	{
+		return labels_.size();
+	}
+
+	inline void SyntheticLoader::Seed(std::uint32_t seed)
+	{
+		gen_.seed(seed);
+	}
+
+	inline const std::wstring& SyntheticLoader::LabelName(std::size_t id) const
+	{
+#ifndef NDEBUG
+		assert(id < labels_.size());
+#endif
+		return labels_[id];
+	}
+
+	inline std::size_t SyntheticLoader::Labels() const noexcept
+	{
+		return labels_.size();
+	}
+}
@@ -0,0 +1,55 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace cnn
+{
+	// everything needed to continue training where it stopped
+	struct TrainingState
+	{
+		// finished epochs
+		std::uint64_t epoch = 0;
+		// network weights in distributed::FlattenWeights order
+		std::vector<double> weights;
+		// solver specific values, e.g. the hessian estimate of SdlmSolver
+		std::vector<double> solver;
+		// see BaseImageLoader::State. distributed training keeps the state
+		// of every rank at its index, a single process has one. the state of
+		// an LfwLoader with async reading includes the images of the reads in
+		// flight, which a resumed run doesn't get
+		std::vector<std::string> loaders;
+	};
+
+	// checkpoint file, all values are stored in the native byte order:
+	//   magic "CNNCKPT", uint32 version, uint32 kind (full or delta), uint64 epoch,
+	//   base file name (delta only), uint64 amount of loader states and the states,
+	//   weights, solver values, crc32. version 1 files have one loader state
+	//   without the amount.
+	// a delta checkpoint stores every value xor-ed with the same value of its
+	// full base checkpoint. the difference of close doubles has only a few
+	// non-zero low bytes, so a 4 bit tag with their amount and the bytes themselves
+	// are stored. the encoding is lossless.
+	// files are written to "<path>.tmp" and renamed, so a crash never leaves
+	// a partial checkpoint
+	bool WriteCheckpoint(const std::wstring& path, const TrainingState& state);
+	// base must be the state written to basePath as a full checkpoint.
+	// only the file name of basePath is stored, both files stay in one directory
+	bool WriteCheckpoint(const std::wstring& path, const TrainingState& state,
+	                     const TrainingState& base, const std::wstring& basePath);
+	// reads full checkpoints and deltas together with their base
+	bool ReadCheckpoint(const std::wstring& path, TrainingState& state);
+}
@@ -30,21 +30,36 @@ namespace cnn
 							   std::unique_ptr<BaseActivationFunction> activFun = std::make_unique<ReLU>());
 			~ConvolutionalLayer() = default;
 
-			void Forward(std::shared_ptr<arma::Cube<double>> input) override;
+			void Forward(std::shared_ptr<arma::Cube<double>> input,
+						 LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward2nd(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
+			const char* Type() const noexcept override;
+			bool OutputShape(arma::uword& rows, arma::uword& cols,
+							 arma::uword& slices) const noexcept override;
 
 		private:
 			// add zero padding on borders
 			void AddPadding(std::shared_ptr<arma::Cube<double>> &src,
 							arma::uword n_rows, arma::uword n_cols,
-							arma::uword n_slices) noexcept;
+							arma::uword n_slices) const noexcept;
 			void im2col(const std::shared_ptr<arma::Cube<double>> &src_data,
 						const tensor4d& src_kernel, arma::Mat<double> &dst_data,
 						arma::Mat<double> &dst_kernel,
 						arma::uword height, arma::uword width) const noexcept;
+			// columns [first, last) of im2col matrix of src_data, used in forward pass
+			// so that blocks of output columns may be computed by different threads
+			void im2col(const std::shared_ptr<arma::Cube<double>>& src_data,
+						arma::uword kernel_height, arma::uword kernel_width,
+						arma::Mat<double>& dst_data, arma::uword height,
+						arma::uword first, arma::uword last) const noexcept;
+			// every row is one flattened filter
+			void kernel2row(const tensor4d& src_kernel, arma::uword depth,
+							arma::Mat<double>& dst_kernel) const noexcept;
 			//im2col version for unsymmetric data. used for computing gradients
 			void im2col(const std::shared_ptr<arma::Cube<double>>& src_data,
 						const std::shared_ptr<arma::Cube <double>>& src_kernel,
@@ -78,10 +93,9 @@ namespace cnn
 
 
 		inline
-		// ReSharper disable once CppMemberFunctionMayBeConst
 		void ConvolutionalLayer::AddPadding(std::shared_ptr<arma::Cube<double>>& src,
 											arma::uword n_rows, arma::uword n_cols,
-											arma::uword n_slices) noexcept
+											arma::uword n_slices) const noexcept
 		{
 			// add zero padding on border
 			src = std::make_shared<arma::Cube<double>>(n_rows + 2 * padding_.height,
@@ -90,5 +104,25 @@ namespace cnn
 			src->zeros();
 		}
 
+		inline const char* ConvolutionalLayer::Type() const noexcept
+		{
+			return "convolutional";
+		}
+
+		inline bool ConvolutionalLayer::OutputShape(arma::uword& rows, arma::uword& cols,
+													arma::uword& slices) const noexcept
+		{
+			arma::uword height = rows + 2 * padding_.height;
+			arma::uword width = cols + 2 * padding_.width;
+			if (slices != weights_.n_slices
+				|| height < kernel_size_.height || width < kernel_size_.width
+				|| (height - kernel_size_.height) % stride_ != 0
+				|| (width - kernel_size_.width) % stride_ != 0)
+				return false;
+			rows = (height - kernel_size_.height) / stride_ + 1;
+			cols = (width - kernel_size_.width) / stride_ + 1;
+			slices = n_filters_;
+			return true;
+		}
 	}
 }
@@ -0,0 +1,173 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "util.hpp"
+#include "image_loader.hpp"
+#include "sampler.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <armadillo>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	// packed file of preprocessed images, written once and mapped by CachedLoader.
+	// all values are stored in the native byte order:
+	//   header          (DatasetCacheHeader, padded to data_offset)
+	//   samples         count * rows * cols * slices doubles in armadillo order
+	//   records         count * {uint32 label, uint32 flags}
+	//   label names     uint32 amount; amount * {uint32 length, utf-8 name}
+	struct DatasetCacheHeader
+	{
+		char magic[8];
+		std::uint32_t version;
+		std::uint32_t reserved;
+		std::uint64_t rows;
+		std::uint64_t cols;
+		std::uint64_t slices;
+		std::uint64_t count;
+		// samples start on a page boundary
+		std::uint64_t data_offset;
+		std::uint64_t records_offset;
+		std::uint64_t names_offset;
+	};
+
+	class DatasetCacheWriter
+	{
+	public:
+		// record flag of samples from the test set
+		static const std::uint32_t test_sample = 1;
+
+		bool Open(const std::wstring& path, arma::uword rows, arma::uword cols,
+		          arma::uword slices);
+		// image must have the size passed to Open()
+		bool Append(const arma::Cube<double>& image, std::uint32_t label, bool test);
+		// write records, label names and the final header
+		bool Close(const std::vector<std::wstring>& labelNames);
+
+	private:
+		boost::filesystem::ofstream out_;
+		DatasetCacheHeader header_;
+		std::vector<std::pair<std::uint32_t, std::uint32_t>> records_;
+	};
+
+	// serves images straight from the mapped cache file without copying.
+	// the mapping is private, so a layer writing to its input doesn't change the file
+	class CachedLoader final : public BaseImageLoader
+	{
+	public:
+		explicit CachedLoader(const std::wstring& cachePath);
+
+		bool LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                   arma::Col<double>& labels) override;
+		bool LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::Col<double>& labels) override;
+		const std::wstring& LabelName(std::size_t id) const override;
+		std::size_t Labels() const noexcept override;
+		// copies samples from the mapping straight to the buffer
+		bool LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+		                    arma::Col<arma::uword>& labels) override;
+		void Seed(std::uint32_t seed) override;
+		std::string State() const override;
+		bool SetState(const std::string& state) override;
+		// train images without replacement in epochs of the sampler instead of a
+		// random person and a random image of the person. every rank gets a disjoint
+		// shard of the train images, see EpochSampler. Seed() doesn't change the order
+		void SetEpochSampling(std::uint32_t seed, std::size_t rank = 0, std::size_t ranks = 1);
+		const EpochSampler& Sampler() const noexcept;
+
+		bool is_open() const noexcept;
+		std::size_t TrainImages() const noexcept;
+		std::size_t TestImages() const noexcept override;
+		bool LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::uword& label) const override;
+
+	private:
+		std::shared_ptr<arma::Cube<double>> sample(std::size_t idx) const;
+		std::size_t pickTrainSample();
+		void setLabels(std::uint32_t label, arma::Col<double>& labels) const;
+
+	private:
+		boost::interprocess::file_mapping file_;
+		// shared with every served cube, so it outlives the loader if needed
+		std::shared_ptr<boost::interprocess::mapped_region> region_;
+		DatasetCacheHeader header_;
+		double* data_;
+		std::vector<std::uint32_t> sampleLabels_;
+		// train samples of every label, train images are sampled per person like LfwLoader does
+		std::vector<std::vector<std::size_t>> trainByLabel_;
+		std::vector<std::size_t> nonEmptyLabels_;
+		// train samples in the file order
+		std::vector<std::size_t> train_;
+		std::vector<std::size_t> test_;
+		std::vector<std::wstring> labels_;
+		EpochSampler sampler_;
+		std::mt19937 gen_;
+	};
+
+	inline bool CachedLoader::is_open() const noexcept
+	{
+		return data_ != nullptr;
+	}
+
+	inline void CachedLoader::Seed(std::uint32_t seed)
+	{
+		gen_.seed(seed);
+	}
+
+	inline std::string CachedLoader::State() const
+	{
+		return SamplingState(gen_, sampler_);
+	}
+
+	inline bool CachedLoader::SetState(const std::string& state)
+	{
+		return SetSamplingState(state, gen_, sampler_);
+	}
+
+	inline const EpochSampler& CachedLoader::Sampler() const noexcept
+	{
+		return sampler_;
+	}
+
+	inline std::size_t CachedLoader::TrainImages() const noexcept
+	{
+		return train_.size();
+	}
+
+	inline std::size_t CachedLoader::TestImages() const noexcept
+	{
+		return test_.size();
+	}
+
+	inline const std::wstring& CachedLoader::LabelName(std::size_t id) const
+	{
+#ifndef NDEBUG
+		assert(id < labels_.size());
+#endif
+		return labels_[id];
+	}
+
+	inline std::size_t CachedLoader::Labels() const noexcept
+	{
+		return labels_.size();
+	}
+}
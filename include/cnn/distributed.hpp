@@ -0,0 +1,122 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "util.hpp"
+#include "neural_network.hpp"
+#include <boost/interprocess/managed_shared_memory.hpp>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	namespace distributed
+	{
+		// workers are arranged in a ring: every worker sends data to the next one
+		// (rank + 1) % size and receives data from the previous one.
+		// implement this class to run data-parallel training over another medium (e.g. tcp)
+		class BaseTransport
+		{
+		public:
+			virtual ~BaseTransport() = default;
+			virtual std::size_t Rank() const noexcept = 0;
+			virtual std::size_t Size() const noexcept = 0;
+			// send sendCount values to the next worker and receive recvCount values
+			// from the previous worker at the same time. returns false if a peer
+			// didn't respond
+			virtual bool Exchange(const double* send, std::size_t sendCount,
+			                      double* recv, std::size_t recvCount) = 0;
+		};
+
+		// single-producer single-consumer channels placed in one shared memory segment.
+		// the segment must be created once with Create() before workers are started
+		class SharedMemoryTransport final : public BaseTransport
+		{
+		public:
+			SharedMemoryTransport(const std::string& name, std::size_t rank, std::size_t size,
+			                      std::chrono::milliseconds timeout = std::chrono::minutes(1));
+
+			static void Create(const std::string& name, std::size_t size,
+			                   std::size_t channelCapacity = 1 << 18);
+			static void Remove(const std::string& name) noexcept;
+
+			std::size_t Rank() const noexcept override;
+			std::size_t Size() const noexcept override;
+			bool Exchange(const double* send, std::size_t sendCount,
+			              double* recv, std::size_t recvCount) override;
+
+		private:
+			struct Channel
+			{
+				// amount of values ever written by the producer and read by the consumer
+				std::atomic<std::uint64_t> written;
+				std::atomic<std::uint64_t> read;
+				std::uint64_t capacity;
+			};
+
+			static std::string ChannelName(std::size_t rank);
+			static std::string BufferName(std::size_t rank);
+
+		private:
+			boost::interprocess::managed_shared_memory segment_;
+			// channel from this worker to the next one
+			Channel* out_;
+			double* outBuffer_;
+			// channel from the previous worker to this one
+			Channel* in_;
+			double* inBuffer_;
+			std::size_t rank_;
+			std::size_t size_;
+			std::chrono::milliseconds timeout_;
+		};
+
+		// sum data over all workers, every worker gets the result.
+		// bandwidth-optimal ring algorithm: each worker sends 2 * (size - 1) / size * data.size()
+		bool RingAllReduce(BaseTransport& transport, std::vector<double>& data);
+		// copy data of worker 0 to all other workers
+		bool Broadcast(BaseTransport& transport, std::vector<double>& data);
+		// every worker gets the values of all workers, dst[rank] is the value of rank
+		bool AllGather(BaseTransport& transport, const std::string& value,
+		               std::vector<std::string>& dst);
+
+		// pack weights/gradients of all layers to the one contiguous buffer and back
+		void Flatten(const std::vector<std::pair<tensor4d, tensor4d>>& src,
+		             std::vector<double>& dst);
+		void Unflatten(const std::vector<double>& src,
+		               std::vector<std::pair<tensor4d, tensor4d>>& dst);
+		// same for weights of the network itself
+		void FlattenWeights(nn::NeuralNetwork& net, std::vector<double>& dst);
+		void UnflattenWeights(const std::vector<double>& src, nn::NeuralNetwork& net);
+
+		// run worker(rank) in amount child processes and wait for all of them.
+		// returns true if every worker returned 0. only available on POSIX systems
+		bool RunLocalWorkers(std::size_t amount,
+		                     const std::function<int(std::size_t rank)>& worker);
+
+		inline std::size_t SharedMemoryTransport::Rank() const noexcept
+		{
+			return rank_;
+		}
+
+		inline std::size_t SharedMemoryTransport::Size() const noexcept
+		{
+			return size_;
+		}
+	}
+}
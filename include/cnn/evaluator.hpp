@@ -0,0 +1,98 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "neural_network.hpp"
+#include "thread_pool.hpp"
+#include <armadillo>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	struct EvaluationResult
+	{
+		// epoch of the evaluated weights
+		std::uint64_t epoch;
+		// evaluated samples
+		std::size_t samples;
+		// samples which couldn't be loaded or threw during the forward pass
+		std::size_t failed;
+		// mean cost over samples
+		double loss;
+		// fraction of samples with the true label at the first place
+		// or among the five highest scores
+		double top1;
+		double top5;
+		// rows are true labels, columns are top-1 predictions
+		arma::Mat<arma::uword> confusion;
+	};
+
+	// evaluates test images on background threads against a copy of the
+	// weights taken by Submit, so training goes on while the test set runs.
+	// net must have the architecture of the trained network and its own
+	// loader, it's used only by the evaluator
+	class Evaluator
+	{
+	public:
+		// forward passes run on threads threads, 0 means one per hardware core
+		explicit Evaluator(std::shared_ptr<nn::NeuralNetwork> net, std::size_t threads = 1);
+		// finishes the running evaluation, pending ones are dropped
+		~Evaluator();
+		Evaluator(const Evaluator&) = delete;
+		Evaluator& operator=(const Evaluator&) = delete;
+
+		// copies weights of trained and returns. if the previous evaluation
+		// is still running, an older pending copy is replaced by this one.
+		// the first samples test images of the loader are evaluated, so results
+		// of different epochs are comparable. loaders without addressable test
+		// images (see BaseImageLoader::TestImages) give the next samples ones
+		void Submit(nn::NeuralNetwork& trained, std::uint64_t epoch, std::size_t samples);
+		// results finished since the last call, the oldest first
+		std::vector<EvaluationResult> Results();
+		// waits until every submitted evaluation is finished
+		void Flush();
+		// evaluations replaced before they started
+		std::size_t Skipped() const;
+
+	private:
+		void Run();
+		EvaluationResult Evaluate(std::uint64_t epoch, std::size_t samples);
+
+	private:
+		std::shared_ptr<nn::NeuralNetwork> net_;
+		ThreadPool pool_;
+		std::vector<nn::ExecutionContext> contexts_;
+		// serializes LoadTestImage of the workers if the loader has no
+		// addressable test images
+		std::mutex loaderMutex_;
+
+		std::vector<double> pending_;
+		std::uint64_t pendingEpoch_;
+		std::size_t pendingSamples_;
+		bool hasPending_;
+		bool running_;
+		std::size_t skipped_;
+		std::deque<EvaluationResult> results_;
+		bool stop_;
+		mutable std::mutex mutex_;
+		std::condition_variable changed_;
+		std::thread thread_;
+	};
+}
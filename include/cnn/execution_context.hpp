@@ -0,0 +1,118 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "util.hpp"
+#include <armadillo>
+#include <memory>
+#include <vector>
+#include <cstddef>
+
+namespace cnn
+{
+	namespace nn
+	{
+		// everything a layer computes during one forward/backward pass.
+		// layers keep only weights, so one network may be used by several
+		// threads at once if every thread has its own context
+		struct LayerContext
+		{
+			// propagated local error to the next layer
+			std::shared_ptr<arma::Cube<double>> localLoss;
+			// y = f(v)
+			std::shared_ptr<arma::Cube<double>> output;
+			// v = operator(input, weights)
+			std::shared_ptr<arma::Cube<double>> receptiveField;
+			// forwarded signal from previous layer
+			std::shared_ptr<arma::Cube<double>> input;
+			// used by max pooling: when we propagate signals from bottom to top
+			// we're using sliding window and vanishes all signals in its range except max.
+			// for correct propagate local errors we should vanishes all errors for disconnected signals
+			arma::Cube<arma::uword> connectIndexes;
+		};
+
+		// activations of the whole network for one thread
+		class ExecutionContext
+		{
+		public:
+			explicit ExecutionContext(std::size_t layers = 0);
+
+			LayerContext& Layer(std::size_t idx) noexcept;
+			const LayerContext& Layer(std::size_t idx) const noexcept;
+			std::size_t Size() const noexcept;
+			void Resize(std::size_t layers);
+
+			void SetInput(std::shared_ptr<arma::Cube<double>> image);
+			std::shared_ptr<arma::Cube<double>> Input() const noexcept;
+			// one-hot labels of the input image, empty for custom images
+			arma::Col<double>& Labels() noexcept;
+			const arma::Col<double>& Labels() const noexcept;
+
+		private:
+			std::vector<LayerContext> layers_;
+			std::shared_ptr<arma::Cube<double>> input_;
+			arma::Col<double> labels_;
+		};
+
+		inline ExecutionContext::ExecutionContext(std::size_t layers)
+			: layers_(layers)
+		{}
+
+		inline LayerContext& ExecutionContext::Layer(std::size_t idx) noexcept
+		{
+#ifndef NDEBUG
+			assert(idx < layers_.size());
+#endif
+			return layers_[idx];
+		}
+
+		inline const LayerContext& ExecutionContext::Layer(std::size_t idx) const noexcept
+		{
+#ifndef NDEBUG
+			assert(idx < layers_.size());
+#endif
+			return layers_[idx];
+		}
+
+		inline std::size_t ExecutionContext::Size() const noexcept
+		{
+			return layers_.size();
+		}
+
+		inline void ExecutionContext::Resize(std::size_t layers)
+		{
+			layers_.resize(layers);
+		}
+
+		inline void ExecutionContext::SetInput(std::shared_ptr<arma::Cube<double>> image)
+		{
+			input_ = std::move(image);
+			labels_.reset();
+		}
+
+		inline std::shared_ptr<arma::Cube<double>> ExecutionContext::Input() const noexcept
+		{
+			return input_;
+		}
+
+		inline arma::Col<double>& ExecutionContext::Labels() noexcept
+		{
+			return labels_;
+		}
+
+		inline const arma::Col<double>& ExecutionContext::Labels() const noexcept
+		{
+			return labels_;
+		}
+	}
+}
@@ -25,11 +25,17 @@ namespace cnn
 			FullyConnectedLayer(arma::uword in, arma::uword out,
 			                    std::unique_ptr<BaseActivationFunction> activFunc);
 
-			void Forward(std::shared_ptr<arma::Cube<double>> input) override;
+			void Forward(std::shared_ptr<arma::Cube<double>> input,
+						 LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward2nd(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
+			const char* Type() const noexcept override;
+			bool OutputShape(arma::uword& rows, arma::uword& cols,
+							 arma::uword& slices) const noexcept override;
 		};
 
 		inline
@@ -39,5 +45,22 @@ namespace cnn
 		{
 			biasWeights_ = tensor4d(out, 1, 1, 1);
 		}
+
+		inline const char* FullyConnectedLayer::Type() const noexcept
+		{
+			return "fully_connected";
+		}
+
+		inline bool FullyConnectedLayer::OutputShape(arma::uword& rows, arma::uword& cols,
+														arma::uword& slices) const noexcept
+		{
+			// the input is flattened to one column
+			if (rows * cols * slices != weights_.n_rows)
+				return false;
+			rows = weights_.n_cols;
+			cols = 1;
+			slices = 1;
+			return true;
+		}
 	}
 }
@@ -0,0 +1,73 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <armadillo>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	struct ImageCacheStats
+	{
+		std::uint64_t hits;
+		std::uint64_t misses;
+		std::size_t entries;
+		// memory of cached values
+		std::size_t bytes;
+	};
+
+	// least recently used preprocessed images, bounded by the memory of cached
+	// values. keys have to describe the preprocessing as well as the file.
+	// thread-safe, one cache may be shared by loaders of several workers
+	class ImageCache
+	{
+	public:
+		explicit ImageCache(std::size_t capacity);
+		ImageCache(const ImageCache&) = delete;
+		ImageCache& operator=(const ImageCache&) = delete;
+
+		// copies the cached image to dst, dst is resized only if its size is wrong
+		bool Get(const std::string& key, arma::Cube<double>& dst);
+		// images larger than the capacity aren't cached
+		void Put(const std::string& key, const arma::Cube<double>& image);
+		void Clear();
+
+		ImageCacheStats Stats() const;
+		std::size_t Capacity() const noexcept;
+
+	private:
+		typedef std::list<std::pair<std::string, std::shared_ptr<const arma::Cube<double>>>> items_t;
+
+	private:
+		mutable std::mutex mutex_;
+		// the most recently used first
+		items_t items_;
+		std::unordered_map<std::string, items_t::iterator> index_;
+		std::size_t capacity_;
+		std::size_t bytes_;
+		std::uint64_t hits_;
+		std::uint64_t misses_;
+	};
+
+	inline std::size_t ImageCache::Capacity() const noexcept
+	{
+		return capacity_;
+	}
+}
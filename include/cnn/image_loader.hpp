@@ -13,13 +13,23 @@
 // limitations under the License.
 #pragma once
 #include "util.hpp"
+#include "augmentation.hpp"
+#include "sampler.hpp"
+#include "image_cache.hpp"
+#include "async_reader.hpp"
 #include <boost/filesystem.hpp>
 #include <opencv2/core.hpp>
+#include <array>
+#include <deque>
 #include <fstream>
+#include <random>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include <utility>
 #include <memory>
 #include <cstddef>
+#include <cstdint>
 
 namespace cnn
 {
@@ -33,14 +43,41 @@ namespace cnn
 		virtual bool LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
 								   arma::Col<double>& labels) = 0;
 		virtual const std::wstring& LabelName(std::size_t id) const = 0;
+		// amount of label names, LabelName takes ids below it
+		virtual std::size_t Labels() const noexcept = 0;
+		// writes n train images one after another to one buffer: image i takes
+		// slices [i * depth, (i + 1) * depth). the buffer is reallocated only if
+		// its size is wrong. labels[i] is the label index of image i.
+		// the default implementation copies images from LoadTrainImage
+		virtual bool LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+		                            arma::Col<arma::uword>& labels);
+		// restart the generator of random samples (and augmentations)
+		// for reproducible runs, loaders without randomness ignore it
+		virtual void Seed(std::uint32_t seed) {}
+		// generator and sampler position for checkpoints, so a resumed run
+		// gets the same images. loaders without such state (e.g. PrefetchingLoader
+		// and TarLoader, their workers and buffers are ahead of the trainer)
+		// return an empty string and can't be restored
+		virtual std::string State() const { return std::string(); }
+		virtual bool SetState(const std::string& state) { return false; }
+		// test images in a fixed order for evaluation of the whole test set.
+		// LoadTestSample may be called from several threads at once.
+		// loaders without addressable test images have none
+		virtual std::size_t TestImages() const noexcept { return 0; }
+		virtual bool LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+		                            arma::uword& label) const { return false; }
 	};
 
 	class LfwLoader final : public BaseImageLoader
 	{
 	public:
 		//TODO: add defines for use std::string instead std::wstring for *nix
+		// image files of every person are listed once. if indexPath is given
+		// the list is read from there, the dataset is scanned and the index
+		// is written there only if the file is missing or describes other folders
 		LfwLoader(const std::wstring& dataSetPath, const std::wstring& trainPath,
-		          const std::wstring& testPath, cv::Size scaleSize);
+		          const std::wstring& testPath, cv::Size scaleSize,
+		          const std::wstring& indexPath = L"");
 
 
 		bool LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
@@ -51,58 +88,133 @@ namespace cnn
 		                    arma::Col<double>& labels) override;
 
 		const std::wstring& LabelName(std::size_t id) const override;
+		std::size_t Labels() const noexcept override;
+		std::string State() const override;
+		bool SetState(const std::string& state) override;
+		// decodes straight to the buffer
+		bool LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+		                    arma::Col<arma::uword>& labels) override;
+		void Seed(std::uint32_t seed) override;
+
+		// random crop, flip, rotation and color jitter of train images instead
+		// of the fixed face region. test and cached images are never augmented.
+		// run the loader under PrefetchingLoader to keep augmentation off the trainer thread
+		void SetAugmentation(bool enable, const AugmentOptions& options = AugmentOptions());
+		// train images without replacement in epochs of the sampler instead of a
+		// random person and a random image of the person. every rank gets a disjoint
+		// shard of the train images, see EpochSampler. Seed() doesn't change the order
+		void SetEpochSampling(std::uint32_t seed, std::size_t rank = 0, std::size_t ranks = 1);
+		const EpochSampler& Sampler() const noexcept;
+		// keep preprocessed images in memory, so repeated epochs don't decode them
+		// again. keys include the scaling, decoding and normalization settings, so
+		// loaders of several workers may share one cache. augmented images bypass it
+		void SetImageCache(std::shared_ptr<ImageCache> cache);
+		const std::shared_ptr<ImageCache>& Cache() const noexcept;
+		// LoadTrainImage and LoadTrainBatch keep up to depth file reads in flight
+		// across calls and decode them as they complete instead of reading one
+		// file at a time. images are picked up to depth ahead, so State() is
+		// ahead of the returned images by the reads in flight. 0 disables it.
+		// images already picked are still returned first when the depth changes
+		void SetAsyncReading(std::size_t depth);
+		std::size_t AsyncReading() const noexcept;
+
+		// write the file index, it may be passed as indexPath later
+		bool SaveIndex(const std::wstring& indexPath) const;
+		// preprocess every indexed image once and pack them to a file for CachedLoader.
+		// images which can't be read are skipped
+		bool WriteCache(const std::wstring& cachePath) const;
+		// decode jpeg images at 1/2, 1/4 or 1/8 resolution when the region of
+		// interest still isn't smaller than the scaled image. enabled by default
+		void SetReducedDecoding(bool enable) noexcept;
+		// per channel (BGR) normalization of images scaled to [0, 1].
+		// default is mean 0 and deviation 1
+		void SetNormalization(const std::array<double, 3>& mean,
+		                      const std::array<double, 3>& stddev);
+		bool ReducedDecoding() const noexcept;
+		// amount of indexed train and test images
+		std::size_t TrainImages() const noexcept;
+		std::size_t TestImages() const noexcept override;
+		// test persons aren't among the train labels, so the label is always 0
+		bool LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::uword& label) const override;
+		// folder names of a train or test list file. label i + 1 is the i-th
+		// train folder, label 0 is every unknown person
+		static bool ReadFolderNames(const std::wstring& listPath, std::vector<std::wstring>& dst);
 
 	private:
-		bool loadImage(const std::wstring& folder, std::shared_ptr<arma::Cube<double>>& dst) const;
+		struct Folder
+		{
+			std::wstring name;
+			std::vector<boost::filesystem::path> images;
+		};
+
+		struct PendingRead
+		{
+			// folder index
+			arma::uword id;
+			const boost::filesystem::path* path;
+		};
+
+		// images are augmented with the generator if it isn't null
+		bool loadImage(const boost::filesystem::path& path,
+		               std::shared_ptr<arma::Cube<double>>& dst, std::mt19937* augment) const;
+		// dst must have the size of scaled images
+		bool loadImage(const boost::filesystem::path& path, arma::Cube<double>& dst,
+		               std::mt19937* augment) const;
+		// cache key of the file with the current preprocessing
+		std::string cacheKey(const boost::filesystem::path& path) const;
+		// read, crop and scale
+		bool decodeImage(const boost::filesystem::path& path, cv::Mat& dst,
+		                 std::mt19937* augment) const;
+		// crop and scale a decoded image
+		bool scaleImage(const cv::Mat& image, cv::Mat& dst, std::mt19937* augment) const;
+		// normalize to dst and cache it if the key isn't empty
+		void convertImage(const cv::Mat& scaled, const std::string& key,
+		                  arma::Cube<double>& dst, std::mt19937* augment) const;
+		// picks train images and submits their reads until depth are in flight
+		bool fillReadWindow();
+		// the next train image of the read window, dst must have the size of
+		// scaled images. id is the folder index
+		bool loadTrainAsync(arma::Cube<double>& dst, arma::uword& id);
+		// removes the read of the result from the window
+		PendingRead takeRead(const ReadResult& result);
+		// decode a completed read with the current preprocessing
+		bool decodeRead(const ReadResult& result, const PendingRead& read,
+		                arma::Cube<double>& dst, arma::uword& id);
+		// random train image, returns its folder index
+		const boost::filesystem::path* pickTrainImage(arma::uword& id);
+		static bool readFolderList(const std::wstring& listPath, std::vector<Folder>& dst);
+		void scanFolders(std::vector<Folder>& folders) const;
+		bool loadIndex(const std::wstring& indexPath);
+		static std::size_t countImages(const std::vector<Folder>& folders) noexcept;
 
 	private:
-		std::vector<std::pair<std::wstring, arma::uword>> trainDataSet_;
-		std::vector<std::pair<std::wstring, arma::uword>> testDataSet_;
+		std::vector<Folder> trainDataSet_;
+		std::vector<Folder> testDataSet_;
 		std::vector<std::wstring> labels_;
-		std::wstring dataset_dir_;
+		boost::filesystem::path dataset_dir_;
 		cv::Size scaleSize_;
+		// imread flag and region of interest for the reduced decoding
+		int decodeFlag_;
+		cv::Rect decodeROI_;
+		bool reducedDecode_;
+		ImageConverter converter_;
+		bool augment_;
+		Augmenter augmenter_;
+		EpochSampler sampler_;
+		std::shared_ptr<ImageCache> cache_;
+		std::unique_ptr<AsyncFileReader> reader_;
+		// train images picked for the read window: reads in flight by their tag
+		// and cache hits which need no read
+		std::unordered_map<std::size_t, PendingRead> pendingReads_;
+		std::deque<std::pair<arma::Cube<double>, arma::uword>> readyImages_;
+		std::size_t nextReadTag_;
+		// first flat train image index of every folder
+		std::vector<std::size_t> trainOffsets_;
+		std::vector<std::size_t> testOffsets_;
+		std::mt19937 gen_;
 	};
 
-	inline
-	LfwLoader::LfwLoader(const std::wstring& dataSetPath, const std::wstring& trainPath,
-	                     const std::wstring& testPath, cv::Size scaleSize)
-		: dataset_dir_(dataSetPath), scaleSize_(scaleSize)
-	{
-		std::wifstream in;
-		in.open(trainPath);
-#ifndef NDEBUG
-		assert(in.is_open()); {
-			namespace fs = boost::filesystem;
-			assert(fs::is_directory(fs::path(dataset_dir_)));
-		}
-#endif
-		if (dataset_dir_.back() != std::wstring(L"\\").back()) {
-			dataset_dir_.append(L"\\");
-		}
-
-		std::size_t folders_amount;
-		in >> folders_amount;
-		trainDataSet_.reserve(folders_amount);
-		labels_.reserve(folders_amount + 1);
-		labels_.emplace_back(L"Unknown");
-
-		std::wstring folder_name;
-		arma::uword image_amount;
-		while (in >> folder_name >> image_amount) {
-			trainDataSet_.emplace_back(folder_name, image_amount);
-			labels_.emplace_back(folder_name);
-		}
-		in.close();
-		in.open(testPath);
-#ifndef NDEBUG
-		assert(in.is_open());
-#endif
-		in >> folders_amount;
-		testDataSet_.reserve(folders_amount);
-		while (in >> folder_name >> image_amount)
-			testDataSet_.emplace_back(folder_name, image_amount);
-	}
-
 	inline const std::wstring& LfwLoader::LabelName(std::size_t id) const
 	{
 #ifndef NDEBUG
@@ -112,4 +224,71 @@ namespace cnn
 		return labels_[id];
 	}
 
+	inline std::size_t LfwLoader::Labels() const noexcept
+	{
+		return labels_.size();
+	}
+
+	inline void LfwLoader::SetNormalization(const std::array<double, 3>& mean,
+	                                        const std::array<double, 3>& stddev)
+	{
+		converter_ = ImageConverter(mean, stddev);
+	}
+
+	inline void LfwLoader::SetAugmentation(bool enable, const AugmentOptions& options)
+	{
+		augment_ = enable;
+		augmenter_ = Augmenter(options);
+	}
+
+	inline void LfwLoader::Seed(std::uint32_t seed)
+	{
+		gen_.seed(seed);
+	}
+
+	inline std::string LfwLoader::State() const
+	{
+		return SamplingState(gen_, sampler_);
+	}
+
+	inline bool LfwLoader::SetState(const std::string& state)
+	{
+		return SetSamplingState(state, gen_, sampler_);
+	}
+
+	inline const EpochSampler& LfwLoader::Sampler() const noexcept
+	{
+		return sampler_;
+	}
+
+	inline void LfwLoader::SetImageCache(std::shared_ptr<ImageCache> cache)
+	{
+		cache_ = std::move(cache);
+	}
+
+	inline const std::shared_ptr<ImageCache>& LfwLoader::Cache() const noexcept
+	{
+		return cache_;
+	}
+
+	inline std::size_t LfwLoader::AsyncReading() const noexcept
+	{
+		return reader_ ? reader_->Depth() : 0;
+	}
+
+	inline bool LfwLoader::ReducedDecoding() const noexcept
+	{
+		return reducedDecode_;
+	}
+
+	inline std::size_t LfwLoader::TrainImages() const noexcept
+	{
+		return countImages(trainDataSet_);
+	}
+
+	inline std::size_t LfwLoader::TestImages() const noexcept
+	{
+		return countImages(testDataSet_);
+	}
+
 }
@@ -0,0 +1,168 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "neural_network.hpp"
+#include "thread_pool.hpp"
+#include <armadillo>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	namespace serving
+	{
+		struct ServerOptions
+		{
+			// inference threads, every thread has its own execution context
+			std::size_t workers = 1;
+			// a batch takes up to max_batch queued requests at once
+			std::size_t max_batch = 8;
+			// the oldest request waits at most max_latency for the batch to fill up.
+			// zero means that queued requests are taken as soon as the workers are free
+			std::chrono::microseconds max_latency = std::chrono::microseconds(2000);
+			// requests over this amount are rejected
+			std::size_t max_queue = 1024;
+		};
+
+		struct Prediction
+		{
+			std::size_t label;
+			double score;
+			std::wstring name;
+		};
+
+		struct ServerStats
+		{
+			std::uint64_t requests;
+			std::uint64_t rejected;
+			std::uint64_t batches;
+			// sum of time requests spent in the queue
+			std::chrono::microseconds queue_time;
+		};
+
+		// collects concurrent requests to batches. a batch is formed when max_batch
+		// requests are queued or the oldest one has waited max_latency, its requests
+		// run in parallel on the worker threads, and requests coming in meanwhile
+		// are coalesced to the next batch. a larger max_batch and max_latency give
+		// fewer, fuller batches at the cost of latency under light load.
+		// workers share weights of one network, so they must not be changed
+		// while the server is running
+		class InferenceServer
+		{
+		public:
+			InferenceServer(std::shared_ptr<const nn::NeuralNetwork> net,
+			                ServerOptions options = ServerOptions());
+			~InferenceServer();
+			InferenceServer(const InferenceServer&) = delete;
+			InferenceServer& operator=(const InferenceServer&) = delete;
+
+			// in-process front end. returns top_k labels with the highest score.
+			// the future holds an exception if the request was rejected,
+			// e.g. if the network can't take an image of this shape
+			std::future<std::vector<Prediction>> Submit(std::shared_ptr<arma::Cube<double>> image,
+			                                            std::size_t top_k);
+			// unix domain socket front end, see SocketClient for the protocol.
+			// returns false if the socket can't be created or isn't supported
+			bool Listen(const std::string& socketPath);
+			// reject new requests, finish queued ones and join all threads
+			void Stop();
+
+			ServerStats Stats() const;
+			const ServerOptions& Options() const noexcept;
+
+		private:
+			struct Request
+			{
+				std::shared_ptr<arma::Cube<double>> image;
+				std::size_t top_k;
+				std::chrono::steady_clock::time_point enqueued;
+				std::promise<std::vector<Prediction>> result;
+			};
+
+			// forms batches until Stop, queued requests are finished first
+			void Batch();
+			// spreads the batch over the workers and waits until it is done
+			void Run(std::vector<Request>& batch);
+			void Reject(Request& request, const char* reason);
+			void Accept();
+			void Serve(int fd);
+
+		private:
+			std::shared_ptr<const nn::NeuralNetwork> net_;
+			ServerOptions options_;
+
+			mutable std::mutex mutex_;
+			std::condition_variable ready_;
+			std::deque<Request> queue_;
+			bool stop_;
+			ServerStats stats_;
+			// context i is used by the pool thread i only
+			std::vector<nn::ExecutionContext> contexts_;
+			ThreadPool workers_;
+			std::thread batcher_;
+
+			// socket front end
+			std::string socketPath_;
+			int listenFd_;
+			std::atomic<bool> listening_;
+			std::thread acceptor_;
+			std::mutex connectionsMutex_;
+			// descriptors of open connections, each is served by a detached thread
+			std::vector<int> connections_;
+			std::condition_variable connectionsClosed_;
+		};
+
+		// blocking client for the socket front end.
+		// request:  uint32 rows, cols, slices, top_k; rows * cols * slices doubles
+		//           in armadillo (column-major) order
+		// response: uint32 count; count times {uint32 label, double score,
+		//           uint32 length, length bytes of utf-8 label name}.
+		//           count == 0xFFFFFFFF means that the request was rejected
+		class SocketClient
+		{
+		public:
+			SocketClient();
+			~SocketClient();
+			SocketClient(const SocketClient&) = delete;
+			SocketClient& operator=(const SocketClient&) = delete;
+
+			bool Connect(const std::string& socketPath);
+			bool Infer(const arma::Cube<double>& image, std::size_t top_k,
+			           std::vector<Prediction>& result);
+			void Close();
+
+		private:
+			int fd_;
+		};
+
+		// indexes and scores of the top_k largest values of the hypothesis
+		std::vector<Prediction> TopK(const nn::NeuralNetwork& net,
+		                             const arma::Cube<double>& hypothesis, std::size_t top_k);
+
+		inline const ServerOptions& InferenceServer::Options() const noexcept
+		{
+			return options_;
+		}
+	}
+}
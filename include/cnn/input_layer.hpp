@@ -14,31 +14,36 @@
 #pragma once
 
 #include "image_loader.hpp"
+#include "execution_context.hpp"
 #include <armadillo>
 #include <memory>
 namespace cnn
 {
 	namespace nn
 	{
+		// feeds images from the loader to execution contexts.
+		// the loader isn't thread-safe, so one input layer
+		// must not be used by several threads at once
 		class InputLayer
 		{
 		public:
 			InputLayer(std::unique_ptr<BaseImageLoader> loader);
 
-			bool LoadTestImage();
-			bool LoadTrainImage();
-
-			void SetCustomImage(std::shared_ptr<arma::Cube<double>> image);
-
-			bool is_empty() const noexcept;
-			std::shared_ptr<arma::Cube<double>> Output() const noexcept;
-			const arma::Col<double>& Labels() const noexcept;
+			bool LoadTestImage(ExecutionContext& ctx);
+			bool LoadTrainImage(ExecutionContext& ctx);
+			bool LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+			                    arma::Col<arma::uword>& labels);
 
 			const std::wstring& LabelName(std::size_t id) const;
+			std::size_t Labels() const noexcept;
+			std::string LoaderState() const;
+			std::size_t TestImages() const noexcept;
+			// see BaseImageLoader::LoadTestSample. only the input is set, labels
+			// of the context stay empty
+			bool LoadTestSample(std::size_t idx, ExecutionContext& ctx, arma::uword& label) const;
+			bool SetLoaderState(const std::string& state);
 
 		private:
-			arma::Col<double> labels_;
-			std::shared_ptr<arma::Cube<double>> output_;
 			std::unique_ptr<BaseImageLoader> loader_;
 		};
 
@@ -46,44 +51,67 @@ namespace cnn
 		InputLayer::InputLayer(std::unique_ptr<BaseImageLoader> loader)
 			: loader_(std::move(loader)) {}
 
-		inline bool InputLayer::LoadTestImage()
+		inline bool InputLayer::LoadTestImage(ExecutionContext& ctx)
 		{
-			return loader_->LoadTestImage(output_, labels_);
+			std::shared_ptr<arma::Cube<double>> image;
+			arma::Col<double> labels;
+			if (!loader_->LoadTestImage(image, labels))
+				return false;
+			ctx.SetInput(image);
+			ctx.Labels() = std::move(labels);
+			return true;
 		}
 
-		inline bool InputLayer::LoadTrainImage()
+		inline bool InputLayer::LoadTrainImage(ExecutionContext& ctx)
 		{
-			return loader_->LoadTrainImage(output_, labels_);
+			std::shared_ptr<arma::Cube<double>> image;
+			arma::Col<double> labels;
+			if (!loader_->LoadTrainImage(image, labels))
+				return false;
+			ctx.SetInput(image);
+			ctx.Labels() = std::move(labels);
+			return true;
 		}
 
-		inline void 
-		InputLayer::SetCustomImage(std::shared_ptr<arma::Cube<double>> image)
+		inline bool InputLayer::LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+		                                       arma::Col<arma::uword>& labels)
 		{
-			output_ = image;
-			labels_.reset();
+			return loader_->LoadTrainBatch(n, buffer, labels);
 		}
 
-		inline bool InputLayer::is_empty() const noexcept
+		inline const std::wstring& InputLayer::LabelName(std::size_t id) const
 		{
-#ifndef NDEBUG
-			assert(output_);
-#endif
-			return output_->is_empty();
+			return loader_->LabelName(id);
 		}
 
-		inline std::shared_ptr<arma::Cube<double>> InputLayer::Output() const noexcept
+		inline std::size_t InputLayer::Labels() const noexcept
 		{
-			return output_;
+			return loader_->Labels();
 		}
 
-		inline const arma::Col<double>& InputLayer::Labels() const noexcept
+		inline std::size_t InputLayer::TestImages() const noexcept
 		{
-			return labels_;
+			return loader_->TestImages();
 		}
 
-		inline const std::wstring& InputLayer::LabelName(std::size_t id) const
+		inline bool InputLayer::LoadTestSample(std::size_t idx, ExecutionContext& ctx,
+		                                       arma::uword& label) const
 		{
-			return loader_->LabelName(id);
+			std::shared_ptr<arma::Cube<double>> image;
+			if (!loader_->LoadTestSample(idx, image, label))
+				return false;
+			ctx.SetInput(image);
+			return true;
+		}
+
+		inline std::string InputLayer::LoaderState() const
+		{
+			return loader_->State();
+		}
+
+		inline bool InputLayer::SetLoaderState(const std::string& state)
+		{
+			return loader_->SetState(state);
 		}
 	}
 }
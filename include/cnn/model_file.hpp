@@ -0,0 +1,91 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "neural_network.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	namespace nn
+	{
+		// versioned model file, all values are stored in the native byte order:
+		//   header          ModelFileHeader
+		//   layer records   layers * ModelLayerRecord
+		//   blobs           weights and bias weights of every layer, every blob
+		//                   starts at a multiple of alignment. a blob holds all
+		//                   cubes of the tensor one after another in armadillo order
+		struct ModelFileHeader
+		{
+			char magic[8];
+			std::uint32_t version;
+			// model_dtype_float64 is the only one
+			std::uint32_t dtype;
+			std::uint64_t alignment;
+			std::uint64_t layers;
+			// crc32 of the layer records
+			std::uint32_t records_crc;
+			std::uint32_t reserved;
+		};
+
+		struct ModelLayerRecord
+		{
+			// BaseLayer::Type()
+			char type[32];
+			// cubes and their shape of the weights and the bias weights
+			std::uint64_t count;
+			std::uint64_t rows;
+			std::uint64_t cols;
+			std::uint64_t slices;
+			std::uint64_t bias_count;
+			std::uint64_t bias_rows;
+			std::uint64_t bias_cols;
+			std::uint64_t bias_slices;
+			// blob positions in the file
+			std::uint64_t offset;
+			std::uint64_t bias_offset;
+			// crc32 of both blobs
+			std::uint32_t crc;
+			std::uint32_t reserved;
+		};
+
+		const std::uint32_t model_dtype_float64 = 1;
+
+		// weights of a network copied to one flat buffer, blobs of every layer
+		// one after another. records have types and shapes, offsets are set on save
+		struct ModelSnapshot
+		{
+			std::vector<ModelLayerRecord> records;
+			std::vector<double> data;
+		};
+
+		// reuses the memory of dst, so repeated captures don't allocate
+		bool CaptureModel(const NeuralNetwork& net, ModelSnapshot& dst);
+		// writes path + ".tmp" and renames it to path, so networks mapping
+		// the old file keep their pages
+		bool SaveModel(const ModelSnapshot& snapshot, const std::wstring& path);
+		bool SaveModel(const NeuralNetwork& net, const std::wstring& path);
+		// maps the file privately and points weights of the network into the
+		// mapping, so nothing is parsed or copied and processes loading one file
+		// share its pages until they change weights. layer types and shapes must
+		// match the network. verify reads every blob to check checksums.
+		// returns the mapping, weights are valid as long as it lives,
+		// or nullptr if the file can't be used
+		std::shared_ptr<void> MapModel(NeuralNetwork& net, const std::wstring& path,
+		                               bool verify = true);
+	}
+}
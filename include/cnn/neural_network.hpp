@@ -22,9 +22,15 @@
 #include "fully_connected_layer.hpp"
 #include "pooling_layer.hpp"
 #include "convolutional_layer.hpp"
+#include "thread_pool.hpp"
+#include "perf_counters.hpp"
 #include <armadillo>
 
+#include <exception>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <fstream>
 #include <cstddef>
@@ -33,29 +39,69 @@ namespace cnn
 {
 	namespace nn
 	{
+		// the network owns weights and one default execution context used by
+		// the methods without context argument. const methods taking a context
+		// only read weights, so several threads may call them at once with
+		// their own contexts as long as nobody changes the weights
 		class NeuralNetwork
 		{
 		public:
+			// gets the hypothesis or the exception thrown during inference
+			typedef std::function<void(std::shared_ptr<arma::Cube<double>> hypothesis,
+									   std::exception_ptr error)> infer_callback_t;
+
 			NeuralNetwork(std::unique_ptr<BaseImageLoader> loader,
 						  std::unique_ptr<BaseCostFunction> costFunction);
 
 			void AppendLayer(std::unique_ptr<BaseLayer> layer);
 			std::size_t Size() const noexcept;
 			const std::wstring& LabelName(std::size_t id) const;
+			// amount of label names of the loader
+			std::size_t Labels() const noexcept;
+			// see BaseImageLoader::State
+			std::string LoaderState() const;
+			bool SetLoaderState(const std::string& state);
 
 			void InitWeights() noexcept;
 			bool is_initialized() const noexcept;
 			bool LoadWeights(std::ifstream& in);
 			bool SaveWeights(std::ofstream& out) const;
+			// versioned model file, see model_file.hpp. weights point into the
+			// private mapping of the file, so nothing is parsed or copied
+			bool LoadWeights(const std::wstring& path, bool verify = true);
+			bool SaveWeights(const std::wstring& path) const;
+
+			// context with buffers for every layer of this network
+			ExecutionContext CreateContext() const;
+			// true if every layer can take the output of the previous one
+			// when the network gets an image of this shape
+			bool AcceptsInput(arma::uword rows, arma::uword cols,
+							  arma::uword slices) const noexcept;
 
 			bool LoadTestImage();
 			bool LoadTrainImage();
+			bool LoadTestImage(ExecutionContext& ctx);
+			// test images in a fixed order, see BaseImageLoader::LoadTestSample.
+			// several threads may load them at once with their own contexts
+			std::size_t TestImages() const noexcept;
+			bool LoadTestSample(std::size_t idx, ExecutionContext& ctx, arma::uword& label) const;
+			bool LoadTrainImage(ExecutionContext& ctx);
+			// n train images packed to one buffer, see BaseImageLoader::LoadTrainBatch
+			bool LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+								arma::Col<arma::uword>& labels);
 			void SetInputImage(std::shared_ptr<arma::Cube<double>> image);
 
-			std::shared_ptr<arma::Cube<double>> Hypothesis() const noexcept;;
+			std::shared_ptr<arma::Cube<double>> Hypothesis() const noexcept;
 			std::shared_ptr<arma::Cube<double>> Output(std::size_t layerIdx) const noexcept;
 			std::shared_ptr<arma::Cube<double>> ReceptiveField(std::size_t layerIdx) const noexcept;
-			double Error();
+			double Error() const;
+
+			std::shared_ptr<arma::Cube<double>> Hypothesis(const ExecutionContext& ctx) const noexcept;
+			std::shared_ptr<arma::Cube<double>> Output(const ExecutionContext& ctx,
+													   std::size_t layerIdx) const noexcept;
+			std::shared_ptr<arma::Cube<double>> ReceptiveField(const ExecutionContext& ctx,
+															   std::size_t layerIdx) const noexcept;
+			double Error(const ExecutionContext& ctx) const;
 
 			tensor4d& Weights(std::size_t layerIdx) noexcept
 			{
@@ -65,32 +111,80 @@ namespace cnn
 			{
 				return layers_[layerIdx]->BiasWeights();
 			}
+			BaseLayer& Layer(std::size_t layerIdx) noexcept
+			{
+				return *layers_[layerIdx];
+			}
+			const BaseLayer& Layer(std::size_t layerIdx) const noexcept
+			{
+				return *layers_[layerIdx];
+			}
 
 			//propagate signals from bottom
 			void Forward();
+			// propagate signals through layers [first, last) only
+			void Forward(std::size_t first, std::size_t last,
+						 std::shared_ptr<arma::Cube<double>> input);
 			// compute Gradient
 			std::vector<std::pair<tensor4d, tensor4d>> Backpropagation();
 			// compute Hessian
 			std::vector<std::pair<tensor4d, tensor4d>> Backpropagation_2nd();
+
+			void Forward(ExecutionContext& ctx) const;
+			void Forward(ExecutionContext& ctx, std::size_t first, std::size_t last,
+						 std::shared_ptr<arma::Cube<double>> input) const;
+			std::vector<std::pair<tensor4d, tensor4d>> Backpropagation(ExecutionContext& ctx) const;
+			std::vector<std::pair<tensor4d, tensor4d>> Backpropagation_2nd(ExecutionContext& ctx) const;
+
+			// run forward pass on the internal executor, every executor thread has
+			// its own context. the hypothesis belongs to the caller. weights must
+			// not be changed until all pending calls are finished
+			std::future<std::shared_ptr<arma::Cube<double>>> InferAsync(
+				std::shared_ptr<arma::Cube<double>> image);
+			// callback is invoked on the executor thread
+			void InferAsync(std::shared_ptr<arma::Cube<double>> image, infer_callback_t callback);
+			// threads of the executor, 0 means one per hardware core.
+			// takes effect only before the first InferAsync call
+			void SetAsyncThreads(std::size_t threads) noexcept;
+			// hardware counters around every layer call, null switches profiling off.
+			// a full forward pass ends one profiler iteration
+			void SetProfiler(std::shared_ptr<profiling::LayerProfiler> profiler) noexcept;
+			const std::shared_ptr<profiling::LayerProfiler>& Profiler() const noexcept;
+		private:
+			std::shared_ptr<arma::Cube<double>> Infer(ExecutionContext& ctx,
+													  std::shared_ptr<arma::Cube<double>> image) const;
+			ThreadPool& Executor();
+
 		private:
 			std::vector<std::unique_ptr<BaseLayer>> layers_;
 			std::unique_ptr<BaseCostFunction> costFunc_;
 			std::unique_ptr<InputLayer> in_;
+			ExecutionContext context_;
 
 			bool initialized_;
+			// mapping of the model file weights point into
+			std::shared_ptr<void> weightsMapping_;
+			std::shared_ptr<profiling::LayerProfiler> profiler_;
+
+			// executor is started lazily and stopped before layers are destroyed
+			std::mutex asyncMutex_;
+			std::size_t asyncThreads_;
+			std::vector<ExecutionContext> asyncContexts_;
+			std::unique_ptr<ThreadPool> executor_;
 		};
 
 		inline 
 		NeuralNetwork::NeuralNetwork(std::unique_ptr<BaseImageLoader> loader,
 									 std::unique_ptr<BaseCostFunction> costFunction)
-			: in_(std::make_unique<InputLayer>(std::move(loader))),
-			costFunc_(std::move(costFunction)),
-			initialized_(false)
+			: costFunc_(std::move(costFunction)),
+			in_(std::make_unique<InputLayer>(std::move(loader))),
+			initialized_(false), asyncThreads_(0)
 		{}
 
 		inline void NeuralNetwork::AppendLayer(std::unique_ptr<BaseLayer> layer)
 		{
 			layers_.emplace_back(std::move(layer));
+			context_.Resize(layers_.size());
 		}
 
 		inline std::size_t NeuralNetwork::Size() const noexcept
@@ -103,6 +197,32 @@ namespace cnn
 			return in_->LabelName(id);
 		}
 
+		inline std::size_t NeuralNetwork::Labels() const noexcept
+		{
+			return in_->Labels();
+		}
+
+		inline void NeuralNetwork::SetProfiler(
+			std::shared_ptr<profiling::LayerProfiler> profiler) noexcept
+		{
+			profiler_ = std::move(profiler);
+		}
+
+		inline const std::shared_ptr<profiling::LayerProfiler>& NeuralNetwork::Profiler() const noexcept
+		{
+			return profiler_;
+		}
+
+		inline std::string NeuralNetwork::LoaderState() const
+		{
+			return in_->LoaderState();
+		}
+
+		inline bool NeuralNetwork::SetLoaderState(const std::string& state)
+		{
+			return in_->SetLoaderState(state);
+		}
+
 		inline void NeuralNetwork::InitWeights() noexcept
 		{
 			for(std::unique_ptr<BaseLayer> & item : layers_) 
@@ -115,6 +235,18 @@ namespace cnn
 			return initialized_;
 		}
 
+		inline bool NeuralNetwork::AcceptsInput(arma::uword rows, arma::uword cols,
+												arma::uword slices) const noexcept
+		{
+			if (layers_.empty())
+				return false;
+			for (const std::unique_ptr<BaseLayer>& item : layers_) {
+				if (!item->OutputShape(rows, cols, slices))
+					return false;
+			}
+			return true;
+		}
+
 		inline bool NeuralNetwork::LoadWeights(std::ifstream& in)
 		{
 			bool flag = true;
@@ -140,60 +272,142 @@ namespace cnn
 			return flag;
 		}
 
+		inline ExecutionContext NeuralNetwork::CreateContext() const
+		{
+			return ExecutionContext(layers_.size());
+		}
+
 		inline bool NeuralNetwork::LoadTestImage()
 		{
-			return in_->LoadTestImage();
+			return in_->LoadTestImage(context_);
 		}
 
 		inline bool NeuralNetwork::LoadTrainImage()
 		{
-			return in_->LoadTrainImage();
+			return in_->LoadTrainImage(context_);
+		}
+
+		inline bool NeuralNetwork::LoadTestImage(ExecutionContext& ctx)
+		{
+			return in_->LoadTestImage(ctx);
+		}
+
+		inline bool NeuralNetwork::LoadTrainImage(ExecutionContext& ctx)
+		{
+			return in_->LoadTrainImage(ctx);
+		}
+
+		inline std::size_t NeuralNetwork::TestImages() const noexcept
+		{
+			return in_->TestImages();
+		}
+
+		inline bool NeuralNetwork::LoadTestSample(std::size_t idx, ExecutionContext& ctx,
+		                                          arma::uword& label) const
+		{
+			return in_->LoadTestSample(idx, ctx, label);
+		}
+
+		inline bool NeuralNetwork::LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+												  arma::Col<arma::uword>& labels)
+		{
+			return in_->LoadTrainBatch(n, buffer, labels);
 		}
 
 		inline void NeuralNetwork::SetInputImage(std::shared_ptr<arma::Cube<double>> image)
 		{
-			in_->SetCustomImage(std::move(image));
+			context_.SetInput(std::move(image));
 		}
 
 		inline std::shared_ptr<arma::Cube<double>> NeuralNetwork::Hypothesis() const noexcept
 		{
-			return layers_.back()->Output();
+			return Hypothesis(context_);
 		}
 
 		inline
 		std::shared_ptr<arma::Cube<double>> NeuralNetwork::ReceptiveField(
 			std::size_t layerIdx) const noexcept
 		{
+			return ReceptiveField(context_, layerIdx);
+		}
+
+		inline 
+		std::shared_ptr<arma::Cube<double>> NeuralNetwork::Output(std::size_t layerIdx) const noexcept
+		{
+			return Output(context_, layerIdx);
+		}
+
+		inline double NeuralNetwork::Error() const
+		{
+			return Error(context_);
+		}
+
+		inline std::shared_ptr<arma::Cube<double>> NeuralNetwork::Hypothesis(
+			const ExecutionContext& ctx) const noexcept
+		{
+			return ctx.Layer(layers_.size() - 1).output;
+		}
+
+		inline
+		std::shared_ptr<arma::Cube<double>> NeuralNetwork::ReceptiveField(
+			const ExecutionContext& ctx, std::size_t layerIdx) const noexcept
+		{
 #ifndef NDEBUG
 			assert(layerIdx < layers_.size());
 			assert(initialized_);
 #endif
-			return layers_[layerIdx]->ReceptiveField();
+			return ctx.Layer(layerIdx).receptiveField;
 		}
 
 		inline 
-		std::shared_ptr<arma::Cube<double>> NeuralNetwork::Output(arma::uword layerIdx) const noexcept
+		std::shared_ptr<arma::Cube<double>> NeuralNetwork::Output(
+			const ExecutionContext& ctx, std::size_t layerIdx) const noexcept
 		{
 #ifndef NDEBUG
 			assert(layerIdx < layers_.size());
 			assert(initialized_);
 #endif
-			return layers_[layerIdx]->Output();
+			return ctx.Layer(layerIdx).output;
 		}
 
-		inline double NeuralNetwork::Error()
+		inline double NeuralNetwork::Error(const ExecutionContext& ctx) const
 		{
 #ifndef NDEBUG
-			assert(!in_->Labels().empty());
+			assert(!ctx.Labels().empty());
 #endif
-			
-			if (SoftMaxLayer *output = dynamic_cast<SoftMaxLayer*>(layers_.back().get())) {
-				return costFunc_->Compute(in_->Labels(),
-										  layers_.back()->ReceptiveField()->slice(0).col(0));
+			const LayerContext& top = ctx.Layer(layers_.size() - 1);
+			if (dynamic_cast<SoftMaxLayer*>(layers_.back().get())) {
+				return costFunc_->Compute(ctx.Labels(), top.receptiveField->slice(0).col(0));
 			} else {
-				return costFunc_->Compute(in_->Labels(), layers_.back()->Output()->slice(0).col(0));
+				return costFunc_->Compute(ctx.Labels(), top.output->slice(0).col(0));
 			}
 		}
 
+		inline void NeuralNetwork::Forward()
+		{
+			Forward(context_);
+		}
+
+		inline void NeuralNetwork::Forward(std::size_t first, std::size_t last,
+										   std::shared_ptr<arma::Cube<double>> input)
+		{
+			Forward(context_, first, last, std::move(input));
+		}
+
+		inline std::vector<std::pair<tensor4d, tensor4d>> NeuralNetwork::Backpropagation()
+		{
+			return Backpropagation(context_);
+		}
+
+		inline std::vector<std::pair<tensor4d, tensor4d>> NeuralNetwork::Backpropagation_2nd()
+		{
+			return Backpropagation_2nd(context_);
+		}
+
+		inline void NeuralNetwork::SetAsyncThreads(std::size_t threads) noexcept
+		{
+			std::lock_guard<std::mutex> lock(asyncMutex_);
+			asyncThreads_ = threads;
+		}
 	}
 }
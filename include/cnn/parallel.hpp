@@ -0,0 +1,99 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+namespace cnn
+{
+	// fork-join pool for splitting one layer between cores.
+	// every worker has its own deque: it takes the newest chunks from it and
+	// steals the oldest ones from other workers when it runs out of work.
+	// the calling thread helps until all chunks of its call are done
+	class WorkStealingPool
+	{
+	public:
+		typedef std::function<void(std::size_t first, std::size_t last)> body_t;
+
+		// concurrency includes the calling thread, so concurrency - 1 workers are started
+		explicit WorkStealingPool(std::size_t concurrency);
+		~WorkStealingPool();
+		WorkStealingPool(const WorkStealingPool&) = delete;
+		WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+		// calls body on disjoint subranges covering [begin, end) and waits for them.
+		// calls from a worker of the pool are executed serially.
+		// the first exception thrown by body is rethrown
+		void ParallelFor(std::size_t begin, std::size_t end, const body_t& body);
+		std::size_t Concurrency() const noexcept;
+
+	private:
+		struct Job
+		{
+			const body_t* body;
+			std::atomic<std::size_t> pending;
+			std::mutex errorMutex;
+			std::exception_ptr error;
+		};
+
+		struct Task
+		{
+			Job* job;
+			std::size_t first;
+			std::size_t last;
+		};
+
+		struct Queue
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		// own == queues_.size() means the caller, it only steals
+		bool TryPop(std::size_t own, Task& task);
+		void Execute(const Task& task);
+		void Run(std::size_t idx);
+
+	private:
+		std::vector<std::unique_ptr<Queue>> queues_;
+		std::vector<std::thread> workers_;
+		std::atomic<std::size_t> queued_;
+		std::mutex sleepMutex_;
+		std::condition_variable wake_;
+		bool stop_;
+	};
+
+	inline std::size_t WorkStealingPool::Concurrency() const noexcept
+	{
+		return workers_.size() + 1;
+	}
+
+	// intra-layer parallelism shared by all layers. threads == 1 (the default)
+	// runs layers serially, 0 means one thread per hardware core.
+	// with more than one thread BLAS is switched to one thread (CNN_USE_OPENBLAS,
+	// CNN_USE_MKL) because matrix products are already split between the workers.
+	// must not be called while the network is computing
+	void SetIntraOpThreads(std::size_t threads);
+	std::size_t IntraOpThreads() noexcept;
+	// ParallelFor of the shared pool, serial if the pool isn't enabled
+	void ParallelFor(std::size_t begin, std::size_t end, const WorkStealingPool::body_t& body);
+}
@@ -0,0 +1,179 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	namespace profiling
+	{
+		enum Counter
+		{
+			cycles,
+			instructions,
+			l1d_misses,
+			llc_misses,
+			branch_misses,
+			counter_count
+		};
+
+		typedef std::array<std::uint64_t, counter_count> counters_t;
+
+		struct PerfReading
+		{
+			counters_t counters;
+			// time the group was enabled and actually counting, in ns. the kernel
+			// multiplexes groups when there are more events than hardware counters,
+			// running < enabled means that counters saw only a part of the time
+			std::uint64_t enabled;
+			std::uint64_t running;
+		};
+
+		// hardware counters of the calling thread opened with perf_event_open as
+		// one group, so all of them are scheduled together. counters the CPU or
+		// the kernel doesn't provide are left out. only available on Linux,
+		// perf_event_paranoid must allow user space measurements (<= 2)
+		class PerfGroup
+		{
+		public:
+			PerfGroup();
+			~PerfGroup();
+			PerfGroup(const PerfGroup&) = delete;
+			PerfGroup& operator=(const PerfGroup&) = delete;
+
+			bool is_open() const noexcept;
+			bool Available(Counter counter) const noexcept;
+			// counts since the group was opened, unavailable counters are 0
+			bool Read(PerfReading& dst) const;
+
+		private:
+			int leader_;
+			std::array<int, counter_count> fds_;
+			// counters in the order of the group read
+			std::vector<Counter> order_;
+		};
+
+		enum Phase
+		{
+			forward,
+			backward,
+			backward2nd,
+			phase_count
+		};
+
+		struct LayerCounters
+		{
+			std::size_t layer;
+			const char* type;
+			Phase phase;
+			std::uint64_t calls;
+			std::chrono::nanoseconds time;
+			// counters of calls with running < enabled are scaled by enabled / running
+			counters_t counters;
+			// calls with scaled counters
+			std::uint64_t scaled;
+			// calls while the group wasn't scheduled at all, they add no counts
+			std::uint64_t uncounted;
+		};
+
+		// sums counters around every layer call of a network, see
+		// NeuralNetwork::SetProfiler. only the calling thread of a layer is
+		// counted: keep SetIntraOpThreads(1) and single-threaded BLAS to see the
+		// whole work of a layer. every report_interval full forward passes the
+		// table is printed to out, 0 prints nothing
+		class LayerProfiler
+		{
+		public:
+			explicit LayerProfiler(std::size_t report_interval = 0,
+			                       std::ostream* out = nullptr);
+
+			// counters of the calling thread for the layer call until End
+			void Begin(PerfReading& reading, std::chrono::steady_clock::time_point& start);
+			void End(std::size_t layer, const char* type, Phase phase, const PerfReading& reading,
+			         std::chrono::steady_clock::time_point start);
+			void EndIteration();
+
+			// every layer and phase with calls, in layer order
+			std::vector<LayerCounters> Layers() const;
+			std::size_t Iterations() const;
+			// false if perf events can't be opened, the table has only calls and time then
+			bool HasCounters() const;
+			void Reset();
+			// per layer IPC and misses per thousand instructions
+			void Print(std::ostream& out) const;
+
+		private:
+			std::size_t reportInterval_;
+			std::ostream* out_;
+			mutable std::mutex mutex_;
+			// [layer * phase_count + phase]
+			std::vector<LayerCounters> layers_;
+			std::size_t iterations_;
+			bool hasCounters_;
+		};
+
+		// profiles one layer call if profiler isn't null
+		class LayerScope
+		{
+		public:
+			LayerScope(LayerProfiler* profiler, std::size_t layer, const char* type, Phase phase);
+			~LayerScope();
+			LayerScope(const LayerScope&) = delete;
+			LayerScope& operator=(const LayerScope&) = delete;
+
+		private:
+			LayerProfiler* profiler_;
+			std::size_t layer_;
+			const char* type_;
+			Phase phase_;
+			PerfReading reading_;
+			std::chrono::steady_clock::time_point start_;
+		};
+
+		std::ostream& operator<<(std::ostream& os, const LayerProfiler& profiler);
+
+		inline bool PerfGroup::is_open() const noexcept
+		{
+			return leader_ >= 0;
+		}
+
+		inline bool PerfGroup::Available(Counter counter) const noexcept
+		{
+			return fds_[counter] >= 0;
+		}
+
+		inline LayerScope::LayerScope(LayerProfiler* profiler, std::size_t layer, const char* type,
+		                              Phase phase)
+			: profiler_(profiler), layer_(layer), type_(type), phase_(phase)
+		{
+			if (profiler_) {
+				profiler_->Begin(reading_, start_);
+			}
+		}
+
+		inline LayerScope::~LayerScope()
+		{
+			if (profiler_) {
+				profiler_->End(layer_, type_, phase_, reading_, start_);
+			}
+		}
+	}
+}
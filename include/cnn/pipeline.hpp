@@ -0,0 +1,82 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "neural_network.hpp"
+#include "spsc_queue.hpp"
+#include <armadillo>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+namespace cnn
+{
+	namespace nn
+	{
+		// splits layers of the network to contiguous stages, every stage runs
+		// on its own thread. while image i is in the top layers image i + 1
+		// is already processed by the bottom ones.
+		// Push() and Pop() may be called from different threads, but each of them
+		// only from one thread. every stage has its own execution context,
+		// so weights only must not be changed while the executor is alive
+		class PipelineExecutor
+		{
+		public:
+			// stage s runs layers [boundaries[s], boundaries[s + 1]),
+			// boundaries must start with 0 and end with net->Size()
+			PipelineExecutor(std::shared_ptr<NeuralNetwork> net,
+			                 std::vector<std::size_t> boundaries,
+			                 std::size_t queueCapacity = 4);
+			~PipelineExecutor();
+			PipelineExecutor(const PipelineExecutor&) = delete;
+			PipelineExecutor& operator=(const PipelineExecutor&) = delete;
+
+			// split layers to stages with equal amount of layers
+			static std::vector<std::size_t> UniformStages(std::size_t layers, std::size_t stages);
+			// time every layer on the sample image and split layers so
+			// that the slowest stage is as fast as possible
+			static std::vector<std::size_t> BalancedStages(const NeuralNetwork& net,
+			                                               std::shared_ptr<arma::Cube<double>> sample,
+			                                               std::size_t stages);
+
+			// blocks while the first stage queue is full
+			void Push(std::shared_ptr<arma::Cube<double>> image);
+			bool TryPush(std::shared_ptr<arma::Cube<double>>& image);
+			// hypotheses are returned in the order images were pushed.
+			// blocks until the next hypothesis is ready
+			std::shared_ptr<arma::Cube<double>> Pop();
+			bool TryPop(std::shared_ptr<arma::Cube<double>>& hypothesis);
+			std::size_t Stages() const noexcept;
+
+		private:
+			typedef SpscQueue<std::shared_ptr<arma::Cube<double>>> queue_t;
+			void Run(std::size_t stage);
+
+		private:
+			std::shared_ptr<NeuralNetwork> net_;
+			std::vector<std::size_t> boundaries_;
+			// queues_[s] feeds stage s, the last one holds results
+			std::vector<std::unique_ptr<queue_t>> queues_;
+			std::vector<ExecutionContext> contexts_;
+			std::vector<std::thread> workers_;
+			std::atomic<bool> stop_;
+		};
+
+		inline std::size_t PipelineExecutor::Stages() const noexcept
+		{
+			return workers_.size();
+		}
+	}
+}
@@ -42,21 +42,20 @@ namespace cnn
 		public:
 			MaxPoolingLayer(kernel_size_t kernel_size,
 							 std::size_t stride);
-			void Forward(std::shared_ptr<arma::Cube<double>> input) override;
+			void Forward(std::shared_ptr<arma::Cube<double>> input,
+						 LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward2nd(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
+			const char* Type() const noexcept override;
+			bool OutputShape(arma::uword& rows, arma::uword& cols,
+							 arma::uword& slices) const noexcept override;
 		protected:
 			//void SubSample(arma::uword output_height, arma::uword output_width) noexcept override;
 
-		private:
-			// when we propagate signals from bottom to top
-			// we're using sliding window and vanishes all signals in its range except max
-			// for correct propagate local errors we should vanishes all errors for disconnected signals
-			// to reduce memory usage we may change cube to vector of vector which store bool values
-			arma::Cube<arma::uword> connectIndexes_;
-
 		};
 
 		inline BasePoolingLayer::BasePoolingLayer(kernel_size_t kernel_size,
@@ -68,5 +67,21 @@ namespace cnn
 												std::size_t stride)
 			: BasePoolingLayer(kernel_size, stride) {}
 
+		inline const char* MaxPoolingLayer::Type() const noexcept
+		{
+			return "max_pooling";
+		}
+
+		inline bool MaxPoolingLayer::OutputShape(arma::uword& rows, arma::uword& cols,
+												 arma::uword& slices) const noexcept
+		{
+			if (rows < kernel_size_.height || cols < kernel_size_.width
+				|| (rows - kernel_size_.height) % stride_ != 0
+				|| (cols - kernel_size_.width) % stride_ != 0)
+				return false;
+			rows = (rows - kernel_size_.height) / stride_ + 1;
+			cols = (cols - kernel_size_.width) / stride_ + 1;
+			return true;
+		}
 	}
 }
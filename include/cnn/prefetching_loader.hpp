@@ -0,0 +1,135 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "image_loader.hpp"
+#include <armadillo>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	struct PrefetchStats
+	{
+		// train images handed to the trainer
+		std::uint64_t served;
+		// trainer found the queue empty and waited for a worker
+		std::uint64_t consumerStalls;
+		std::chrono::microseconds consumerWait;
+		// a worker found the queue full and waited for the trainer
+		std::uint64_t producerStalls;
+		// loads failed in workers, they are retried after a growing delay
+		std::uint64_t failed;
+		// workers stopped after too many failures in a row
+		std::uint64_t deadWorkers;
+	};
+
+	// decodes train images on background threads into a bounded queue, so the
+	// trainer only pops ready images. loaders aren't thread-safe, so every worker
+	// gets its own loader from the factory; one more serves test images synchronously.
+	// many consumer stalls mean that more workers are needed, many producer
+	// stalls mean that workers are idle
+	class PrefetchingLoader final : public BaseImageLoader
+	{
+	public:
+		typedef std::function<std::unique_ptr<BaseImageLoader>()> factory_t;
+
+		// worker i seeds its loader with seed + i, so every worker draws (and
+		// augments) a reproducible sequence of samples
+		PrefetchingLoader(factory_t factory, std::size_t workers, std::size_t capacity = 64,
+		                  std::uint32_t seed = std::random_device().operator()());
+		~PrefetchingLoader();
+		PrefetchingLoader(const PrefetchingLoader&) = delete;
+		PrefetchingLoader& operator=(const PrefetchingLoader&) = delete;
+
+		bool LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                   arma::Col<double>& labels) override;
+		// blocks until a worker has an image ready.
+		// false if all workers stopped because their loaders keep failing
+		bool LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::Col<double>& labels) override;
+		const std::wstring& LabelName(std::size_t id) const override;
+		std::size_t Labels() const noexcept override;
+		// served by the test loader, it isn't used by workers
+		std::size_t TestImages() const noexcept override;
+		bool LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::uword& label) const override;
+
+		PrefetchStats Stats() const;
+		std::size_t Workers() const noexcept;
+
+	private:
+		struct Sample
+		{
+			std::shared_ptr<arma::Cube<double>> image;
+			arma::Col<double> labels;
+		};
+
+		void Run(std::size_t worker);
+
+	private:
+		// loaders_[i] belongs to worker i, the last one serves test images
+		std::vector<std::unique_ptr<BaseImageLoader>> loaders_;
+		std::size_t capacity_;
+
+		mutable std::mutex mutex_;
+		std::condition_variable notEmpty_;
+		std::condition_variable notFull_;
+		// interrupts delays of failing workers
+		std::condition_variable stopping_;
+		std::deque<Sample> queue_;
+		bool stop_;
+		// workers that haven't given up yet
+		std::size_t liveWorkers_;
+		PrefetchStats stats_;
+
+		std::mutex testMutex_;
+		std::vector<std::thread> workers_;
+	};
+
+	inline std::size_t PrefetchingLoader::Workers() const noexcept
+	{
+		return workers_.size();
+	}
+
+	inline const std::wstring& PrefetchingLoader::LabelName(std::size_t id) const
+	{
+		return loaders_.back()->LabelName(id);
+	}
+
+	inline std::size_t PrefetchingLoader::Labels() const noexcept
+	{
+		return loaders_.back()->Labels();
+	}
+
+	inline std::size_t PrefetchingLoader::TestImages() const noexcept
+	{
+		return loaders_.back()->TestImages();
+	}
+
+	inline bool PrefetchingLoader::LoadTestSample(std::size_t idx,
+	                                              std::shared_ptr<arma::Cube<double>>& dst,
+	                                              arma::uword& label) const
+	{
+		return loaders_.back()->LoadTestSample(idx, dst, label);
+	}
+}
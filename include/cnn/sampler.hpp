@@ -0,0 +1,92 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <random>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	// sampling without replacement: every epoch is a permutation of [0, size)
+	// that depends only on the seed and the epoch number. rank r of ranks takes
+	// positions r, r + ranks, ... of the permutation, so samplers of all ranks
+	// created with the same seed cover every sample exactly once per epoch and
+	// need no communication. shard sizes differ by one at most.
+	// a sampler isn't thread-safe, every worker or process owns its own one
+	class EpochSampler
+	{
+	public:
+		// empty sampler, Next() must not be called
+		EpochSampler() noexcept;
+		EpochSampler(std::size_t size, std::uint32_t seed, std::size_t rank = 0,
+		             std::size_t ranks = 1, bool shuffle = true);
+
+		// next index of the shard, the next epoch starts after the last one
+		std::size_t Next();
+		// jump to the position of the epoch, e.g. to resume training
+		void SetEpoch(std::size_t epoch, std::size_t position = 0);
+
+		std::size_t Epoch() const noexcept;
+		// indexes of the current epoch already returned
+		std::size_t Position() const noexcept;
+		std::size_t Size() const noexcept;
+		std::size_t ShardSize() const noexcept;
+		bool empty() const noexcept;
+
+	private:
+		void permute();
+
+	private:
+		std::vector<std::size_t> order_;
+		std::size_t size_;
+		std::uint32_t seed_;
+		std::size_t rank_;
+		std::size_t ranks_;
+		bool shuffle_;
+		std::size_t epoch_;
+		std::size_t position_;
+	};
+
+	// generator and sampler position of a loader as text for checkpoints
+	std::string SamplingState(const std::mt19937& gen, const EpochSampler& sampler);
+	// the sampler keeps its seed and shard, only its position is restored
+	bool SetSamplingState(const std::string& state, std::mt19937& gen, EpochSampler& sampler);
+
+	inline std::size_t EpochSampler::Epoch() const noexcept
+	{
+		return epoch_;
+	}
+
+	inline std::size_t EpochSampler::Position() const noexcept
+	{
+		return position_;
+	}
+
+	inline std::size_t EpochSampler::Size() const noexcept
+	{
+		return size_;
+	}
+
+	inline std::size_t EpochSampler::ShardSize() const noexcept
+	{
+		return order_.size();
+	}
+
+	inline bool EpochSampler::empty() const noexcept
+	{
+		return order_.empty();
+	}
+}
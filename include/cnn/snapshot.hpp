@@ -0,0 +1,69 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "model_file.hpp"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <cstddef>
+
+namespace cnn
+{
+	// writes model files of network weights on a background thread.
+	// Write only copies weights to one of two buffers and returns, the thread
+	// saves them with nn::SaveModel. Write waits only if both buffers are still taken
+	class SnapshotWriter
+	{
+	public:
+		// keep the last keep snapshots and remove older ones, 0 keeps all
+		explicit SnapshotWriter(std::size_t keep = 0);
+		// finishes pending snapshots
+		~SnapshotWriter();
+		SnapshotWriter(const SnapshotWriter&) = delete;
+		SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+		void Write(const nn::NeuralNetwork& net, const std::wstring& path);
+		// waits until every snapshot is written
+		void Flush();
+
+		void SetKeep(std::size_t keep);
+		std::size_t Written() const;
+		std::size_t Failed() const;
+
+	private:
+		struct Job
+		{
+			std::size_t buffer;
+			std::wstring path;
+		};
+
+		void Run();
+
+	private:
+		nn::ModelSnapshot buffers_[2];
+		bool used_[2];
+		std::deque<Job> jobs_;
+		// written snapshots, the oldest first
+		std::deque<std::wstring> kept_;
+		std::size_t keep_;
+		std::size_t written_;
+		std::size_t failed_;
+		bool stop_;
+		mutable std::mutex mutex_;
+		std::condition_variable changed_;
+		std::thread thread_;
+	};
+}
@@ -23,13 +23,19 @@ namespace cnn
 		{
 		public:
 			SoftMaxLayer(arma::uword in, arma::uword out);
-			void Forward(std::shared_ptr<arma::Cube<double>> input) override;
+			void Forward(std::shared_ptr<arma::Cube<double>> input,
+						 LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
 			std::pair<tensor4d, tensor4d> Backward2nd(
-				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss) override;
+				const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+				LayerContext& ctx) const override;
+			const char* Type() const noexcept override;
+			bool OutputShape(arma::uword& rows, arma::uword& cols,
+							 arma::uword& slices) const noexcept override;
 		private:
-			void ComputeOutput() const;
+			void ComputeOutput(LayerContext& ctx) const;
 		};
 
 		inline SoftMaxLayer::SoftMaxLayer(arma::uword in, arma::uword out)
@@ -38,17 +44,34 @@ namespace cnn
 			biasWeights_ = tensor4d(out, 1, 1, 1);
 		}
 
-		inline void SoftMaxLayer::ComputeOutput() const
+		inline void SoftMaxLayer::ComputeOutput(LayerContext& ctx) const
 		{
-			double maxVal = receptiveField_->slice(0).col(0).max();
+			double maxVal = ctx.receptiveField->slice(0).col(0).max();
 			double denominator = arma::sum<arma::Col<double>>(
-				arma::exp(receptiveField_->slice(0).col(0) - maxVal));		
+				arma::exp(ctx.receptiveField->slice(0).col(0) - maxVal));		
 			
 			double numerator;
-			for (arma::uword r = 0; r < receptiveField_->n_rows; ++r) {
-				numerator = std::exp((*receptiveField_)(r, 0, 0) - maxVal);
-				(*output_)(r, 0, 0) = numerator / denominator;
+			for (arma::uword r = 0; r < ctx.receptiveField->n_rows; ++r) {
+				numerator = std::exp((*ctx.receptiveField)(r, 0, 0) - maxVal);
+				(*ctx.output)(r, 0, 0) = numerator / denominator;
 			}
 		}
+
+		inline const char* SoftMaxLayer::Type() const noexcept
+		{
+			return "softmax";
+		}
+
+		inline bool SoftMaxLayer::OutputShape(arma::uword& rows, arma::uword& cols,
+												arma::uword& slices) const noexcept
+		{
+			// the input is flattened to one column
+			if (rows * cols * slices != weights_.n_rows)
+				return false;
+			rows = weights_.n_cols;
+			cols = 1;
+			slices = 1;
+			return true;
+		}
 	}
 }
\ No newline at end of file
@@ -14,7 +14,12 @@
 #pragma once
 #include "util.hpp"
 #include "neural_network.hpp"
+#include "distributed.hpp"
+#include "snapshot.hpp"
+#include "checkpoint.hpp"
+#include "evaluator.hpp"
 #include <memory>
+#include <vector>
 
 namespace cnn
 {
@@ -33,6 +38,42 @@ namespace cnn
 					   std::wstring snapshot_prefix = L"");
 			virtual ~BaseSolver() = default;
 			virtual void Solve() = 0;
+			// keep only the last keep snapshots, 0 keeps all
+			void SetSnapshotKeep(std::size_t keep);
+			// write "<prefix>_<epoch>.ckpt" every interval epochs, 0 disables checkpoints.
+			// every full_interval-th checkpoint is full, the others are deltas to it.
+			// checkpoints need a loader with state (see BaseImageLoader::State),
+			// they are disabled with a message otherwise. the state of an LfwLoader
+			// with async reading is ahead by the reads in flight, a resumed run
+			// skips up to that many images
+			void SetCheckpoints(std::wstring prefix, arma::uword interval,
+			                    arma::uword full_interval = 5);
+			// restore weights, solver and loader state, Solve continues
+			// with the epoch after the checkpoint
+			bool Resume(const std::wstring& path);
+			// test evaluations run on the evaluator while training goes on
+			// instead of serial forward passes in the training loop
+			void SetEvaluator(std::shared_ptr<Evaluator> evaluator);
+			// evaluator results reported so far
+			const std::vector<EvaluationResult>& Evaluations() const noexcept;
+		protected:
+			// snapshots are written in the background while training goes on
+			void Snapshot(arma::uword epoch);
+			// wait for pending snapshots and report failed ones
+			void FlushSnapshots();
+			// writes a checkpoint if epoch is a multiple of the checkpoint interval
+			void Checkpoint(arma::uword epoch);
+			// evaluates test_size_ test images if epoch is a multiple of test_interval_
+			void Test(arma::uword epoch);
+			// print finished evaluations, wait for all of them if flush is set
+			void ReportEvaluations(bool flush = false);
+			// solvers with own state (e.g. hessian estimates) extend these.
+			// RestoreState checks the whole state before anything is changed
+			virtual void SaveState(TrainingState& state);
+			virtual bool RestoreState(const TrainingState& state);
+			// index of this process' loader state in checkpoints
+			virtual std::size_t Rank() const noexcept;
+
 		protected:
 			std::shared_ptr<nn::NeuralNetwork> net_;
 			std::wstring snapshot_prefix_;
@@ -49,6 +90,21 @@ namespace cnn
 			// write to file every snapshot_interval epoches
 			arma::uword snapshot_interval_;
 
+			SnapshotWriter snapshots_;
+			std::size_t reportedFailures_;
+
+			// the first epoch of Solve, not zero after Resume
+			arma::uword start_epoch_;
+			std::wstring checkpoint_prefix_;
+			arma::uword checkpoint_interval_;
+			arma::uword checkpoint_full_interval_;
+			// the last full checkpoint, deltas are made against it
+			TrainingState checkpointBase_;
+			std::wstring checkpointBasePath_;
+			arma::uword checkpointDeltas_;
+
+			std::shared_ptr<Evaluator> evaluator_;
+			std::vector<EvaluationResult> evaluations_;
 		};
 
 		class SgdSolver final : public BaseSolver
@@ -81,11 +137,43 @@ namespace cnn
 
 
 			void Solve() override;
+		protected:
+			void SaveState(TrainingState& state) override;
+			bool RestoreState(const TrainingState& state) override;
 		private:
 			// Levenberg–Marquardt hyperparameters
 			double mu_;
 			// smth like momentum for computing diagonal hessian
 			double gamma_;
+			// running hessian estimate, empty before the first epoch
+			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> old_hessian_;
+		};
+
+		// data-parallel sgd: every worker process computes gradient on its own
+		// batch and loader shard, gradients are averaged with ring all-reduce
+		class DistributedSgdSolver final : public BaseSolver
+		{
+		public:
+			DistributedSgdSolver(std::shared_ptr<nn::NeuralNetwork> network,
+								 std::shared_ptr<distributed::BaseTransport> transport,
+								 arma::uword batch_size, double learning_rate,
+								 arma::uword max_epoch, arma::uword test_interval,
+								 arma::uword test_size, arma::uword snapshot_interval,
+								 std::wstring snapshot_prefix = L"")
+				: BaseSolver(network, batch_size, learning_rate, max_epoch,
+							 test_interval, test_size, snapshot_interval, snapshot_prefix),
+				transport_(transport) {}
+
+			void Solve() override;
+		protected:
+			// checkpoints hold the loader states of all workers, so that every
+			// worker continues with its own generator
+			void SaveState(TrainingState& state) override;
+			std::size_t Rank() const noexcept override;
+		private:
+			std::shared_ptr<distributed::BaseTransport> transport_;
+			// gathered from all workers before a checkpoint
+			std::vector<std::string> loaderStates_;
 		};
 
 		inline 
@@ -97,11 +185,45 @@ namespace cnn
 			: net_(network), batch_size_(batch_size), learning_rate_(learning_rate),
 			max_epoch_(max_epoch), test_interval_(test_interval),
 			test_size_(test_size), snapshot_interval_(snapshot_interval),
-			snapshot_prefix_(snapshot_prefix)
+			snapshot_prefix_(snapshot_prefix), reportedFailures_(0), start_epoch_(0),
+			checkpoint_interval_(0), checkpoint_full_interval_(1), checkpointDeltas_(0)
 		{
 			
 		}
 
+		inline std::size_t BaseSolver::Rank() const noexcept
+		{
+			return 0;
+		}
+
+		inline std::size_t DistributedSgdSolver::Rank() const noexcept
+		{
+			return transport_->Rank();
+		}
+
+		inline void BaseSolver::SetSnapshotKeep(std::size_t keep)
+		{
+			snapshots_.SetKeep(keep);
+		}
+
+		inline void BaseSolver::SetCheckpoints(std::wstring prefix, arma::uword interval,
+		                                       arma::uword full_interval)
+		{
+			checkpoint_prefix_ = std::move(prefix);
+			checkpoint_interval_ = interval;
+			checkpoint_full_interval_ = full_interval;
+		}
+
+		inline void BaseSolver::SetEvaluator(std::shared_ptr<Evaluator> evaluator)
+		{
+			evaluator_ = std::move(evaluator);
+		}
+
+		inline const std::vector<EvaluationResult>& BaseSolver::Evaluations() const noexcept
+		{
+			return evaluations_;
+		}
+
 		inline 
 		SdlmSolver::SdlmSolver(std::shared_ptr<nn::NeuralNetwork> network,
 							   arma::uword batch_size, double learning_rate,
@@ -0,0 +1,87 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <cstddef>
+
+namespace cnn
+{
+	// bounded lock-free queue for exactly one producer thread and one consumer thread
+	template <typename T>
+	class SpscQueue
+	{
+	public:
+		explicit SpscQueue(std::size_t capacity);
+		SpscQueue(const SpscQueue&) = delete;
+		SpscQueue& operator=(const SpscQueue&) = delete;
+
+		// returns false if the queue is full, item is left untouched then
+		bool TryPush(T&& item);
+		// returns false if the queue is empty
+		bool TryPop(T& item);
+		bool Empty() const noexcept;
+		std::size_t Capacity() const noexcept;
+
+	private:
+		// one extra cell distinguishes full queue from empty one
+		std::vector<T> buffer_;
+		// head_ is written only by consumer, tail_ only by producer.
+		// keep them on different cache lines to avoid false sharing
+		alignas(64) std::atomic<std::size_t> head_;
+		alignas(64) std::atomic<std::size_t> tail_;
+	};
+
+	template <typename T>
+	SpscQueue<T>::SpscQueue(std::size_t capacity)
+		: buffer_(capacity + 1), head_(0), tail_(0)
+	{
+	}
+
+	template <typename T>
+	bool SpscQueue<T>::TryPush(T&& item)
+	{
+		std::size_t tail = tail_.load(std::memory_order_relaxed);
+		std::size_t next = tail + 1 == buffer_.size() ? 0 : tail + 1;
+		if (next == head_.load(std::memory_order_acquire))
+			return false;
+		buffer_[tail] = std::move(item);
+		tail_.store(next, std::memory_order_release);
+		return true;
+	}
+
+	template <typename T>
+	bool SpscQueue<T>::TryPop(T& item)
+	{
+		std::size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return false;
+		item = std::move(buffer_[head]);
+		head_.store(head + 1 == buffer_.size() ? 0 : head + 1, std::memory_order_release);
+		return true;
+	}
+
+	template <typename T>
+	bool SpscQueue<T>::Empty() const noexcept
+	{
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+
+	template <typename T>
+	std::size_t SpscQueue<T>::Capacity() const noexcept
+	{
+		return buffer_.size() - 1;
+	}
+}
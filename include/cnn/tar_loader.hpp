@@ -0,0 +1,157 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "image_loader.hpp"
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <opencv2/core.hpp>
+#include <armadillo>
+#include <array>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+namespace cnn
+{
+	struct TarLoaderOptions
+	{
+		// stream buffer of every open shard, shards are read sequentially
+		std::size_t buffer_size = 4 << 20;
+		// train members a random one is taken from. the buffer keeps their
+		// encoded bytes (about 10-20 KB per jpeg face image) and decodes the
+		// taken one only
+		std::size_t shuffle_buffer = 1024;
+		// visit train shards in a new random order every epoch
+		bool shuffle_shards = true;
+		// crop before scaling, empty means the whole image
+		cv::Rect roi = cv::Rect();
+	};
+
+	// streams images from tar shards (ustar, gnu and pax archives) instead of
+	// opening every small file. a member "<path>/<folder>/<file>" belongs to the
+	// folder: train images get label i + 1 of the i-th folder of the train list
+	// (the LfwLoader list format), other folders and every test image are label 0.
+	// members which aren't images are skipped
+	class TarLoader final : public BaseImageLoader
+	{
+	public:
+		TarLoader(const std::vector<std::wstring>& trainShards,
+		          const std::vector<std::wstring>& testShards,
+		          const std::wstring& trainPath, cv::Size scaleSize,
+		          const TarLoaderOptions& options = TarLoaderOptions());
+
+		bool LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                   arma::Col<double>& labels) override;
+		bool LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+		                    arma::Col<double>& labels) override;
+		const std::wstring& LabelName(std::size_t id) const override;
+		std::size_t Labels() const noexcept override;
+		void Seed(std::uint32_t seed) override;
+
+		// per channel (BGR) normalization of images scaled to [0, 1]
+		void SetNormalization(const std::array<double, 3>& mean,
+		                      const std::array<double, 3>& stddev);
+		bool is_open() const noexcept;
+		// completed passes over the train shards
+		std::size_t Epochs() const noexcept;
+
+	private:
+		// a member which may be an image
+		struct Sample
+		{
+			std::vector<unsigned char> data;
+			std::uint32_t label;
+		};
+
+		struct Stream
+		{
+			std::vector<boost::filesystem::path> shards;
+			std::vector<std::size_t> order;
+			std::size_t next;
+			// an image was decoded since the first shard of the pass was opened.
+			// train members are decoded later, so it may lag behind the pass
+			bool produced;
+			std::size_t epochs;
+			boost::filesystem::ifstream file;
+			// size of the open shard, members can't be larger
+			std::uint64_t length;
+			std::vector<char> buffer;
+		};
+
+		void initStream(Stream& stream, const std::vector<std::wstring>& shards);
+		// next member of the stream, passes go on forever.
+		// false if a whole pass has no images
+		bool readSample(Stream& stream, bool test, Sample& sample);
+		// decodes the member and marks the pass of the stream as productive
+		bool decodeSample(Stream& stream, const Sample& sample,
+		                  std::shared_ptr<arma::Cube<double>>& dst);
+		// next regular file of the shard whose size is length.
+		// false at the end of the archive or if a header is damaged
+		static bool readMember(std::istream& in, std::uint64_t length, std::string& name,
+		                       std::vector<unsigned char>& data);
+		bool decode(const std::vector<unsigned char>& data, arma::Cube<double>& dst) const;
+		std::uint32_t labelOf(const std::string& name) const;
+		void setLabels(std::uint32_t label, arma::Col<double>& labels) const;
+
+	private:
+		Stream train_;
+		Stream test_;
+		std::vector<Sample> shuffle_;
+		std::vector<std::wstring> labels_;
+		std::unordered_map<std::wstring, std::uint32_t> labelIds_;
+		cv::Size scaleSize_;
+		TarLoaderOptions options_;
+		ImageConverter converter_;
+		bool open_;
+		std::mt19937 gen_;
+	};
+
+	inline const std::wstring& TarLoader::LabelName(std::size_t id) const
+	{
+#ifndef NDEBUG
+		assert(id < labels_.size());
+#endif
+		return labels_[id];
+	}
+
+	inline std::size_t TarLoader::Labels() const noexcept
+	{
+		return labels_.size();
+	}
+
+	inline void TarLoader::Seed(std::uint32_t seed)
+	{
+		gen_.seed(seed);
+	}
+
+	inline void TarLoader::SetNormalization(const std::array<double, 3>& mean,
+	                                        const std::array<double, 3>& stddev)
+	{
+		converter_ = ImageConverter(mean, stddev);
+	}
+
+	inline bool TarLoader::is_open() const noexcept
+	{
+		return open_;
+	}
+
+	inline std::size_t TarLoader::Epochs() const noexcept
+	{
+		return train_.epochs;
+	}
+}
@@ -0,0 +1,109 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include "neural_network.hpp"
+#include "thread_pool.hpp"
+#include <armadillo>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace cnn
+{
+	namespace evaluation
+	{
+		struct EvaluationOptions
+		{
+			// inference threads, every thread has its own execution context.
+			// 0 means one per hardware core
+			std::size_t threads = 0;
+			// a sample is a top-k hit if its label is among the k highest scores
+			std::size_t top_k = 5;
+			// test images taken by a thread at once
+			std::size_t chunk = 16;
+		};
+
+		struct ClassReport
+		{
+			// test images of the class
+			std::size_t support;
+			// test images predicted as the class
+			std::size_t predicted;
+			std::size_t correct;
+			// 0 if the class has no predictions or no images
+			double precision;
+			double recall;
+		};
+
+		struct TestSetReport
+		{
+			// test images of the loader
+			std::size_t images;
+			std::size_t evaluated;
+			// images which couldn't be loaded or have a label out of the hypothesis
+			std::size_t failed;
+			double seconds;
+			// mean cost over evaluated images
+			double loss;
+			double accuracy;
+			std::size_t top_k;
+			double top_k_accuracy;
+			// rows are true labels, columns are top-1 predictions
+			arma::Mat<arma::uword> confusion;
+			std::vector<ClassReport> classes;
+		};
+
+		// counts of one pass over samples, see EvaluateSamples
+		struct Tally
+		{
+			std::size_t evaluated = 0;
+			// samples which couldn't be loaded, threw or have a label out of the hypothesis
+			std::size_t failed = 0;
+			// sum of costs
+			double loss = 0.0;
+			std::size_t top1 = 0;
+			std::size_t top_k = 0;
+			// rows are true labels, columns are top-1 predictions
+			arma::Mat<arma::uword> confusion;
+
+			void Merge(const Tally& other);
+		};
+
+		// sets the input of ctx to sample idx and its label index to label.
+		// it's called from all threads of the pool at once
+		typedef std::function<bool(std::size_t idx, nn::ExecutionContext& ctx,
+		                           arma::uword& label)> sample_loader_t;
+
+		// evaluates samples [0, amount) on the threads of pool, contexts[i] belongs
+		// to thread i. threads take chunk samples at once, weights must not be
+		// changed meanwhile. both the test set report and Evaluator use it
+		Tally EvaluateSamples(const nn::NeuralNetwork& net, ThreadPool& pool,
+		                      std::vector<nn::ExecutionContext>& contexts, std::size_t amount,
+		                      const sample_loader_t& load, std::size_t top_k,
+		                      std::size_t chunk = 16);
+
+		// run every test image of the network loader once, see
+		// BaseImageLoader::LoadTestSample. weights must not be changed meanwhile
+		TestSetReport EvaluateTestSet(const nn::NeuralNetwork& net,
+		                              const EvaluationOptions& options = EvaluationOptions());
+		// the report with label names of the network as a JSON object.
+		// labels without a name in the loader get null, so do non-finite values
+		bool WriteJson(const nn::NeuralNetwork& net, const TestSetReport& report,
+		               const std::wstring& path);
+
+		std::ostream& operator<<(std::ostream& os, const TestSetReport& report);
+	}
+}
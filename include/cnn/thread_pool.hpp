@@ -0,0 +1,58 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstddef>
+
+namespace cnn
+{
+	// fixed amount of threads executing tasks in FIFO order.
+	// a task gets the index of the thread running it, so callers may keep
+	// per-thread state (e.g. execution contexts) without locking
+	class ThreadPool
+	{
+	public:
+		typedef std::function<void(std::size_t worker)> task_t;
+
+		// threads == 0 means one thread per hardware core
+		explicit ThreadPool(std::size_t threads = 0);
+		// finishes queued tasks and joins threads
+		~ThreadPool();
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+
+		void Post(task_t task);
+		std::size_t Size() const noexcept;
+
+	private:
+		void Run(std::size_t worker);
+
+	private:
+		std::mutex mutex_;
+		std::condition_variable ready_;
+		std::deque<task_t> tasks_;
+		bool stop_;
+		std::vector<std::thread> workers_;
+	};
+
+	inline std::size_t ThreadPool::Size() const noexcept
+	{
+		return workers_.size();
+	}
+}
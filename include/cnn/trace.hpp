@@ -0,0 +1,93 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+
+// CNN_TRACE_SCOPE(name, category[, index]) records the enclosing scope as one
+// event while tracing is started. name and category must outlive the trace,
+// e.g. string literals. without CNN_ENABLE_TRACING the macro expands to nothing,
+// so instrumented code has no overhead in regular builds
+#ifdef CNN_ENABLE_TRACING
+#define CNN_TRACE_CONCAT_IMPL(a, b) a##b
+#define CNN_TRACE_CONCAT(a, b) CNN_TRACE_CONCAT_IMPL(a, b)
+#define CNN_TRACE_SCOPE(...) \
+	::cnn::trace::Scope CNN_TRACE_CONCAT(cnn_trace_scope_, __LINE__)(__VA_ARGS__)
+#else
+#define CNN_TRACE_SCOPE(...)
+#endif
+
+namespace cnn
+{
+	namespace trace
+	{
+		typedef std::chrono::steady_clock clock;
+
+		// events of every thread are kept in memory from Start until Clear
+		void Start();
+		void Stop();
+		bool Enabled() noexcept;
+		void Clear();
+		// chrome trace event format, it may be opened in chrome://tracing or Perfetto
+		bool WriteChromeTrace(const std::wstring& path);
+
+		// index < 0 means that the event has no index (e.g. of a layer).
+		// events are dropped if there is no memory for them
+		void Record(const char* name, const char* category, std::int64_t index,
+		            clock::time_point begin, clock::time_point end) noexcept;
+
+		class Scope
+		{
+		public:
+			Scope(const char* name, const char* category, std::int64_t index = -1) noexcept;
+			~Scope();
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+
+		private:
+			const char* name_;
+			const char* category_;
+			std::int64_t index_;
+			bool enabled_;
+			clock::time_point begin_;
+		};
+
+		namespace detail
+		{
+			extern std::atomic<bool> enabled;
+		}
+
+		inline bool Enabled() noexcept
+		{
+			return detail::enabled.load(std::memory_order_relaxed);
+		}
+
+		inline Scope::Scope(const char* name, const char* category, std::int64_t index) noexcept
+			: name_(name), category_(category), index_(index), enabled_(Enabled())
+		{
+			if (enabled_) {
+				begin_ = clock::now();
+			}
+		}
+
+		inline Scope::~Scope()
+		{
+			if (enabled_) {
+				Record(name_, category_, index_, begin_, clock::now());
+			}
+		}
+	}
+}
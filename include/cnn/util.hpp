@@ -16,6 +16,7 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/highgui.hpp>
 #include <armadillo>
+#include <array>
 #include <vector>
 #include <cstdint>
 #include "assert.h"
@@ -71,13 +72,13 @@ namespace cnn
 
 	inline tensor4d::tensor4d(const tensor4d& item)
 		: data(item.data),
-		n_rows(item.n_rows), n_cols(item.n_cols), n_slices(item.n_cols), n_size(item.n_cols)
+		n_rows(item.n_rows), n_cols(item.n_cols), n_slices(item.n_slices), n_size(item.n_size)
 	{
 	}
 
 	inline tensor4d::tensor4d(tensor4d&& item)
 		: data(std::move(item.data)), 
-		n_rows(item.n_rows), n_cols(item.n_cols), n_slices(item.n_cols), n_size(item.n_cols)
+		n_rows(item.n_rows), n_cols(item.n_cols), n_slices(item.n_slices), n_size(item.n_size)
 	{}
 
 	inline tensor4d& tensor4d::operator=(const tensor4d& item)
@@ -85,8 +86,8 @@ namespace cnn
 		data = item.data;
 		n_rows = item.n_rows;
 		n_cols = item.n_cols;
-		n_slices = item.n_cols;
-		n_size = item.n_cols;
+		n_slices = item.n_slices;
+		n_size = item.n_size;
 		return *this;
 	}
 
@@ -95,13 +96,13 @@ namespace cnn
 		data= std::move(item.data);
 		n_rows = item.n_rows;
 		n_cols = item.n_cols;
-		n_slices = item.n_cols;
-		n_size = item.n_cols;
+		n_slices = item.n_slices;
+		n_size = item.n_size;
 
 		item.n_rows = 0;
 		item.n_cols = 0;
-		item.n_cols = 0;
-		item.n_cols = 0;
+		item.n_slices = 0;
+		item.n_size = 0;
 		return *this;
 	}
 
@@ -112,5 +113,48 @@ namespace cnn
 
 	//convert cv mat with 3 channels to arma cube
 	arma::Cube<double> cvMat2armaCube(const cv::Mat& src);
+	// same as above but writes to existing cube of size (src.cols, src.rows, 3),
+	// e.g. to a part of a larger buffer
+	void cvMat2armaCube(const cv::Mat& src, arma::Cube<double>& dst);
 	cv::Mat armaMat2cvMat(const arma::Mat<double> &src);
+
+	// one-pass conversion of 8-bit BGR images to normalized planar cubes.
+	// channel c of the result is (pixel / 255 - mean[c]) / stddev[c], channels
+	// are in BGR order and the cube has cvMat2armaCube layout (src.cols, src.rows, 3).
+	// every possible byte value is converted once in the constructor, so the
+	// conversion is one table lookup per value without temporary images
+	class ImageConverter
+	{
+	public:
+		ImageConverter(const std::array<double, 3>& mean = { { 0.0, 0.0, 0.0 } },
+		               const std::array<double, 3>& stddev = { { 1.0, 1.0, 1.0 } });
+		// same normalization after color jitter: pixel values x in [0, 1]
+		// become clamp((x - 0.5) * contrast + 0.5 + brightness, 0, 1) first
+		ImageConverter(const ImageConverter& base, double contrast, double brightness);
+
+		// gray, BGR or BGRA images of any depth. 16 and 32 bit integer images
+		// are scaled by their range, floating point ones are taken as [0, 1].
+		// dst is resized only if its size is wrong
+		void Convert(const cv::Mat& src, arma::Cube<double>& dst) const;
+		const std::array<double, 3>& Mean() const noexcept;
+		const std::array<double, 3>& StdDev() const noexcept;
+
+	private:
+		void fill(double contrast, double brightness);
+
+	private:
+		std::array<double, 3> mean_;
+		std::array<double, 3> stddev_;
+		double lut_[3][256];
+	};
+
+	inline const std::array<double, 3>& ImageConverter::Mean() const noexcept
+	{
+		return mean_;
+	}
+
+	inline const std::array<double, 3>& ImageConverter::StdDev() const noexcept
+	{
+		return stddev_;
+	}
 }
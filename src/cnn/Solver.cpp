@@ -13,6 +13,7 @@
 // limitations under the License.
 #include "solver.hpp"
 #include "util.hpp"
+#include "trace.hpp"
 #include <boost/format.hpp>
 #include <boost/filesystem.hpp>
 #include <iostream>
@@ -21,6 +22,134 @@ namespace cnn
 {
 	namespace solver
 	{
+		void BaseSolver::Snapshot(arma::uword epoch)
+		{
+			std::wstring path = snapshot_prefix_ + (boost::wformat(L"_%1%.model") % epoch).str();
+			snapshots_.Write(*net_, path);
+			std::size_t failed = snapshots_.Failed();
+			if (failed != reportedFailures_) {
+				reportedFailures_ = failed;
+				std::cout << "cannot save weights to file\n";
+			}
+		}
+
+		void BaseSolver::FlushSnapshots()
+		{
+			snapshots_.Flush();
+			if (snapshots_.Failed() != reportedFailures_) {
+				reportedFailures_ = snapshots_.Failed();
+				std::cout << "cannot save weights to file\n";
+			}
+		}
+
+		void BaseSolver::Checkpoint(arma::uword epoch)
+		{
+			if (checkpoint_interval_ == 0 || epoch % checkpoint_interval_ != 0)
+				return;
+			// a resumed run wouldn't get the same images
+			if (net_->LoaderState().empty()) {
+				std::cout << "loader has no state, checkpoints are disabled\n";
+				checkpoint_interval_ = 0;
+				return;
+			}
+			TrainingState state;
+			state.epoch = epoch;
+			SaveState(state);
+			std::wstring path = checkpoint_prefix_ + (boost::wformat(L"_%1%.ckpt") % epoch).str();
+			bool full = checkpointBase_.weights.empty()
+				|| checkpointDeltas_ + 1 >= checkpoint_full_interval_;
+			if (full) {
+				if (!WriteCheckpoint(path, state)) {
+					std::cout << "cannot save checkpoint to file\n";
+					return;
+				}
+				checkpointBase_ = std::move(state);
+				checkpointBasePath_ = path;
+				checkpointDeltas_ = 0;
+			} else {
+				if (!WriteCheckpoint(path, state, checkpointBase_, checkpointBasePath_)) {
+					std::cout << "cannot save checkpoint to file\n";
+					return;
+				}
+				++checkpointDeltas_;
+			}
+		}
+
+		void BaseSolver::SaveState(TrainingState& state)
+		{
+			distributed::FlattenWeights(*net_, state.weights);
+			state.loaders.assign(1, net_->LoaderState());
+		}
+
+		bool BaseSolver::RestoreState(const TrainingState& state)
+		{
+			std::vector<double> current;
+			distributed::FlattenWeights(*net_, current);
+			// a checkpoint of fewer workers has no state for this one
+			if (current.size() != state.weights.size() || Rank() >= state.loaders.size())
+				return false;
+			// the loader checks its state while setting it, the weights can't fail after that
+			if (!net_->SetLoaderState(state.loaders[Rank()]))
+				return false;
+			distributed::UnflattenWeights(state.weights, *net_);
+			return true;
+		}
+
+		bool BaseSolver::Resume(const std::wstring& path)
+		{
+#ifndef NDEBUG
+			assert(net_->is_initialized());
+#endif
+			TrainingState state;
+			if (!ReadCheckpoint(path, state) || !RestoreState(state))
+				return false;
+			start_epoch_ = state.epoch;
+			// the next checkpoint is full, the old base may belong to another run
+			checkpointBase_ = TrainingState();
+			checkpointBasePath_.clear();
+			checkpointDeltas_ = 0;
+			return true;
+		}
+
+		void BaseSolver::Test(arma::uword epoch)
+		{
+			if (test_interval_ == 0 || epoch % test_interval_ != 0)
+				return;
+			if (evaluator_) {
+				evaluator_->Submit(*net_, epoch, test_size_);
+				return;
+			}
+			std::cout << boost::format(
+				"compute error on test dataset for %1% samples on %2% training epoches..."
+			) % test_size_ % epoch << "\n";
+
+			// compute error on test data-set
+			double error = 0.0;
+			for (arma::uword i = 0; i < test_size_; ++i) {
+				net_->LoadTestImage();
+				net_->Forward();
+				error += net_->Error();
+			}
+			error /= test_size_;
+			std::cout << "test error = " << error << "\n";
+		}
+
+		void BaseSolver::ReportEvaluations(bool flush)
+		{
+			if (!evaluator_)
+				return;
+			if (flush) {
+				evaluator_->Flush();
+			}
+			for (EvaluationResult& result : evaluator_->Results()) {
+				std::cout << boost::format(
+					"test error on %1% training epoches = %2%, top-1 = %3%, top-5 = %4% (%5% samples, %6% failed)"
+				) % result.epoch % result.loss % result.top1 % result.top5 % result.samples
+					% result.failed << "\n";
+				evaluations_.emplace_back(std::move(result));
+			}
+		}
+
 		void SgdSolver::Solve()
 		{
 			using namespace arma;
@@ -29,7 +158,9 @@ namespace cnn
 #endif
 			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> gradient;
 			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> iter_gradient;
-			for (uword epoch = 0; epoch < max_epoch_; ++epoch) {
+			for (uword epoch = start_epoch_; epoch < max_epoch_; ++epoch) {
+				CNN_TRACE_SCOPE("epoch", "solver", epoch);
+				ReportEvaluations();
 				double error = 0.0;
 				net_->LoadTrainImage();
 				net_->Forward();
@@ -70,6 +201,7 @@ namespace cnn
 				std::cout << "training error = " << error << "\n";
 				std::cout << "update weights...\n";
 				for (std::size_t n = 0; n < gradient.size(); ++n) {
+					CNN_TRACE_SCOPE("update_weights", "solver", n);
 					cnn::tensor4d& weigths = net_->Weights(n);
 					cnn::tensor4d& bias_weigths = net_->BiasWeights(n);
 					for (uword item = 0; item < weigths.data.size(); ++item) {
@@ -96,18 +228,13 @@ namespace cnn
 				}
 
 				if (snapshot_interval_ != 0 && (epoch + 1) % snapshot_interval_ == 0) {
-					boost::filesystem::ofstream out;
-					std::wstring path = snapshot_prefix_ + (boost::wformat(L"_%1%.dat") 
-															% (epoch + 1)).str();
-					out.open(path, std::ios::binary);
-					if (!out.is_open()) {
-						std::cout << "cannot save weights to file\n";
-					} else {
-						net_->SaveWeights(out);
-						out.close();
-					}
+					Snapshot(epoch + 1);
 				}
+				Checkpoint(epoch + 1);
+				Test(epoch + 1);
 			}
+			FlushSnapshots();
+			ReportEvaluations(true);
 		}
 
 		void SdlmSolver::Solve()
@@ -120,25 +247,11 @@ namespace cnn
 			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> iter_gradient;
 			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> current_hessian;
 			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> new_hessian;
-			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> old_hessian;
 			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> iter_hessian;
-			for (uword epoch = 0; epoch < max_epoch_; ++epoch) {
+			for (uword epoch = start_epoch_; epoch < max_epoch_; ++epoch) {
+				CNN_TRACE_SCOPE("epoch", "solver", epoch);
+				ReportEvaluations();
 				double error = 0.0;
-				if (test_interval_ != 0 && (epoch + 1) % test_interval_ == 0) {
-					std::cout << boost::format(
-						"compute error on test dataset for %1% samples on %2% training epoches..."
-					) % test_size_ % (epoch + 1) << "\n";
-
-					// compute error on test data-set
-					for (uword i = 0; i < test_size_; ++i) {
-						net_->LoadTestImage();
-						net_->Forward();
-						error += net_->Error();
-					}
-					error /= test_size_;
-					std::cout << "test error = " << error << "\n";
-				}
-				error = 0.0;
 				net_->LoadTrainImage();
 				net_->Forward();
 				error += net_->Error();
@@ -185,25 +298,26 @@ namespace cnn
 				std::cout << "training error = " << error << "\n";
 				std::cout << "update weights...\n";
 				new_hessian = std::move(current_hessian);
-				if (!old_hessian.empty()) {
+				if (!old_hessian_.empty()) {
 					// new_hessian = (1 - gamma) % old_hessian + gamma % new_hessian
 					for (std::size_t n = 0; n < new_hessian.size(); ++n) {
 						// weights
 						for (uword item = 0; item < new_hessian[n].first.data.size(); ++item) {
 							new_hessian[n].first.data[item]
-									= (1 - gamma_) * old_hessian[n].first.data[item]
+									= (1 - gamma_) * old_hessian_[n].first.data[item]
 									+ gamma_ * new_hessian[n].first.data[item];
 						}
 						//biases
 						for (uword item = 0; item < new_hessian[n].second.data.size(); ++item) {
 							new_hessian[n].second.data[item]
-									= (1 - gamma_) * old_hessian[n].second.data[item]
+									= (1 - gamma_) * old_hessian_[n].second.data[item]
 									+ gamma_ * new_hessian[n].second.data[item];
 						}
 					}
 				}
 				// found optimal learning rate for all weights and update in-place
 				for (std::size_t n = 0; n < new_hessian.size(); ++n) {
+					CNN_TRACE_SCOPE("update_weights", "solver", n);
 					cnn::tensor4d& weigths = net_->Weights(n);
 					cnn::tensor4d& bias_weigths = net_->BiasWeights(n);
 					double local_learning_rate;
@@ -234,21 +348,143 @@ namespace cnn
 					}
 
 				}
-				old_hessian = std::move(new_hessian);
+				old_hessian_ = std::move(new_hessian);
 
 				if (snapshot_interval_ != 0 && (epoch + 1) % snapshot_interval_ == 0) {
-					boost::filesystem::ofstream out;
-					std::wstring path = snapshot_prefix_ + (boost::wformat(L"_%1%.dat")
-															% (epoch + 1)).str();
-					out.open(path, std::ios::binary);
-					if (!out.is_open()) {
-						std::cout << "cannot save weights to file\n";
-					} else {
-						net_->SaveWeights(out);
-						out.close();
+					Snapshot(epoch + 1);
+				}
+				Checkpoint(epoch + 1);
+				Test(epoch + 1);
+			}
+			FlushSnapshots();
+			ReportEvaluations(true);
+		}
+
+		void SdlmSolver::SaveState(TrainingState& state)
+		{
+			BaseSolver::SaveState(state);
+			distributed::Flatten(old_hessian_, state.solver);
+		}
+
+		bool SdlmSolver::RestoreState(const TrainingState& state)
+		{
+			// the hessian has the shape of the weights, it's checked before
+			// the base class changes anything
+			if (!state.solver.empty() && state.solver.size() != state.weights.size())
+				return false;
+			if (!BaseSolver::RestoreState(state))
+				return false;
+			old_hessian_.clear();
+			if (state.solver.empty())
+				return true;
+			for (std::size_t n = 0; n < net_->Size(); ++n) {
+				old_hessian_.emplace_back(net_->Weights(n), net_->BiasWeights(n));
+			}
+			distributed::Unflatten(state.solver, old_hessian_);
+			return true;
+		}
+
+		void DistributedSgdSolver::Solve()
+		{
+			using namespace arma;
+#ifndef NDEBUG
+			assert(net_->is_initialized());
+#endif
+			bool master = transport_->Rank() == 0;
+			std::vector<double> buffer;
+			// all workers start from weights of the first one
+			distributed::FlattenWeights(*net_, buffer);
+			if (!distributed::Broadcast(*transport_, buffer)) {
+				std::cout << "worker " << transport_->Rank() << ": cannot receive initial weights\n";
+				return;
+			}
+			distributed::UnflattenWeights(buffer, *net_);
+
+			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> gradient;
+			std::vector<std::pair<cnn::tensor4d, cnn::tensor4d>> iter_gradient;
+			double total_batch = static_cast<double>(batch_size_ * transport_->Size());
+			for (uword epoch = start_epoch_; epoch < max_epoch_; ++epoch) {
+				CNN_TRACE_SCOPE("epoch", "solver", epoch);
+				ReportEvaluations();
+				double error = 0.0;
+				net_->LoadTrainImage();
+				net_->Forward();
+				error += net_->Error();
+				gradient = net_->Backpropagation();
+				if (master) {
+					std::cout << boost::format(
+						"compute error on training dataset for %1% samples on %2% workers on %3% training epoches..."
+					) % batch_size_ % transport_->Size() % (epoch + 1) << "\n";
+				}
+				for (uword i = 1; i < batch_size_; ++i) {
+					net_->LoadTrainImage();
+					net_->Forward();
+					error += net_->Error();
+					iter_gradient = net_->Backpropagation();
+					for (std::size_t n = 0; n < gradient.size(); ++n) {
+						// weights
+						for (uword item = 0; item < gradient[n].first.data.size(); ++item) {
+							gradient[n].first.data[item] += iter_gradient[n].first.data[item];
+						}
+						//biases
+						for (uword item = 0; item < gradient[n].second.data.size(); ++item) {
+							gradient[n].second.data[item] += iter_gradient[n].second.data[item];
+						}
+					}
+				}
+				// sum gradients of all workers, error is sent in the same message
+				distributed::Flatten(gradient, buffer);
+				buffer.push_back(error);
+				if (!distributed::RingAllReduce(*transport_, buffer)) {
+					std::cout << "worker " << transport_->Rank() << ": gradient exchange failed\n";
+					return;
+				}
+				error = buffer.back() / total_batch;
+				buffer.pop_back();
+				for (double& value : buffer) {
+					value /= total_batch;
+				}
+				distributed::Unflatten(buffer, gradient);
+				if (master) {
+					std::cout << "training error = " << error << "\n";
+					std::cout << "update weights...\n";
+				}
+				// every worker has the same gradient so weights stay equal without sync
+				for (std::size_t n = 0; n < gradient.size(); ++n) {
+					CNN_TRACE_SCOPE("update_weights", "solver", n);
+					cnn::tensor4d& weigths = net_->Weights(n);
+					cnn::tensor4d& bias_weigths = net_->BiasWeights(n);
+					for (uword item = 0; item < weigths.data.size(); ++item) {
+						weigths.data[item] += -learning_rate_ * gradient[n].first.data[item];
+					}
+					//biases
+					for (uword item = 0; item < bias_weigths.data.size(); ++item) {
+						bias_weigths.data[item] += -learning_rate_ * gradient[n].second.data[item];
 					}
 				}
+
+				if (master && snapshot_interval_ != 0 && (epoch + 1) % snapshot_interval_ == 0) {
+					Snapshot(epoch + 1);
+				}
+				// weights are equal on all workers, loaders differ
+				if (checkpoint_interval_ != 0 && (epoch + 1) % checkpoint_interval_ == 0
+					&& !distributed::AllGather(*transport_, net_->LoaderState(), loaderStates_)) {
+					std::cout << "worker " << transport_->Rank() << ": loader state exchange failed\n";
+					return;
+				}
+				if (master) {
+					Checkpoint(epoch + 1);
+					Test(epoch + 1);
+				}
 			}
+			FlushSnapshots();
+			ReportEvaluations(true);
+		}
+
+		void DistributedSgdSolver::SaveState(TrainingState& state)
+		{
+			BaseSolver::SaveState(state);
+			state.loaders = loaderStates_;
 		}
 	}
 }
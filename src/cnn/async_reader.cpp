@@ -0,0 +1,335 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "async_reader.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#define CNN_HAS_IO_URING
+#endif
+#endif
+
+namespace cnn
+{
+	struct AsyncFileReader::Request
+	{
+		boost::filesystem::path path;
+		std::size_t tag;
+		int fd;
+		std::vector<unsigned char> data;
+		// bytes read so far, short reads are continued
+		std::size_t done;
+#ifdef CNN_HAS_IO_URING
+		iovec iov;
+#endif
+	};
+
+#ifdef CNN_HAS_IO_URING
+	// submission and completion rings set up with raw system calls, so no
+	// liburing is needed. submissions are made under the reader mutex and
+	// completions are consumed by the reaper thread only
+	struct AsyncFileReader::Ring
+	{
+		int fd = -1;
+		void* sq = MAP_FAILED;
+		std::size_t sqSize = 0;
+		void* cq = MAP_FAILED;
+		std::size_t cqSize = 0;
+		io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+		std::size_t sqesSize = 0;
+		unsigned* sqTail;
+		unsigned* sqMask;
+		unsigned* sqArray;
+		unsigned* cqHead;
+		unsigned* cqTail;
+		unsigned* cqMask;
+		io_uring_cqe* cqes;
+
+		bool Setup(unsigned entries)
+		{
+			io_uring_params params;
+			std::memset(&params, 0, sizeof(params));
+			fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+			if (fd < 0)
+				return false;
+			sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+			cqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+			if (params.features & IORING_FEAT_SINGLE_MMAP) {
+				sqSize = cqSize = std::max(sqSize, cqSize);
+			}
+			sq = mmap(nullptr, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			          fd, IORING_OFF_SQ_RING);
+			if (sq == MAP_FAILED)
+				return false;
+			if (params.features & IORING_FEAT_SINGLE_MMAP) {
+				cq = sq;
+			} else {
+				cq = mmap(nullptr, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				          fd, IORING_OFF_CQ_RING);
+				if (cq == MAP_FAILED)
+					return false;
+			}
+			sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+			sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+			                                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+			if (sqes == MAP_FAILED)
+				return false;
+			char* sqBase = static_cast<char*>(sq);
+			char* cqBase = static_cast<char*>(cq);
+			sqTail = reinterpret_cast<unsigned*>(sqBase + params.sq_off.tail);
+			sqMask = reinterpret_cast<unsigned*>(sqBase + params.sq_off.ring_mask);
+			sqArray = reinterpret_cast<unsigned*>(sqBase + params.sq_off.array);
+			cqHead = reinterpret_cast<unsigned*>(cqBase + params.cq_off.head);
+			cqTail = reinterpret_cast<unsigned*>(cqBase + params.cq_off.tail);
+			cqMask = reinterpret_cast<unsigned*>(cqBase + params.cq_off.ring_mask);
+			cqes = reinterpret_cast<io_uring_cqe*>(cqBase + params.cq_off.cqes);
+			return true;
+		}
+
+		~Ring()
+		{
+			if (sqes != MAP_FAILED)
+				munmap(sqes, sqesSize);
+			if (cq != MAP_FAILED && cq != sq)
+				munmap(cq, cqSize);
+			if (sq != MAP_FAILED)
+				munmap(sq, sqSize);
+			if (fd >= 0)
+				close(fd);
+		}
+
+		// the caller guarantees a free entry, at most depth + 1 entries are in flight
+		void Push(std::uint8_t opcode, int file, const iovec* iov, std::uint64_t offset,
+		          std::uint64_t user)
+		{
+			unsigned tail = *sqTail;
+			unsigned index = tail & *sqMask;
+			io_uring_sqe& sqe = sqes[index];
+			std::memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = opcode;
+			sqe.fd = file;
+			sqe.addr = reinterpret_cast<std::uint64_t>(iov);
+			sqe.len = iov ? 1 : 0;
+			sqe.off = offset;
+			sqe.user_data = user;
+			sqArray[index] = index;
+			__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		}
+
+		int Enter(unsigned submit, unsigned wait)
+		{
+			int result;
+			do {
+				result = static_cast<int>(syscall(__NR_io_uring_enter, fd, submit, wait,
+				                                  wait ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0));
+			} while (result < 0 && errno == EINTR);
+			return result;
+		}
+	};
+#else
+	struct AsyncFileReader::Ring
+	{};
+#endif
+
+	namespace
+	{
+		bool ReadFile(const boost::filesystem::path& path, std::vector<unsigned char>& data)
+		{
+			boost::system::error_code error;
+			std::uintmax_t size = boost::filesystem::file_size(path, error);
+			if (error)
+				return false;
+			boost::filesystem::ifstream in(path, std::ios::binary);
+			if (!in.is_open())
+				return false;
+			data.resize(static_cast<std::size_t>(size));
+			return static_cast<bool>(in.read(reinterpret_cast<char*>(data.data()),
+			                                 static_cast<std::streamsize>(size)));
+		}
+	}
+
+	AsyncFileReader::AsyncFileReader(std::size_t depth)
+		: depth_(std::max<std::size_t>(1, depth)), outstanding_(0), inflight_(0), stop_(false)
+	{
+#ifdef CNN_HAS_IO_URING
+		// one more entry wakes the reaper up on shutdown
+		std::unique_ptr<Ring> ring(new Ring());
+		if (ring->Setup(static_cast<unsigned>(depth_ + 1))) {
+			ring_ = std::move(ring);
+			reaper_ = std::thread(&AsyncFileReader::reap, this);
+			return;
+		}
+#endif
+		pool_.reset(new ThreadPool(depth_));
+	}
+
+	AsyncFileReader::~AsyncFileReader()
+	{
+		if (pool_) {
+			// the pool finishes every posted read
+			pool_.reset();
+			return;
+		}
+#ifdef CNN_HAS_IO_URING
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+			++inflight_;
+			ring_->Push(IORING_OP_NOP, -1, nullptr, 0, 0);
+			ring_->Enter(1, 0);
+		}
+		reaper_.join();
+		for (const std::unique_ptr<Request>& request : waiting_) {
+			if (request->fd >= 0)
+				close(request->fd);
+		}
+#endif
+	}
+
+	void AsyncFileReader::complete(std::unique_ptr<Request> request, bool ok)
+	{
+#ifdef CNN_HAS_IO_URING
+		if (request->fd >= 0)
+			close(request->fd);
+#endif
+		done_.push_back(ReadResult{ request->tag, ok, std::move(request->data) });
+		completed_.notify_one();
+	}
+
+	void AsyncFileReader::Submit(const boost::filesystem::path& path, std::size_t tag)
+	{
+		std::unique_ptr<Request> request(new Request());
+		request->path = path;
+		request->tag = tag;
+		request->fd = -1;
+		request->done = 0;
+		if (pool_) {
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				++outstanding_;
+			}
+			Request* raw = request.release();
+			pool_->Post([this, raw](std::size_t)
+			{
+				std::unique_ptr<Request> request(raw);
+				bool ok = ReadFile(request->path, request->data);
+				std::lock_guard<std::mutex> lock(mutex_);
+				complete(std::move(request), ok);
+			});
+			return;
+		}
+#ifdef CNN_HAS_IO_URING
+		// opened on the calling thread, so neither the reaper nor other
+		// submitters wait for the file system under the mutex
+		request->fd = open(request->path.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat info;
+		bool opened = request->fd >= 0 && fstat(request->fd, &info) == 0;
+		if (opened) {
+			request->data.resize(static_cast<std::size_t>(info.st_size));
+		}
+		std::lock_guard<std::mutex> lock(mutex_);
+		++outstanding_;
+		if (!opened) {
+			complete(std::move(request), false);
+			return;
+		}
+		waiting_.push_back(std::move(request));
+		submitWaiting();
+#endif
+	}
+
+	void AsyncFileReader::submitWaiting()
+	{
+#ifdef CNN_HAS_IO_URING
+		unsigned submitted = 0;
+		while (!stop_ && inflight_ < depth_ && !waiting_.empty()) {
+			std::unique_ptr<Request> request = std::move(waiting_.front());
+			waiting_.pop_front();
+			if (request->done == request->data.size()) {
+				complete(std::move(request), true);
+				continue;
+			}
+			request->iov.iov_base = request->data.data() + request->done;
+			request->iov.iov_len = request->data.size() - request->done;
+			Request* raw = request.release();
+			ring_->Push(IORING_OP_READV, raw->fd, &raw->iov, raw->done,
+			            reinterpret_cast<std::uint64_t>(raw));
+			++inflight_;
+			++submitted;
+		}
+		if (submitted)
+			ring_->Enter(submitted, 0);
+#endif
+	}
+
+	void AsyncFileReader::reap()
+	{
+#ifdef CNN_HAS_IO_URING
+		for (;;) {
+			ring_->Enter(0, 1);
+			unsigned head = *ring_->cqHead;
+			unsigned tail = __atomic_load_n(ring_->cqTail, __ATOMIC_ACQUIRE);
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (; head != tail; ++head) {
+				const io_uring_cqe& cqe = ring_->cqes[head & *ring_->cqMask];
+				--inflight_;
+				// user data 0 is the shutdown wake-up
+				if (cqe.user_data == 0)
+					continue;
+				std::unique_ptr<Request> request(reinterpret_cast<Request*>(cqe.user_data));
+				if (cqe.res < 0) {
+					complete(std::move(request), false);
+				} else if (cqe.res == 0) {
+					// the file was truncated after fstat
+					request->data.resize(request->done);
+					complete(std::move(request), true);
+				} else {
+					request->done += static_cast<std::size_t>(cqe.res);
+					if (request->done == request->data.size()) {
+						complete(std::move(request), true);
+					} else {
+						waiting_.push_front(std::move(request));
+					}
+				}
+			}
+			__atomic_store_n(ring_->cqHead, head, __ATOMIC_RELEASE);
+			if (stop_ && inflight_ == 0)
+				return;
+			submitWaiting();
+		}
+#endif
+	}
+
+	bool AsyncFileReader::Wait(ReadResult& result)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		completed_.wait(lock, [this]() { return !done_.empty() || outstanding_ == 0; });
+		if (done_.empty())
+			return false;
+		result = std::move(done_.front());
+		done_.pop_front();
+		--outstanding_;
+		return true;
+	}
+}
@@ -0,0 +1,69 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "augmentation.hpp"
+#include <opencv2/imgproc.hpp>
+#include <cmath>
+
+namespace cnn
+{
+	namespace
+	{
+		const double pi = 3.14159265358979323846;
+
+		double Uniform(std::mt19937& gen, double range)
+		{
+			if (range <= 0.0)
+				return 0.0;
+			return std::uniform_real_distribution<double>(-range, range)(gen);
+		}
+	}
+
+	void Augmenter::Warp(const cv::Mat& src, const cv::Rect& roi, cv::Size size,
+	                     std::mt19937& gen, cv::Mat& dst) const
+	{
+		double scale = 1.0 + Uniform(gen, options_.scale);
+		double angle = Uniform(gen, options_.rotation) * pi / 180.0;
+		double mirror = options_.flip && std::bernoulli_distribution(0.5)(gen) ? -1.0 : 1.0;
+		// center of the shifted crop in source coordinates
+		double cx = roi.x + 0.5 * (roi.width - 1) + Uniform(gen, options_.shift) * roi.width;
+		double cy = roi.y + 0.5 * (roi.height - 1) + Uniform(gen, options_.shift) * roi.height;
+
+		// map from destination to source pixels: src = R * F * S * (dst - dst_center) + center,
+		// S scales the output to the crop, F mirrors x and R rotates around the center
+		double sx = scale * roi.width / size.width * mirror;
+		double sy = scale * roi.height / size.height;
+		double cos = std::cos(angle);
+		double sin = std::sin(angle);
+		double a00 = cos * sx, a01 = -sin * sy;
+		double a10 = sin * sx, a11 = cos * sy;
+		double ox = 0.5 * (size.width - 1);
+		double oy = 0.5 * (size.height - 1);
+
+		cv::Mat transform(2, 3, CV_64FC1);
+		transform.at<double>(0, 0) = a00;
+		transform.at<double>(0, 1) = a01;
+		transform.at<double>(0, 2) = cx - a00 * ox - a01 * oy;
+		transform.at<double>(1, 0) = a10;
+		transform.at<double>(1, 1) = a11;
+		transform.at<double>(1, 2) = cy - a10 * ox - a11 * oy;
+		// the matrix already maps destination to source
+		cv::warpAffine(src, dst, transform, size, cv::INTER_LINEAR | cv::WARP_INVERSE_MAP,
+		               cv::BORDER_REFLECT_101);
+	}
+
+	ColorJitter Augmenter::Jitter(std::mt19937& gen) const
+	{
+		return ColorJitter{ 1.0 + Uniform(gen, options_.contrast), Uniform(gen, options_.brightness) };
+	}
+}
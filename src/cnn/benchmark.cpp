@@ -0,0 +1,176 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "benchmark.hpp"
+#include <boost/format.hpp>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace cnn
+{
+	namespace benchmark
+	{
+		namespace
+		{
+			typedef std::chrono::steady_clock clock;
+
+			// request(client) sends one request and returns true on success
+			LoadReport Run(const LoadOptions& options,
+			               const std::function<bool(std::size_t)>& request,
+			               const std::function<bool(std::size_t)>& prepare)
+			{
+				std::size_t clients = std::max<std::size_t>(1, options.clients);
+				std::vector<std::vector<clock::duration>> latency(clients);
+				std::vector<std::size_t> failed(clients, 0);
+				std::vector<bool> ready(clients, false);
+				for (std::size_t c = 0; c < clients; ++c) {
+					ready[c] = prepare(c);
+					latency[c].reserve(options.requests);
+				}
+				std::vector<std::thread> threads;
+				threads.reserve(clients);
+				clock::time_point start = clock::now();
+				for (std::size_t c = 0; c < clients; ++c) {
+					threads.emplace_back([&, c]()
+					{
+						for (std::size_t i = 0; i < options.requests; ++i) {
+							clock::time_point sent = clock::now();
+							if (ready[c] && request(c)) {
+								latency[c].push_back(clock::now() - sent);
+							} else {
+								++failed[c];
+							}
+						}
+					});
+				}
+				for (std::thread& thread : threads) {
+					thread.join();
+				}
+				double seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+				std::vector<clock::duration> all;
+				for (const std::vector<clock::duration>& item : latency) {
+					all.insert(all.end(), item.begin(), item.end());
+				}
+				std::sort(all.begin(), all.end());
+				auto percentile = [&all](double p)
+				{
+					if (all.empty())
+						return std::chrono::microseconds(0);
+					std::size_t idx = std::min(all.size() - 1, static_cast<std::size_t>(p * all.size()));
+					return std::chrono::duration_cast<std::chrono::microseconds>(all[idx]);
+				};
+				LoadReport report;
+				report.requests = all.size();
+				report.failed = 0;
+				for (std::size_t item : failed) {
+					report.failed += item;
+				}
+				report.seconds = seconds;
+				report.throughput = seconds > 0.0 ? all.size() / seconds : 0.0;
+				report.p50 = percentile(0.50);
+				report.p95 = percentile(0.95);
+				report.p99 = percentile(0.99);
+				report.max = all.empty() ? std::chrono::microseconds(0)
+					: std::chrono::duration_cast<std::chrono::microseconds>(all.back());
+				return report;
+			}
+		}
+
+		LoadReport RunLoad(serving::InferenceServer& server,
+		                   std::shared_ptr<arma::Cube<double>> image,
+		                   const LoadOptions& options)
+		{
+			return Run(options, [&](std::size_t)
+			{
+				try {
+					server.Submit(image, options.top_k).get();
+					return true;
+				} catch (const std::exception&) {
+					return false;
+				}
+			}, [](std::size_t) { return true; });
+		}
+
+		LoadReport RunLoad(const std::string& socketPath,
+		                   const arma::Cube<double>& image,
+		                   const LoadOptions& options)
+		{
+			std::vector<std::unique_ptr<serving::SocketClient>> clients;
+			std::vector<std::vector<serving::Prediction>> results(std::max<std::size_t>(1, options.clients));
+			for (std::size_t c = 0; c < results.size(); ++c) {
+				clients.emplace_back(std::make_unique<serving::SocketClient>());
+			}
+			return Run(options, [&](std::size_t c)
+			{
+				return clients[c]->Infer(image, options.top_k, results[c]);
+			}, [&](std::size_t c)
+			{
+				return clients[c]->Connect(socketPath);
+			});
+		}
+
+		DecodeReport BenchmarkDecode(LfwLoader& loader, std::size_t images)
+		{
+			bool reduced = loader.ReducedDecoding();
+			// cache hits and reads ahead would be timed instead of decodes
+			std::shared_ptr<ImageCache> cache = loader.Cache();
+			std::size_t depth = loader.AsyncReading();
+			loader.SetImageCache(nullptr);
+			loader.SetAsyncReading(0);
+			auto run = [&loader, images](bool enable)
+			{
+				loader.SetReducedDecoding(enable);
+				std::shared_ptr<arma::Cube<double>> image;
+				arma::Col<double> labels;
+				std::size_t done = 0;
+				clock::time_point start = clock::now();
+				for (std::size_t i = 0; i < images; ++i) {
+					if (loader.LoadTrainImage(image, labels))
+						++done;
+				}
+				double seconds = std::chrono::duration<double>(clock::now() - start).count();
+				return seconds > 0.0 ? done / seconds : 0.0;
+			};
+			// the first pass also warms up the file cache
+			run(false);
+			DecodeReport report;
+			report.images = images;
+			report.full = run(false);
+			report.reduced = run(true);
+			loader.SetReducedDecoding(reduced);
+			loader.SetAsyncReading(depth);
+			loader.SetImageCache(std::move(cache));
+			return report;
+		}
+
+		std::ostream& operator<<(std::ostream& os, const LoadReport& report)
+		{
+			return os << boost::format(
+				"requests: %u, failed: %u, time: %.3f s, throughput: %.1f req/s\n"
+				"latency us: p50 %d, p95 %d, p99 %d, max %d\n")
+				% report.requests % report.failed % report.seconds % report.throughput
+				% report.p50.count() % report.p95.count() % report.p99.count() % report.max.count();
+		}
+
+		std::ostream& operator<<(std::ostream& os, const DecodeReport& report)
+		{
+			return os << boost::format(
+				"decoded %u images: full %.1f img/s, reduced %.1f img/s\n")
+				% report.images % report.full % report.reduced;
+		}
+	}
+}
@@ -0,0 +1,332 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "binary_loaders.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <algorithm>
+#include <codecvt>
+#include <locale>
+#include <sstream>
+
+namespace cnn
+{
+	namespace
+	{
+		std::uint32_t ReadBigEndian(const unsigned char* src)
+		{
+			return (std::uint32_t(src[0]) << 24) | (std::uint32_t(src[1]) << 16)
+				| (std::uint32_t(src[2]) << 8) | std::uint32_t(src[3]);
+		}
+
+		std::vector<std::wstring> NumberedLabels(std::size_t amount)
+		{
+			std::vector<std::wstring> labels;
+			labels.reserve(amount);
+			for (std::size_t i = 0; i < amount; ++i) {
+				labels.emplace_back(std::to_wstring(i));
+			}
+			return labels;
+		}
+
+		const std::size_t cifar_side = 32;
+		const std::size_t cifar_plane = cifar_side * cifar_side;
+	}
+
+	MappedDatasetLoader::MappedDatasetLoader(arma::uword width, arma::uword height,
+	                                         arma::uword channels)
+		: width_(width), height_(height), channels_(channels), open_(false),
+		gen_(std::random_device().operator()())
+	{}
+
+	bool MappedDatasetLoader::map(const std::wstring& path, Part& part,
+	                              const unsigned char*& begin, std::size_t& size)
+	{
+		namespace ipc = boost::interprocess;
+		try {
+			ipc::file_mapping file(boost::filesystem::path(path).string().c_str(), ipc::read_only);
+			// the region stays valid after the file mapping is closed
+			part.regions.emplace_back(file, ipc::read_only);
+		} catch (const ipc::interprocess_exception&) {
+			return false;
+		}
+		begin = static_cast<const unsigned char*>(part.regions.back().get_address());
+		size = part.regions.back().get_size();
+		return true;
+	}
+
+	bool MappedDatasetLoader::LoadImage(bool test, std::size_t idx, arma::Cube<double>& dst,
+	                                    arma::uword& label) const
+	{
+		const Part& part = test ? test_ : train_;
+		if (idx >= part.samples.size())
+			return false;
+		if (dst.n_rows != width_ || dst.n_cols != height_ || dst.n_slices != channels_) {
+			dst.set_size(width_, height_, channels_);
+		}
+		decode(part.samples[idx].first, dst.memptr());
+		label = part.samples[idx].second;
+		return true;
+	}
+
+	void MappedDatasetLoader::setLabels(std::uint32_t label, arma::Col<double>& labels) const
+	{
+		labels.set_size(labels_.size());
+		labels.fill(0);
+		labels(label) = 1;
+	}
+
+	void MappedDatasetLoader::SetEpochSampling(std::uint32_t seed, std::size_t rank,
+	                                           std::size_t ranks)
+	{
+		sampler_ = EpochSampler(train_.samples.size(), seed, rank, ranks);
+	}
+
+	std::size_t MappedDatasetLoader::pick(const Part& part)
+	{
+		if (&part == &train_ && !sampler_.empty())
+			return sampler_.Next();
+		std::uniform_int_distribution<std::size_t> uid(0, part.samples.size() - 1);
+		return uid(gen_);
+	}
+
+	bool MappedDatasetLoader::LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                        arma::Col<double>& labels)
+	{
+		if (test_.samples.empty())
+			return false;
+		arma::uword label;
+		dst = std::make_shared<arma::Cube<double>>(width_, height_, channels_);
+		LoadImage(true, pick(test_), *dst, label);
+		setLabels(static_cast<std::uint32_t>(label), labels);
+		return true;
+	}
+
+	bool MappedDatasetLoader::LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+	                                         arma::uword& label) const
+	{
+		if (idx >= test_.samples.size())
+			return false;
+		dst = std::make_shared<arma::Cube<double>>(width_, height_, channels_);
+		return LoadImage(true, idx, *dst, label);
+	}
+
+	bool MappedDatasetLoader::LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                         arma::Col<double>& labels)
+	{
+		if (train_.samples.empty())
+			return false;
+		arma::uword label;
+		dst = std::make_shared<arma::Cube<double>>(width_, height_, channels_);
+		LoadImage(false, pick(train_), *dst, label);
+		setLabels(static_cast<std::uint32_t>(label), labels);
+		return true;
+	}
+
+	bool MappedDatasetLoader::LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+	                                         arma::Col<arma::uword>& labels)
+	{
+		if (train_.samples.empty())
+			return false;
+		if (buffer.n_rows != width_ || buffer.n_cols != height_ || buffer.n_slices != channels_ * n) {
+			buffer.set_size(width_, height_, channels_ * n);
+		}
+		labels.set_size(n);
+		for (std::size_t i = 0; i < n; ++i) {
+			const std::pair<const unsigned char*, std::uint32_t>& sample = train_.samples[pick(train_)];
+			decode(sample.first, buffer.slice_memptr(i * channels_));
+			labels(i) = sample.second;
+		}
+		return true;
+	}
+
+	MnistLoader::MnistLoader(const std::wstring& trainImages, const std::wstring& trainLabels,
+	                         const std::wstring& testImages, const std::wstring& testLabels)
+		: MappedDatasetLoader(0, 0, 1)
+	{
+		labels_ = NumberedLabels(10);
+		open_ = load(trainImages, trainLabels, train_) && load(testImages, testLabels, test_);
+#ifndef NDEBUG
+		assert(open_);
+#endif
+	}
+
+	bool MnistLoader::load(const std::wstring& images, const std::wstring& labels, Part& part)
+	{
+		const unsigned char* data;
+		const unsigned char* tags;
+		std::size_t data_size, tags_size;
+		if (!map(images, part, data, data_size) || !map(labels, part, tags, tags_size))
+			return false;
+		// idx header: two zero bytes, type 0x08 (unsigned byte), amount of
+		// dimensions and big-endian sizes of every dimension
+		if (data_size < 16 || tags_size < 8 || ReadBigEndian(data) != 0x00000803
+			|| ReadBigEndian(tags) != 0x00000801)
+			return false;
+		std::size_t count = ReadBigEndian(data + 4);
+		arma::uword height = ReadBigEndian(data + 8);
+		arma::uword width = ReadBigEndian(data + 12);
+		// sizes come from the file, compare by division so that they can't overflow
+		if (ReadBigEndian(tags + 4) != count || tags_size - 8 < count
+			|| width == 0 || height == 0 || height > (data_size - 16) / width
+			|| count > (data_size - 16) / (width * height))
+			return false;
+		if (width_ == 0) {
+			width_ = width;
+			height_ = height;
+		} else if (width_ != width || height_ != height) {
+			return false;
+		}
+		part.samples.reserve(count);
+		for (std::size_t i = 0; i < count; ++i) {
+			if (tags[8 + i] >= labels_.size())
+				return false;
+			part.samples.emplace_back(data + 16 + i * width * height, tags[8 + i]);
+		}
+		return true;
+	}
+
+	void MnistLoader::decode(const unsigned char* pixels, double* dst) const noexcept
+	{
+		// rows of the image are contiguous in both, see cvMat2armaCube layout
+		std::size_t size = width_ * height_;
+		for (std::size_t i = 0; i < size; ++i) {
+			dst[i] = pixels[i] / 255.0;
+		}
+	}
+
+	CifarLoader::CifarLoader(const std::vector<std::wstring>& trainFiles,
+	                         const std::vector<std::wstring>& testFiles,
+	                         CifarLabels variant, const std::wstring& labelNames)
+		: MappedDatasetLoader(cifar_side, cifar_side, 3), variant_(variant)
+	{
+		std::size_t classes = variant == CifarLabels::cifar10 ? 10
+			: variant == CifarLabels::cifar100_coarse ? 20 : 100;
+		if (!labelNames.empty()) {
+			boost::filesystem::wifstream in{ boost::filesystem::path(labelNames) };
+			in.imbue(std::locale(in.getloc(), new std::codecvt_utf8<wchar_t>));
+			std::wstring name;
+			while (std::getline(in, name) && labels_.size() < classes) {
+				if (!name.empty() && name.back() == L'\r')
+					name.pop_back();
+				if (!name.empty())
+					labels_.push_back(name);
+			}
+		}
+		if (labels_.size() != classes) {
+			labels_ = NumberedLabels(classes);
+		}
+		open_ = true;
+		for (const std::wstring& path : trainFiles) {
+			open_ = load(path, train_) && open_;
+		}
+		for (const std::wstring& path : testFiles) {
+			open_ = load(path, test_) && open_;
+		}
+#ifndef NDEBUG
+		assert(open_);
+#endif
+	}
+
+	bool CifarLoader::load(const std::wstring& path, Part& part)
+	{
+		const unsigned char* data;
+		std::size_t size;
+		if (!map(path, part, data, size))
+			return false;
+		// cifar-100 records have coarse and fine label bytes
+		std::size_t label_bytes = variant_ == CifarLabels::cifar10 ? 1 : 2;
+		std::size_t label_idx = variant_ == CifarLabels::cifar100_fine ? 1 : 0;
+		std::size_t record = label_bytes + 3 * cifar_plane;
+		if (size % record != 0)
+			return false;
+		std::size_t count = size / record;
+		part.samples.reserve(part.samples.size() + count);
+		for (std::size_t i = 0; i < count; ++i) {
+			const unsigned char* item = data + i * record;
+			if (item[label_idx] >= labels_.size())
+				return false;
+			part.samples.emplace_back(item + label_bytes, item[label_idx]);
+		}
+		return true;
+	}
+
+	void CifarLoader::decode(const unsigned char* pixels, double* dst) const noexcept
+	{
+		// planes are stored as R, G, B with contiguous rows; slices are B, G, R
+		for (std::size_t c = 0; c < 3; ++c) {
+			const unsigned char* plane = pixels + (2 - c) * cifar_plane;
+			double* slice = dst + c * cifar_plane;
+			for (std::size_t i = 0; i < cifar_plane; ++i) {
+				slice[i] = plane[i] / 255.0;
+			}
+		}
+	}
+
+	SyntheticLoader::SyntheticLoader(arma::uword rows, arma::uword cols, arma::uword slices,
+	                                 std::size_t classes, std::size_t poolSize,
+	                                 std::uint32_t seed)
+		: labels_(NumberedLabels(classes)), next_(0), gen_(seed)
+	{
+#ifndef NDEBUG
+		assert(classes != 0);
+#endif
+		std::uniform_real_distribution<double> value(0.0, 1.0);
+		poolSize = std::max<std::size_t>(1, poolSize);
+		pool_.reserve(poolSize);
+		for (std::size_t i = 0; i < poolSize; ++i) {
+			pool_.emplace_back(std::make_shared<arma::Cube<double>>(rows, cols, slices));
+			for (double& item : *pool_.back()) {
+				item = value(gen_);
+			}
+		}
+	}
+
+	bool SyntheticLoader::LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                    arma::Col<double>& labels)
+	{
+		return LoadTrainImage(dst, labels);
+	}
+
+	bool SyntheticLoader::LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                     arma::Col<double>& labels)
+	{
+		// tensors are shared, nothing is allocated or generated per call
+		dst = pool_[next_];
+		next_ = (next_ + 1) % pool_.size();
+		std::uniform_int_distribution<std::size_t> uid(0, labels_.size() - 1);
+		labels.set_size(labels_.size());
+		labels.fill(0);
+		labels(uid(gen_)) = 1;
+		return true;
+	}
+
+	std::string SyntheticLoader::State() const
+	{
+		std::ostringstream out;
+		out << gen_ << ' ' << next_;
+		return out.str();
+	}
+
+	bool SyntheticLoader::SetState(const std::string& state)
+	{
+		std::istringstream in(state);
+		std::mt19937 restored;
+		std::size_t next;
+		if (!(in >> restored >> next) || next >= pool_.size())
+			return false;
+		gen_ = restored;
+		next_ = next;
+		return true;
+	}
+}
@@ -0,0 +1,242 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "checkpoint.hpp"
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <iterator>
+#include <cstring>
+
+namespace cnn
+{
+	namespace
+	{
+		const char checkpoint_magic[8] = { 'C', 'N', 'N', 'C', 'K', 'P', 'T', '\0' };
+		const std::uint32_t checkpoint_version = 2;
+		// a single loader state without the amount
+		const std::uint32_t checkpoint_version_single_loader = 1;
+		const std::uint32_t checkpoint_full = 0;
+		const std::uint32_t checkpoint_delta = 1;
+		const std::uint8_t encoding_raw = 0;
+		const std::uint8_t encoding_xor = 1;
+
+		template<typename T>
+		void Put(std::string& dst, T value)
+		{
+			dst.append(reinterpret_cast<const char*>(&value), sizeof(value));
+		}
+
+		void PutString(std::string& dst, const std::string& value)
+		{
+			Put<std::uint64_t>(dst, value.size());
+			dst += value;
+		}
+
+		// base is used if it has the same size
+		void PutValues(std::string& dst, const std::vector<double>& values,
+		               const std::vector<double>* base)
+		{
+			Put<std::uint64_t>(dst, values.size());
+			if (base == nullptr || base->size() != values.size()) {
+				Put(dst, encoding_raw);
+				dst.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(double));
+				return;
+			}
+			Put(dst, encoding_xor);
+			// two tags per byte, then the non-zero low bytes of every value
+			std::size_t tags = dst.size();
+			dst.append((values.size() + 1) / 2, '\0');
+			for (std::size_t i = 0; i < values.size(); ++i) {
+				std::uint64_t value, previous;
+				std::memcpy(&value, &values[i], sizeof(value));
+				std::memcpy(&previous, &(*base)[i], sizeof(previous));
+				std::uint64_t diff = value ^ previous;
+				unsigned bytes = 0;
+				for (std::uint64_t rest = diff; rest != 0; rest >>= 8) {
+					dst.push_back(static_cast<char>(rest & 0xFF));
+					++bytes;
+				}
+				dst[tags + i / 2] |= static_cast<char>(bytes << (4 * (i % 2)));
+			}
+		}
+
+		class Reader
+		{
+		public:
+			Reader(const char* begin, const char* end) : pos_(begin), end_(end) {}
+
+			bool Get(void* dst, std::size_t size)
+			{
+				if (static_cast<std::size_t>(end_ - pos_) < size)
+					return false;
+				std::memcpy(dst, pos_, size);
+				pos_ += size;
+				return true;
+			}
+
+			template<typename T>
+			bool Get(T& value)
+			{
+				return Get(&value, sizeof(value));
+			}
+
+			bool GetString(std::string& value)
+			{
+				std::uint64_t size;
+				if (!Get(size) || static_cast<std::uint64_t>(end_ - pos_) < size)
+					return false;
+				value.assign(pos_, static_cast<std::size_t>(size));
+				pos_ += size;
+				return true;
+			}
+
+			bool GetValues(std::vector<double>& values, const std::vector<double>* base)
+			{
+				std::uint64_t size;
+				std::uint8_t encoding;
+				if (!Get(size) || !Get(encoding))
+					return false;
+				if (encoding == encoding_raw) {
+					if (static_cast<std::uint64_t>(end_ - pos_) / sizeof(double) < size)
+						return false;
+					values.resize(static_cast<std::size_t>(size));
+					return Get(values.data(), values.size() * sizeof(double));
+				}
+				if (encoding != encoding_xor || base == nullptr || base->size() != size)
+					return false;
+				const unsigned char* tags = reinterpret_cast<const unsigned char*>(pos_);
+				std::size_t tags_size = static_cast<std::size_t>((size + 1) / 2);
+				if (static_cast<std::size_t>(end_ - pos_) < tags_size)
+					return false;
+				pos_ += tags_size;
+				values.resize(static_cast<std::size_t>(size));
+				for (std::size_t i = 0; i < values.size(); ++i) {
+					unsigned bytes = (tags[i / 2] >> (4 * (i % 2))) & 0x0F;
+					if (bytes > sizeof(std::uint64_t) || static_cast<std::size_t>(end_ - pos_) < bytes)
+						return false;
+					std::uint64_t diff = 0;
+					for (unsigned b = 0; b < bytes; ++b) {
+						diff |= static_cast<std::uint64_t>(static_cast<unsigned char>(*pos_++)) << (8 * b);
+					}
+					std::uint64_t value;
+					std::memcpy(&value, &(*base)[i], sizeof(value));
+					value ^= diff;
+					std::memcpy(&values[i], &value, sizeof(value));
+				}
+				return true;
+			}
+
+		private:
+			const char* pos_;
+			const char* end_;
+		};
+
+		bool Write(const std::wstring& path, const TrainingState& state,
+		           const TrainingState* base, const std::wstring& baseName)
+		{
+			std::string data(checkpoint_magic, sizeof(checkpoint_magic));
+			Put(data, checkpoint_version);
+			Put(data, base ? checkpoint_delta : checkpoint_full);
+			Put(data, state.epoch);
+			if (base) {
+				PutString(data, boost::filesystem::path(baseName).string());
+			}
+			Put<std::uint64_t>(data, state.loaders.size());
+			for (const std::string& loader : state.loaders) {
+				PutString(data, loader);
+			}
+			PutValues(data, state.weights, base ? &base->weights : nullptr);
+			PutValues(data, state.solver, base ? &base->solver : nullptr);
+			boost::crc_32_type crc;
+			crc.process_bytes(data.data(), data.size());
+			Put<std::uint32_t>(data, crc.checksum());
+
+			boost::filesystem::path target(path);
+			boost::filesystem::path temporary(path + L".tmp");
+			{
+				boost::filesystem::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+				if (!out.is_open())
+					return false;
+				out.write(data.data(), data.size());
+				if (!out)
+					return false;
+			}
+			boost::system::error_code error;
+			boost::filesystem::rename(temporary, target, error);
+			return !error;
+		}
+
+		bool Read(const std::wstring& path, TrainingState& state, bool allowDelta)
+		{
+			boost::filesystem::ifstream in(boost::filesystem::path(path), std::ios::binary);
+			if (!in.is_open())
+				return false;
+			std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			std::uint32_t stored;
+			if (data.size() < sizeof(checkpoint_magic) + sizeof(stored))
+				return false;
+			std::memcpy(&stored, data.data() + data.size() - sizeof(stored), sizeof(stored));
+			boost::crc_32_type crc;
+			crc.process_bytes(data.data(), data.size() - sizeof(stored));
+			if (crc.checksum() != stored
+				|| std::memcmp(data.data(), checkpoint_magic, sizeof(checkpoint_magic)) != 0)
+				return false;
+
+			Reader reader(data.data() + sizeof(checkpoint_magic), data.data() + data.size() - sizeof(stored));
+			std::uint32_t version, kind;
+			if (!reader.Get(version) || !reader.Get(kind) || !reader.Get(state.epoch)
+				|| (version != checkpoint_version && version != checkpoint_version_single_loader)
+				|| (kind != checkpoint_full && kind != checkpoint_delta))
+				return false;
+			TrainingState base;
+			if (kind == checkpoint_delta) {
+				std::string baseName;
+				// deltas are always made against a full checkpoint
+				if (!allowDelta || !reader.GetString(baseName)
+					|| !Read((boost::filesystem::path(path).parent_path() / baseName).wstring(), base, false))
+					return false;
+			}
+			std::uint64_t loaders = 1;
+			if (version != checkpoint_version_single_loader && !reader.Get(loaders))
+				return false;
+			// every state takes at least its size
+			if (loaders > data.size() / sizeof(std::uint64_t))
+				return false;
+			state.loaders.resize(static_cast<std::size_t>(loaders));
+			for (std::string& loader : state.loaders) {
+				if (!reader.GetString(loader))
+					return false;
+			}
+			const TrainingState* previous = kind == checkpoint_delta ? &base : nullptr;
+			return reader.GetValues(state.weights, previous ? &previous->weights : nullptr)
+				&& reader.GetValues(state.solver, previous ? &previous->solver : nullptr);
+		}
+	}
+
+	bool WriteCheckpoint(const std::wstring& path, const TrainingState& state)
+	{
+		return Write(path, state, nullptr, std::wstring());
+	}
+
+	bool WriteCheckpoint(const std::wstring& path, const TrainingState& state,
+	                     const TrainingState& base, const std::wstring& basePath)
+	{
+		return Write(path, state, &base, boost::filesystem::path(basePath).filename().wstring());
+	}
+
+	bool ReadCheckpoint(const std::wstring& path, TrainingState& state)
+	{
+		return Read(path, state, true);
+	}
+}
@@ -12,17 +12,30 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "convolutional_layer.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
 #include <cmath>
 
 namespace cnn
 {
 	namespace nn
 	{
+		namespace
+		{
+			// product of unrolled kernels and input, traced apart from the unrolling
+			arma::Mat<double> Gemm(const arma::Mat<double>& kernels, const arma::Mat<double>& input)
+			{
+				CNN_TRACE_SCOPE("gemm", "convolutional");
+				return kernels * input;
+			}
+		}
+
 		void ConvolutionalLayer::im2col(const std::shared_ptr<arma::Cube<double>>& src_data,
 		                                const tensor4d& src_kernel, arma::Mat<double>& dst_data,
 		                                arma::Mat<double>& dst_kernel,
 		                                arma::uword height, arma::uword width) const noexcept
 		{
+			CNN_TRACE_SCOPE("im2col", "convolutional");
 			arma::uword kernel_size = src_kernel.n_rows * src_kernel.n_cols;
 			dst_data.set_size(src_kernel.n_rows * src_kernel.n_cols * src_data->n_slices,
 			                  height * width);
@@ -49,12 +62,49 @@ namespace cnn
 			}
 		}
 
+		void ConvolutionalLayer::im2col(const std::shared_ptr<arma::Cube<double>>& src_data,
+		                                arma::uword kernel_height, arma::uword kernel_width,
+		                                arma::Mat<double>& dst_data, arma::uword height,
+		                                arma::uword first, arma::uword last) const noexcept
+		{
+			CNN_TRACE_SCOPE("im2col", "convolutional");
+			using namespace arma;
+			uword kernel_size = kernel_height * kernel_width;
+			dst_data.set_size(kernel_size * src_data->n_slices, last - first);
+			for (uword idx = first; idx < last; ++idx) {
+				uword col = idx / height;
+				uword row = idx % height;
+				for (uword c = 0; c < src_data->n_slices; ++c) {
+					dst_data(span(c * kernel_size, c * kernel_size + kernel_size - 1),
+					         idx - first
+					) = arma::vectorise(src_data->slice(c)(
+						span(row * stride_, row * stride_ + kernel_height - 1),
+						span(col * stride_, col * stride_ + kernel_width - 1)));
+				}
+			}
+		}
+
+		void ConvolutionalLayer::kernel2row(const tensor4d& src_kernel, arma::uword depth,
+		                                    arma::Mat<double>& dst_kernel) const noexcept
+		{
+			arma::uword kernel_size = src_kernel.n_rows * src_kernel.n_cols;
+			dst_kernel.set_size(src_kernel.n_size, kernel_size * depth);
+			for (arma::uword c = 0; c < depth; ++c) {
+				for (arma::uword k = 0; k < src_kernel.n_size; ++k) {
+					dst_kernel(k, arma::span(c * kernel_size, c * kernel_size
+					                         + kernel_size - 1)
+					) = arma::vectorise(src_kernel.data[k].slice(c)).t();
+				}
+			}
+		}
+
 		void ConvolutionalLayer::im2col(const std::shared_ptr<arma::Cube<double>>& src_data,
 		                                const std::shared_ptr<arma::Cube<double>>& src_delta,
 		                                arma::Mat<double>& dst_data,
 		                                arma::Mat<double>& dst_delta,
 		                                arma::uword height, arma::uword width) const noexcept
 		{
+			CNN_TRACE_SCOPE("im2col", "convolutional");
 			using namespace arma;
 			uword kernel_size = src_delta->n_rows * src_delta->n_cols;
 			uword kernel_depth = src_delta->n_slices;
@@ -76,7 +126,8 @@ namespace cnn
 			}
 		}
 
-		void ConvolutionalLayer::Forward(std::shared_ptr<arma::Cube<double>> input)
+		void ConvolutionalLayer::Forward(std::shared_ptr<arma::Cube<double>> input,
+									LayerContext& ctx) const
 		{
 			using namespace arma;
 #ifndef NDEBUG
@@ -87,60 +138,72 @@ namespace cnn
 #endif
 
 			if (padding_.height == 0 && padding_.width == 0) {
-				input_ = input;
+				// the input may be shared with other contexts, it's only read
+				ctx.input = input;
 			} else {
-				AddPadding(input_, input->n_rows, input->n_cols, input->n_slices);
+				AddPadding(ctx.input, input->n_rows, input->n_cols, input->n_slices);
+				(*ctx.input)(span(padding_.height, padding_.height + input->n_rows - 1),
+				          span(padding_.width, padding_.width + input->n_cols - 1),
+				          span::all) = *input;
 			}
-			(*input_)(span(padding_.height, padding_.height + input->n_rows - 1),
-			          span(padding_.width, padding_.width + input->n_cols - 1),
-			          span::all) = *input;
 
-			Mat<double> input2col;
 			Mat<double> kernel2col;
 
-			uword output_height = (input_->n_rows - kernel_size_.height) / stride_ + 1;
-			uword output_width = (input_->n_cols - kernel_size_.width) / stride_ + 1;
-
-			im2col(input_, weights_, input2col, kernel2col, output_height, output_width);
+			uword output_height = (ctx.input->n_rows - kernel_size_.height) / stride_ + 1;
+			uword output_width = (ctx.input->n_cols - kernel_size_.width) / stride_ + 1;
 
-			Mat<double> cross_correlation = kernel2col * input2col;
+			kernel2row(weights_, ctx.input->n_slices, kernel2col);
+			// every block of output columns is unrolled and multiplied separately,
+			// so blocks may be computed in parallel
+			Mat<double> cross_correlation(n_filters_, output_height * output_width);
+			ParallelFor(0, cross_correlation.n_cols, [&](std::size_t first, std::size_t last)
+			{
+				Mat<double> input2col;
+				im2col(ctx.input, kernel_size_.height, kernel_size_.width, input2col,
+				       output_height, first, last);
+				cross_correlation.cols(first, last - 1) = Gemm(kernel2col, input2col);
+			});
 
-			if (!receptiveField_) {
-				receptiveField_ = std::make_shared<Cube<double>>(output_height, output_width,
+			if (!ctx.receptiveField) {
+				ctx.receptiveField = std::make_shared<Cube<double>>(output_height, output_width,
 				                                                n_filters_);
 			} // convolution and pooling layer don't have fixed data for input signals
 			// so we need always resize our receptive field 
 			else {
-				receptiveField_->set_size(output_height, output_width, n_filters_);
+				ctx.receptiveField->set_size(output_height, output_width, n_filters_);
 			}
 
-			double bias;
-			for (uword k = 0; k < n_filters_; ++k) {
-				bias = 0;
-				for (uword c = 0; c < biasWeights_.n_slices; ++c) {
-					bias += biasWeights_.data[k](0, 0, c);
+			ParallelFor(0, n_filters_, [&](std::size_t first, std::size_t last)
+			{
+				double bias;
+				for (uword k = first; k < last; ++k) {
+					bias = 0;
+					for (uword c = 0; c < biasWeights_.n_slices; ++c) {
+						bias += biasWeights_.data[k](0, 0, c);
+					}
+					ctx.receptiveField->slice(k) = arma::reshape(cross_correlation.row(k),
+					                                          output_height, output_width) + bias;
 				}
-				receptiveField_->slice(k) = arma::reshape(cross_correlation.row(k),
-				                                          output_height, output_width) + bias;
-			}
+			});
 
 
 			if (activFunc_) {
-				if (!output_) {
-					output_ = std::make_shared<Cube<double>>(output_height, output_width,
+				if (!ctx.output) {
+					ctx.output = std::make_shared<Cube<double>>(output_height, output_width,
 					                                        n_filters_);
 				} else {
-					output_->set_size(output_height, output_width, n_filters_);
+					ctx.output->set_size(output_height, output_width, n_filters_);
 				}
-				activFunc_->Compute(receptiveField_, output_);
+				activFunc_->Compute(ctx.receptiveField, ctx.output);
 			} else {
-				output_ = receptiveField_;
+				ctx.output = ctx.receptiveField;
 			}
 		}
 
 
 		std::pair<tensor4d, tensor4d> ConvolutionalLayer::Backward(
-			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss)
+			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+			LayerContext& ctx) const
 		{
 			using namespace arma;
 #ifndef NDEBUG
@@ -148,27 +211,27 @@ namespace cnn
 #endif
 			// if top layer was 1d tensor we need reshape input error to 3d
 			if (prevLocalLoss->n_slices == 1 && prevLocalLoss->n_cols == 1) {
-				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), output_->n_rows,
-				                               output_->n_cols, output_->n_slices);
+				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), ctx.output->n_rows,
+				                               ctx.output->n_cols, ctx.output->n_slices);
 			}
 
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<Cube<double>>(
-					input_->n_rows, input_->n_cols, input_->n_slices);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<Cube<double>>(
+					ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices);
 			} else {
-				localLoss_->set_size(input_->n_rows, input_->n_cols, input_->n_slices);
+				ctx.localLoss->set_size(ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices);
 			}
 
-			uword output_height = output_->n_rows;
-			uword output_width = output_->n_cols;
-			uword output_depth = output_->n_slices;
+			uword output_height = ctx.output->n_rows;
+			uword output_width = ctx.output->n_cols;
+			uword output_depth = ctx.output->n_slices;
 			Cube<double> dfdz(output_height, output_width,
 			                 output_depth);
 			for (uword c = 0; c < output_depth; ++c) {
 				for (uword col = 0; col < output_width; ++col) {
 					for (uword row = 0; row < output_height; ++row) {
 						dfdz(row, col, c) = activFunc_->Derivative(
-							(*receptiveField_)(row, col, c));
+							(*ctx.receptiveField)(row, col, c));
 					}
 				}
 			}
@@ -179,13 +242,13 @@ namespace cnn
 				         weights_.n_slices, n_filters_),
 				tensor4d(1, 1, biasWeights_.n_slices, n_filters_));
 			// if on forward propagate was used padding for input then
-			// input_ on backward stage has already been padded
+			// ctx.input on backward stage has already been padded
 			Mat<double> input2col, kernel2col;
-			uword input_depth = input_->n_slices;
-			im2col(input_, prevLocalLoss, input2col, kernel2col,
+			uword input_depth = ctx.input->n_slices;
+			im2col(ctx.input, prevLocalLoss, input2col, kernel2col,
 			       kernel_size_.height, kernel_size_.width);
 			//output size = [prevLocalLoss->n_slices; n_filters * kernel_size_h * kernel_size_w] 
-			Mat<double> cross_correlation = kernel2col * input2col;
+			Mat<double> cross_correlation = Gemm(kernel2col, input2col);
 			for (uword k = 0; k < n_filters_; ++k) {
 				for (uword d = 0; d < weights_.n_slices; ++d) {
 					result.first.data[k].slice(d) = arma::reshape(
@@ -207,8 +270,8 @@ namespace cnn
 			}
 
 			// propagate error to bottom layer:
-			uword unpadded_input_height = input_->n_rows - 2 * padding_.height;
-			uword unpadded_input_width = input_->n_cols - 2 * padding_.width;
+			uword unpadded_input_height = ctx.input->n_rows - 2 * padding_.height;
+			uword unpadded_input_width = ctx.input->n_cols - 2 * padding_.width;
 			// we must add zeros on borders to input loss to get conv result dimension
 			// equal to input signals
 			uword pad_h = (unpadded_input_height -
@@ -236,18 +299,18 @@ namespace cnn
 
 			im2col(paddedPrevLoss, flippedKernel, input2col, kernel2col,
 			       unpadded_input_height, unpadded_input_width);
-			Mat<double> convolution = kernel2col * input2col;
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<Cube<double>>(unpadded_input_height,
+			Mat<double> convolution = Gemm(kernel2col, input2col);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<Cube<double>>(unpadded_input_height,
 				                                            unpadded_input_width,
 				                                            input_depth);
 			} else {
-				localLoss_->set_size(unpadded_input_height,
+				ctx.localLoss->set_size(unpadded_input_height,
 									 unpadded_input_width,
 									 input_depth);
 			}
 			for (uword c = 0; c < input_depth; ++c) {
-				(*localLoss_).slice(c) = arma::reshape(convolution.row(c),
+				(*ctx.localLoss).slice(c) = arma::reshape(convolution.row(c),
 				                                       unpadded_input_height,
 				                                       unpadded_input_width);
 			}
@@ -256,7 +319,8 @@ namespace cnn
 		}
 
 		std::pair<tensor4d, tensor4d> ConvolutionalLayer::Backward2nd(
-			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss)
+			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+			LayerContext& ctx) const
 		{
 			using namespace arma;
 #ifndef NDEBUG
@@ -264,27 +328,27 @@ namespace cnn
 #endif
 			// if top layer was 1d tensor we need reshape input error to 3d
 			if (prevLocalLoss->n_slices == 1 && prevLocalLoss->n_cols == 1) {
-				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), output_->n_rows,
-				                               output_->n_cols, output_->n_slices);
+				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), ctx.output->n_rows,
+				                               ctx.output->n_cols, ctx.output->n_slices);
 			}
 
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<Cube<double>>(
-					input_->n_rows, input_->n_cols, input_->n_slices);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<Cube<double>>(
+					ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices);
 			} else {
-				localLoss_->set_size(input_->n_rows, input_->n_cols, input_->n_slices);
+				ctx.localLoss->set_size(ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices);
 			}
 
-			uword output_height = output_->n_rows;
-			uword output_width = output_->n_cols;
-			uword output_depth = output_->n_slices;
+			uword output_height = ctx.output->n_rows;
+			uword output_width = ctx.output->n_cols;
+			uword output_depth = ctx.output->n_slices;
 			Cube<double> dfdz(output_height, output_width,
 			                 output_depth);
 			for (uword c = 0; c < output_depth; ++c) {
 				for (uword col = 0; col < output_width; ++col) {
 					for (uword row = 0; row < output_height; ++row) {
 						dfdz(row, col, c) = std::pow(activFunc_->Derivative(
-							                             (*receptiveField_)(row, col, c)), 2);
+							                             (*ctx.receptiveField)(row, col, c)), 2);
 					}
 				}
 			}
@@ -296,19 +360,19 @@ namespace cnn
 				         weights_.n_slices, n_filters_),
 				tensor4d(1, 1, biasWeights_.n_slices, n_filters_));
 			// if on forward propagate was used padding for input then
-			// input_ on backward stage has already been padded
+			// ctx.input on backward stage has already been padded
 			Mat<double> input2col, kernel2col;
-			uword input_depth = input_->n_slices;
+			uword input_depth = ctx.input->n_slices;
 			// in 2nd order backpropagation we must square input
 			std::shared_ptr<Cube<double>> squaredInput = std::make_shared<Cube<double>>(
-				input_->n_rows, input_->n_cols, input_depth);
+				ctx.input->n_rows, ctx.input->n_cols, input_depth);
 			for (uword c = 0; c < input_depth; ++c) {
-				squaredInput->slice(c) = arma::square(input_->slice(c));
+				squaredInput->slice(c) = arma::square(ctx.input->slice(c));
 			}
 
 			im2col(squaredInput, prevLocalLoss, input2col, kernel2col,
 			       kernel_size_.height, kernel_size_.width);
-			Mat<double> cross_correlation = kernel2col * input2col;
+			Mat<double> cross_correlation = Gemm(kernel2col, input2col);
 			for (uword k = 0; k < n_filters_; ++k) {
 				for (uword d = 0; d < weights_.n_slices; ++d) {
 					result.first.data[k].slice(d) = arma::reshape(
@@ -330,8 +394,8 @@ namespace cnn
 			}
 
 			// propagate error to bottom layer:
-			uword unpadded_input_height = input_->n_rows - 2 * padding_.height;
-			uword unpadded_input_width = input_->n_cols - 2 * padding_.width;
+			uword unpadded_input_height = ctx.input->n_rows - 2 * padding_.height;
+			uword unpadded_input_width = ctx.input->n_cols - 2 * padding_.width;
 			// we must add zeros on borders to input loss to get conv result dimension
 			// equal to input signals
 			uword pad_h = (unpadded_input_height -
@@ -359,18 +423,18 @@ namespace cnn
 			}
 			im2col(paddedPrevLoss, squaredFlippedKernel, input2col, kernel2col,
 			       unpadded_input_height, unpadded_input_width);
-			Mat<double> convolution = kernel2col * input2col;
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<Cube<double>>(unpadded_input_height,
+			Mat<double> convolution = Gemm(kernel2col, input2col);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<Cube<double>>(unpadded_input_height,
 				                                            unpadded_input_width,
 				                                            input_depth);
 			} else {
-				localLoss_->set_size(unpadded_input_height,
+				ctx.localLoss->set_size(unpadded_input_height,
 				                     unpadded_input_width,
 				                     input_depth);
 			}
 			for (uword c = 0; c < input_depth; ++c) {
-				(*localLoss_).slice(c) = arma::reshape(convolution.row(c),
+				(*ctx.localLoss).slice(c) = arma::reshape(convolution.row(c),
 				                                       unpadded_input_height,
 				                                       unpadded_input_width);
 			}
@@ -0,0 +1,262 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "dataset_cache.hpp"
+#include <algorithm>
+#include <codecvt>
+#include <cstring>
+#include <locale>
+
+namespace cnn
+{
+	namespace
+	{
+		const char cache_magic[8] = { 'C', 'N', 'N', 'C', 'A', 'C', 'H', 'E' };
+		const std::uint32_t cache_version = 1;
+		const std::uint64_t page_size = 4096;
+
+		template <typename T>
+		void Write(std::ostream& out, const T& value)
+		{
+			out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+		}
+	}
+
+	const std::uint32_t DatasetCacheWriter::test_sample;
+
+	bool DatasetCacheWriter::Open(const std::wstring& path, arma::uword rows, arma::uword cols,
+	                              arma::uword slices)
+	{
+		out_.open(boost::filesystem::path(path), std::ios::binary | std::ios::trunc);
+		if (!out_.is_open())
+			return false;
+		std::memset(&header_, 0, sizeof(header_));
+		std::memcpy(header_.magic, cache_magic, sizeof(cache_magic));
+		header_.version = cache_version;
+		header_.rows = rows;
+		header_.cols = cols;
+		header_.slices = slices;
+		header_.data_offset = page_size;
+		records_.clear();
+		// the header is rewritten on Close()
+		std::vector<char> padding(page_size, 0);
+		out_.write(padding.data(), padding.size());
+		return static_cast<bool>(out_);
+	}
+
+	bool DatasetCacheWriter::Append(const arma::Cube<double>& image, std::uint32_t label, bool test)
+	{
+		if (!out_.is_open() || image.n_rows != header_.rows || image.n_cols != header_.cols
+			|| image.n_slices != header_.slices)
+			return false;
+		// cube memory is contiguous
+		out_.write(reinterpret_cast<const char*>(image.memptr()), image.n_elem * sizeof(double));
+		records_.emplace_back(label, test ? test_sample : 0);
+		++header_.count;
+		return static_cast<bool>(out_);
+	}
+
+	bool DatasetCacheWriter::Close(const std::vector<std::wstring>& labelNames)
+	{
+		if (!out_.is_open())
+			return false;
+		header_.records_offset = header_.data_offset
+			+ header_.count * header_.rows * header_.cols * header_.slices * sizeof(double);
+		for (const std::pair<std::uint32_t, std::uint32_t>& record : records_) {
+			Write(out_, record.first);
+			Write(out_, record.second);
+		}
+		header_.names_offset = header_.records_offset + records_.size() * 2 * sizeof(std::uint32_t);
+		std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8;
+		Write(out_, static_cast<std::uint32_t>(labelNames.size()));
+		for (const std::wstring& name : labelNames) {
+			std::string bytes = utf8.to_bytes(name);
+			Write(out_, static_cast<std::uint32_t>(bytes.size()));
+			out_.write(bytes.data(), bytes.size());
+		}
+		out_.seekp(0);
+		Write(out_, header_);
+		out_.close();
+		bool flag = !out_.fail();
+		records_.clear();
+		return flag;
+	}
+
+	CachedLoader::CachedLoader(const std::wstring& cachePath)
+		: data_(nullptr), gen_(std::random_device().operator()())
+	{
+		namespace ipc = boost::interprocess;
+		std::memset(&header_, 0, sizeof(header_));
+		std::string path = boost::filesystem::path(cachePath).string();
+		try {
+			file_ = ipc::file_mapping(path.c_str(), ipc::read_only);
+			region_ = std::make_shared<ipc::mapped_region>(file_, ipc::copy_on_write);
+		} catch (const ipc::interprocess_exception&) {
+			return;
+		}
+		const char* begin = static_cast<const char*>(region_->get_address());
+		std::size_t size = region_->get_size();
+		if (size < sizeof(header_))
+			return;
+		std::memcpy(&header_, begin, sizeof(header_));
+		if (std::memcmp(header_.magic, cache_magic, sizeof(cache_magic)) != 0
+			|| header_.version != cache_version)
+			return;
+		// sizes are checked by division, so a crafted header can't overflow them:
+		// samples must fit between the data offset and the end of the file
+		const std::uint64_t values = size / sizeof(double);
+		if (header_.data_offset > size || header_.data_offset % sizeof(double) != 0
+			|| !header_.rows || !header_.cols || !header_.slices
+			|| header_.cols > values / header_.rows
+			|| header_.slices > values / (header_.rows * header_.cols))
+			return;
+		std::uint64_t sample_size = header_.rows * header_.cols * header_.slices * sizeof(double);
+		if (header_.count > (size - header_.data_offset) / sample_size)
+			return;
+		std::uint64_t records_size = header_.count * 2 * sizeof(std::uint32_t);
+		if (header_.records_offset != header_.data_offset + header_.count * sample_size
+			|| header_.records_offset > size || records_size > size - header_.records_offset
+			|| header_.names_offset != header_.records_offset + records_size
+			|| size - header_.names_offset < sizeof(std::uint32_t))
+			return;
+
+		const char* pos = begin + header_.names_offset;
+		const char* end = begin + size;
+		std::uint32_t amount;
+		std::memcpy(&amount, pos, sizeof(amount));
+		pos += sizeof(amount);
+		std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8;
+		labels_.reserve(amount);
+		for (std::uint32_t i = 0; i < amount; ++i) {
+			std::uint32_t length;
+			if (end - pos < static_cast<std::ptrdiff_t>(sizeof(length)))
+				return;
+			std::memcpy(&length, pos, sizeof(length));
+			pos += sizeof(length);
+			if (end - pos < static_cast<std::ptrdiff_t>(length))
+				return;
+			labels_.emplace_back(utf8.from_bytes(pos, pos + length));
+			pos += length;
+		}
+
+		sampleLabels_.resize(header_.count);
+		trainByLabel_.resize(labels_.size());
+		const char* record = begin + header_.records_offset;
+		for (std::size_t i = 0; i < header_.count; ++i, record += 2 * sizeof(std::uint32_t)) {
+			std::uint32_t label, flags;
+			std::memcpy(&label, record, sizeof(label));
+			std::memcpy(&flags, record + sizeof(label), sizeof(flags));
+			if (label >= labels_.size())
+				return;
+			sampleLabels_[i] = label;
+			if (flags & DatasetCacheWriter::test_sample) {
+				test_.push_back(i);
+			} else {
+				trainByLabel_[label].push_back(i);
+				train_.push_back(i);
+			}
+		}
+		for (std::size_t label = 0; label < trainByLabel_.size(); ++label) {
+			if (!trainByLabel_[label].empty())
+				nonEmptyLabels_.push_back(label);
+		}
+		data_ = reinterpret_cast<double*>(static_cast<char*>(region_->get_address())
+		                                  + header_.data_offset);
+	}
+
+	bool CachedLoader::LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                 arma::Col<double>& labels)
+	{
+		if (!is_open() || test_.empty())
+			return false;
+		std::uniform_int_distribution<std::size_t> uid(0, test_.size() - 1);
+		std::size_t idx = test_[uid(gen_)];
+		dst = sample(idx);
+		setLabels(sampleLabels_[idx], labels);
+		return true;
+	}
+
+	bool CachedLoader::LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+	                                  arma::uword& label) const
+	{
+		if (!is_open() || idx >= test_.size())
+			return false;
+		dst = sample(test_[idx]);
+		label = sampleLabels_[test_[idx]];
+		return true;
+	}
+
+	bool CachedLoader::LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                  arma::Col<double>& labels)
+	{
+		if (!is_open() || nonEmptyLabels_.empty())
+			return false;
+		std::size_t idx = pickTrainSample();
+		dst = sample(idx);
+		setLabels(sampleLabels_[idx], labels);
+		return true;
+	}
+
+	bool CachedLoader::LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+	                                  arma::Col<arma::uword>& labels)
+	{
+		if (!is_open() || nonEmptyLabels_.empty())
+			return false;
+		if (buffer.n_rows != header_.rows || buffer.n_cols != header_.cols
+			|| buffer.n_slices != header_.slices * n) {
+			buffer.set_size(header_.rows, header_.cols, header_.slices * n);
+		}
+		labels.set_size(n);
+		std::size_t sample_size = header_.rows * header_.cols * header_.slices;
+		for (std::size_t i = 0; i < n; ++i) {
+			std::size_t idx = pickTrainSample();
+			const double* src = data_ + idx * sample_size;
+			std::copy(src, src + sample_size, buffer.slice_memptr(i * header_.slices));
+			labels(i) = sampleLabels_[idx];
+		}
+		return true;
+	}
+
+	void CachedLoader::SetEpochSampling(std::uint32_t seed, std::size_t rank, std::size_t ranks)
+	{
+		sampler_ = EpochSampler(train_.size(), seed, rank, ranks);
+	}
+
+	std::size_t CachedLoader::pickTrainSample()
+	{
+		if (!sampler_.empty())
+			return train_[sampler_.Next()];
+		std::uniform_int_distribution<std::size_t> uid(0, nonEmptyLabels_.size() - 1);
+		const std::vector<std::size_t>& samples = trainByLabel_[nonEmptyLabels_[uid(gen_)]];
+		std::uniform_int_distribution<std::size_t> image(0, samples.size() - 1);
+		return samples[image(gen_)];
+	}
+
+	std::shared_ptr<arma::Cube<double>> CachedLoader::sample(std::size_t idx) const
+	{
+		std::size_t sample_size = header_.rows * header_.cols * header_.slices;
+		// the cube uses mapped memory directly and keeps the mapping alive
+		std::shared_ptr<boost::interprocess::mapped_region> region = region_;
+		return std::shared_ptr<arma::Cube<double>>(
+			new arma::Cube<double>(data_ + idx * sample_size, header_.rows, header_.cols,
+			                       header_.slices, false, true),
+			[region](arma::Cube<double>* cube) { delete cube; });
+	}
+
+	void CachedLoader::setLabels(std::uint32_t label, arma::Col<double>& labels) const
+	{
+		labels.set_size(labels_.size());
+		labels.fill(0);
+		labels(label) = 1;
+	}
+}
@@ -0,0 +1,323 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "distributed.hpp"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace cnn
+{
+	namespace distributed
+	{
+		namespace ipc = boost::interprocess;
+
+		SharedMemoryTransport::SharedMemoryTransport(const std::string& name,
+		                                             std::size_t rank, std::size_t size,
+		                                             std::chrono::milliseconds timeout)
+			: segment_(ipc::open_only, name.c_str()),
+			rank_(rank), size_(size), timeout_(timeout)
+		{
+#ifndef NDEBUG
+			assert(rank < size);
+#endif
+			std::size_t prev = (rank + size - 1) % size;
+			out_ = segment_.find<Channel>(ChannelName(rank).c_str()).first;
+			outBuffer_ = segment_.find<double>(BufferName(rank).c_str()).first;
+			in_ = segment_.find<Channel>(ChannelName(prev).c_str()).first;
+			inBuffer_ = segment_.find<double>(BufferName(prev).c_str()).first;
+			if (!(out_ && outBuffer_ && in_ && inBuffer_)) {
+				throw std::runtime_error("shared memory segment " + name
+				                         + " was created for fewer workers");
+			}
+		}
+
+		void SharedMemoryTransport::Create(const std::string& name, std::size_t size,
+		                                   std::size_t channelCapacity)
+		{
+			ipc::shared_memory_object::remove(name.c_str());
+			std::size_t bytes = size * (channelCapacity * sizeof(double) + 4096) + 65536;
+			ipc::managed_shared_memory segment(ipc::create_only, name.c_str(), bytes);
+			for (std::size_t r = 0; r < size; ++r) {
+				Channel* channel = segment.construct<Channel>(ChannelName(r).c_str())();
+				channel->written.store(0);
+				channel->read.store(0);
+				channel->capacity = channelCapacity;
+				segment.construct<double>(BufferName(r).c_str())[channelCapacity](0.0);
+			}
+		}
+
+		void SharedMemoryTransport::Remove(const std::string& name) noexcept
+		{
+			ipc::shared_memory_object::remove(name.c_str());
+		}
+
+		bool SharedMemoryTransport::Exchange(const double* send, std::size_t sendCount,
+		                                     double* recv, std::size_t recvCount)
+		{
+			// both directions must progress together, otherwise all workers
+			// can block on full channels at the same time
+			std::size_t sent = 0;
+			std::size_t received = 0;
+			std::uint64_t outCapacity = out_->capacity;
+			std::uint64_t inCapacity = in_->capacity;
+			auto lastProgress = std::chrono::steady_clock::now();
+			while (sent < sendCount || received < recvCount) {
+				bool progress = false;
+				if (sent < sendCount) {
+					std::uint64_t written = out_->written.load(std::memory_order_relaxed);
+					std::uint64_t read = out_->read.load(std::memory_order_acquire);
+					std::size_t amount = static_cast<std::size_t>(std::min<std::uint64_t>(
+						outCapacity - (written - read), sendCount - sent));
+					for (std::size_t done = 0; done < amount;) {
+						std::size_t pos = static_cast<std::size_t>((written + done) % outCapacity);
+						std::size_t part = std::min<std::size_t>(amount - done, outCapacity - pos);
+						std::memcpy(outBuffer_ + pos, send + sent + done, part * sizeof(double));
+						done += part;
+					}
+					if (amount != 0) {
+						out_->written.store(written + amount, std::memory_order_release);
+						sent += amount;
+						progress = true;
+					}
+				}
+				if (received < recvCount) {
+					std::uint64_t written = in_->written.load(std::memory_order_acquire);
+					std::uint64_t read = in_->read.load(std::memory_order_relaxed);
+					std::size_t amount = static_cast<std::size_t>(std::min<std::uint64_t>(
+						written - read, recvCount - received));
+					for (std::size_t done = 0; done < amount;) {
+						std::size_t pos = static_cast<std::size_t>((read + done) % inCapacity);
+						std::size_t part = std::min<std::size_t>(amount - done, inCapacity - pos);
+						std::memcpy(recv + received + done, inBuffer_ + pos, part * sizeof(double));
+						done += part;
+					}
+					if (amount != 0) {
+						in_->read.store(read + amount, std::memory_order_release);
+						received += amount;
+						progress = true;
+					}
+				}
+				if (progress) {
+					lastProgress = std::chrono::steady_clock::now();
+				} else if (std::chrono::steady_clock::now() - lastProgress > timeout_) {
+					return false;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+			return true;
+		}
+
+		std::string SharedMemoryTransport::ChannelName(std::size_t rank)
+		{
+			return "channel_" + std::to_string(rank);
+		}
+
+		std::string SharedMemoryTransport::BufferName(std::size_t rank)
+		{
+			return "buffer_" + std::to_string(rank);
+		}
+
+		bool RingAllReduce(BaseTransport& transport, std::vector<double>& data)
+		{
+			std::size_t size = transport.Size();
+			std::size_t rank = transport.Rank();
+			if (size == 1 || data.empty())
+				return true;
+			// split data to size chunks, the last chunks may be one value shorter
+			std::vector<std::size_t> offset(size + 1, 0);
+			for (std::size_t i = 0; i < size; ++i) {
+				offset[i + 1] = offset[i] + data.size() / size + (i < data.size() % size ? 1 : 0);
+			}
+			std::vector<double> chunk(offset[1] - offset[0]);
+			// reduce-scatter: after size - 1 steps worker owns the sum of chunk (rank + 1) % size
+			for (std::size_t step = 0; step + 1 < size; ++step) {
+				std::size_t sendIdx = (rank + size - step) % size;
+				std::size_t recvIdx = (rank + 2 * size - step - 1) % size;
+				std::size_t recvCount = offset[recvIdx + 1] - offset[recvIdx];
+				if (!transport.Exchange(data.data() + offset[sendIdx],
+				                        offset[sendIdx + 1] - offset[sendIdx],
+				                        chunk.data(), recvCount))
+					return false;
+				for (std::size_t i = 0; i < recvCount; ++i) {
+					data[offset[recvIdx] + i] += chunk[i];
+				}
+			}
+			// all-gather: pass reduced chunks around the ring
+			for (std::size_t step = 0; step + 1 < size; ++step) {
+				std::size_t sendIdx = (rank + 1 + size - step) % size;
+				std::size_t recvIdx = (rank + size - step) % size;
+				if (!transport.Exchange(data.data() + offset[sendIdx],
+				                        offset[sendIdx + 1] - offset[sendIdx],
+				                        data.data() + offset[recvIdx],
+				                        offset[recvIdx + 1] - offset[recvIdx]))
+					return false;
+			}
+			return true;
+		}
+
+		bool Broadcast(BaseTransport& transport, std::vector<double>& data)
+		{
+			// x + 0 == x exactly, so sum with zeros is a broadcast
+			if (transport.Rank() != 0) {
+				std::fill(data.begin(), data.end(), 0.0);
+			}
+			return RingAllReduce(transport, data);
+		}
+
+		bool AllGather(BaseTransport& transport, const std::string& value,
+		               std::vector<std::string>& dst)
+		{
+			// every worker fills only its own part of zeros, so the sum is the
+			// concatenation. lengths are exchanged first to place the parts
+			std::size_t size = transport.Size();
+			std::size_t rank = transport.Rank();
+			std::vector<double> lengths(size, 0.0);
+			lengths[rank] = static_cast<double>(value.size());
+			if (!RingAllReduce(transport, lengths))
+				return false;
+			std::vector<std::size_t> offset(size + 1, 0);
+			for (std::size_t i = 0; i < size; ++i) {
+				offset[i + 1] = offset[i] + static_cast<std::size_t>(lengths[i]);
+			}
+			std::vector<double> bytes(offset[size], 0.0);
+			for (std::size_t i = 0; i < value.size(); ++i) {
+				bytes[offset[rank] + i] = static_cast<unsigned char>(value[i]);
+			}
+			if (!RingAllReduce(transport, bytes))
+				return false;
+			dst.assign(size, std::string());
+			for (std::size_t r = 0; r < size; ++r) {
+				dst[r].reserve(offset[r + 1] - offset[r]);
+				for (std::size_t i = offset[r]; i < offset[r + 1]; ++i) {
+					dst[r].push_back(static_cast<char>(static_cast<unsigned char>(bytes[i])));
+				}
+			}
+			return true;
+		}
+
+		void Flatten(const std::vector<std::pair<tensor4d, tensor4d>>& src,
+		             std::vector<double>& dst)
+		{
+			std::size_t size = 0;
+			for (const std::pair<tensor4d, tensor4d>& layer : src) {
+				for (const arma::Cube<double>& cube : layer.first.data)
+					size += cube.n_elem;
+				for (const arma::Cube<double>& cube : layer.second.data)
+					size += cube.n_elem;
+			}
+			dst.resize(size);
+			double* pos = dst.data();
+			for (const std::pair<tensor4d, tensor4d>& layer : src) {
+				for (const arma::Cube<double>& cube : layer.first.data)
+					pos = std::copy(cube.memptr(), cube.memptr() + cube.n_elem, pos);
+				for (const arma::Cube<double>& cube : layer.second.data)
+					pos = std::copy(cube.memptr(), cube.memptr() + cube.n_elem, pos);
+			}
+		}
+
+		void Unflatten(const std::vector<double>& src,
+		               std::vector<std::pair<tensor4d, tensor4d>>& dst)
+		{
+			const double* pos = src.data();
+			for (std::pair<tensor4d, tensor4d>& layer : dst) {
+				for (arma::Cube<double>& cube : layer.first.data) {
+					std::copy(pos, pos + cube.n_elem, cube.memptr());
+					pos += cube.n_elem;
+				}
+				for (arma::Cube<double>& cube : layer.second.data) {
+					std::copy(pos, pos + cube.n_elem, cube.memptr());
+					pos += cube.n_elem;
+				}
+			}
+#ifndef NDEBUG
+			assert(pos == src.data() + src.size());
+#endif
+		}
+
+		void FlattenWeights(nn::NeuralNetwork& net, std::vector<double>& dst)
+		{
+			dst.clear();
+			for (std::size_t n = 0; n < net.Size(); ++n) {
+				for (const arma::Cube<double>& cube : net.Weights(n).data)
+					dst.insert(dst.end(), cube.memptr(), cube.memptr() + cube.n_elem);
+				for (const arma::Cube<double>& cube : net.BiasWeights(n).data)
+					dst.insert(dst.end(), cube.memptr(), cube.memptr() + cube.n_elem);
+			}
+		}
+
+		void UnflattenWeights(const std::vector<double>& src, nn::NeuralNetwork& net)
+		{
+			const double* pos = src.data();
+			for (std::size_t n = 0; n < net.Size(); ++n) {
+				for (arma::Cube<double>& cube : net.Weights(n).data) {
+					std::copy(pos, pos + cube.n_elem, cube.memptr());
+					pos += cube.n_elem;
+				}
+				for (arma::Cube<double>& cube : net.BiasWeights(n).data) {
+					std::copy(pos, pos + cube.n_elem, cube.memptr());
+					pos += cube.n_elem;
+				}
+			}
+#ifndef NDEBUG
+			assert(pos == src.data() + src.size());
+#endif
+		}
+
+		bool RunLocalWorkers(std::size_t amount,
+		                     const std::function<int(std::size_t rank)>& worker)
+		{
+#if defined(__unix__) || defined(__APPLE__)
+			std::cout.flush();
+			std::vector<pid_t> children;
+			children.reserve(amount);
+			bool success = true;
+			for (std::size_t rank = 0; rank < amount; ++rank) {
+				pid_t pid = fork();
+				if (pid == 0) {
+					int code = 1;
+					try {
+						code = worker(rank);
+					} catch (const std::exception& e) {
+						std::cerr << "worker " << rank << " failed: " << e.what() << "\n";
+					}
+					std::cout.flush();
+					// don't run destructors of objects inherited from the parent
+					_exit(code);
+				}
+				if (pid < 0) {
+					success = false;
+					break;
+				}
+				children.push_back(pid);
+			}
+			for (pid_t pid : children) {
+				int status = 0;
+				if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+					success = false;
+			}
+			return success;
+#else
+			return false;
+#endif
+		}
+	}
+}
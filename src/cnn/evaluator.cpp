@@ -0,0 +1,144 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "evaluator.hpp"
+#include "distributed.hpp"
+#include "test_evaluation.hpp"
+#include <algorithm>
+#include <utility>
+
+namespace cnn
+{
+	Evaluator::Evaluator(std::shared_ptr<nn::NeuralNetwork> net, std::size_t threads)
+		: net_(net), pool_(threads), pendingEpoch_(0), pendingSamples_(0),
+		hasPending_(false), running_(false), skipped_(0), stop_(false)
+	{
+#ifndef NDEBUG
+		assert(net_);
+#endif
+		for (std::size_t i = 0; i < pool_.Size(); ++i) {
+			contexts_.emplace_back(net_->CreateContext());
+		}
+		thread_ = std::thread(&Evaluator::Run, this);
+	}
+
+	Evaluator::~Evaluator()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		changed_.notify_all();
+		thread_.join();
+	}
+
+	void Evaluator::Submit(nn::NeuralNetwork& trained, std::uint64_t epoch, std::size_t samples)
+	{
+		// the copy is the only work done on the caller thread
+		std::vector<double> weights;
+		distributed::FlattenWeights(trained, weights);
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (hasPending_)
+				++skipped_;
+			pending_.swap(weights);
+			pendingEpoch_ = epoch;
+			pendingSamples_ = samples;
+			hasPending_ = true;
+		}
+		changed_.notify_all();
+	}
+
+	std::vector<EvaluationResult> Evaluator::Results()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<EvaluationResult> results(std::make_move_iterator(results_.begin()),
+		                                      std::make_move_iterator(results_.end()));
+		results_.clear();
+		return results;
+	}
+
+	void Evaluator::Flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this]() { return !hasPending_ && !running_; });
+	}
+
+	std::size_t Evaluator::Skipped() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return skipped_;
+	}
+
+	void Evaluator::Run()
+	{
+		std::vector<double> weights;
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;) {
+			changed_.wait(lock, [this]() { return stop_ || hasPending_; });
+			if (stop_)
+				return;
+			weights.swap(pending_);
+			std::uint64_t epoch = pendingEpoch_;
+			std::size_t samples = pendingSamples_;
+			hasPending_ = false;
+			running_ = true;
+			lock.unlock();
+
+			distributed::UnflattenWeights(weights, *net_);
+			EvaluationResult result = Evaluate(epoch, samples);
+
+			lock.lock();
+			results_.emplace_back(std::move(result));
+			running_ = false;
+			changed_.notify_all();
+		}
+	}
+
+	EvaluationResult Evaluator::Evaluate(std::uint64_t epoch, std::size_t samples)
+	{
+		evaluation::Tally tally;
+		std::size_t images = net_->TestImages();
+		if (images != 0) {
+			// addressable test images are decoded by all workers at once
+			tally = evaluation::EvaluateSamples(*net_, pool_, contexts_, std::min(samples, images),
+			                                    [this](std::size_t idx, nn::ExecutionContext& ctx,
+			                                           arma::uword& label)
+			{
+				return net_->LoadTestSample(idx, ctx, label);
+			}, 5);
+		} else {
+			tally = evaluation::EvaluateSamples(*net_, pool_, contexts_, samples,
+			                                    [this](std::size_t, nn::ExecutionContext& ctx,
+			                                           arma::uword& label)
+			{
+				std::lock_guard<std::mutex> lock(loaderMutex_);
+				if (!net_->LoadTestImage(ctx))
+					return false;
+				label = ctx.Labels().index_max();
+				return true;
+			}, 5, 1);
+		}
+
+		EvaluationResult result;
+		result.epoch = epoch;
+		result.samples = tally.evaluated;
+		result.failed = tally.failed;
+		double evaluated = result.samples ? static_cast<double>(result.samples) : 1.0;
+		result.loss = tally.loss / evaluated;
+		result.top1 = tally.top1 / evaluated;
+		result.top5 = tally.top_k / evaluated;
+		result.confusion = std::move(tally.confusion);
+		return result;
+	}
+}
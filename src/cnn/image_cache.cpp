@@ -0,0 +1,96 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "image_cache.hpp"
+#include <algorithm>
+
+namespace cnn
+{
+	namespace
+	{
+		std::size_t ImageBytes(const arma::Cube<double>& image) noexcept
+		{
+			return image.n_elem * sizeof(double);
+		}
+	}
+
+	ImageCache::ImageCache(std::size_t capacity)
+		: capacity_(capacity), bytes_(0), hits_(0), misses_(0)
+	{}
+
+	bool ImageCache::Get(const std::string& key, arma::Cube<double>& dst)
+	{
+		std::shared_ptr<const arma::Cube<double>> image;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			auto it = index_.find(key);
+			if (it == index_.end()) {
+				++misses_;
+				return false;
+			}
+			++hits_;
+			items_.splice(items_.begin(), items_, it->second);
+			image = it->second->second;
+		}
+		// the image is immutable, so it is copied without the lock
+		if (dst.n_rows != image->n_rows || dst.n_cols != image->n_cols
+			|| dst.n_slices != image->n_slices) {
+			dst.set_size(image->n_rows, image->n_cols, image->n_slices);
+		}
+		std::copy(image->begin(), image->end(), dst.begin());
+		return true;
+	}
+
+	void ImageCache::Put(const std::string& key, const arma::Cube<double>& image)
+	{
+		std::size_t size = ImageBytes(image);
+		if (size > capacity_)
+			return;
+		std::shared_ptr<const arma::Cube<double>> copy = std::make_shared<const arma::Cube<double>>(image);
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = index_.find(key);
+		if (it != index_.end()) {
+			bytes_ -= ImageBytes(*it->second->second);
+			it->second->second = std::move(copy);
+			items_.splice(items_.begin(), items_, it->second);
+		} else {
+			items_.emplace_front(key, std::move(copy));
+			index_.emplace(key, items_.begin());
+		}
+		bytes_ += size;
+		while (bytes_ > capacity_) {
+			bytes_ -= ImageBytes(*items_.back().second);
+			index_.erase(items_.back().first);
+			items_.pop_back();
+		}
+	}
+
+	void ImageCache::Clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		items_.clear();
+		index_.clear();
+		bytes_ = 0;
+	}
+
+	ImageCacheStats ImageCache::Stats() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		ImageCacheStats stats;
+		stats.hits = hits_;
+		stats.misses = misses_;
+		stats.entries = index_.size();
+		stats.bytes = bytes_;
+		return stats;
+	}
+}
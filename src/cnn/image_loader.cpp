@@ -12,86 +12,547 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "image_loader.hpp"
+#include "dataset_cache.hpp"
+#include "trace.hpp"
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
+#include <boost/filesystem/fstream.hpp>
 #include <algorithm>
+#include <codecvt>
+#include <limits>
+#include <locale>
 #include <random>
 #include <cstddef>
 
 namespace cnn
 {
+	namespace
+	{
+		const wchar_t index_magic[] = L"lfw-index";
+		const int index_version = 1;
+		// faces of lfw images (250x250) are in this region
+		const cv::Rect face_roi(70, 78, 125, 94);
+
+		// index files are utf-8 whatever the platform wide encoding is
+		void imbueUtf8(std::wios& stream)
+		{
+			stream.imbue(std::locale(stream.getloc(), new std::codecvt_utf8<wchar_t>));
+		}
+	}
+
+	LfwLoader::LfwLoader(const std::wstring& dataSetPath, const std::wstring& trainPath,
+	                     const std::wstring& testPath, cv::Size scaleSize,
+	                     const std::wstring& indexPath)
+		: dataset_dir_(dataSetPath), scaleSize_(scaleSize),
+		decodeFlag_(cv::IMREAD_COLOR), decodeROI_(face_roi), reducedDecode_(false),
+		augment_(false), nextReadTag_(0), gen_(std::random_device().operator()())
+	{
+		SetReducedDecoding(true);
+#ifndef NDEBUG
+		assert(boost::filesystem::is_directory(dataset_dir_));
+#endif
+		bool flag = readFolderList(trainPath, trainDataSet_);
+		flag = readFolderList(testPath, testDataSet_) && flag;
+#ifndef NDEBUG
+		assert(flag);
+#endif
+		labels_.reserve(trainDataSet_.size() + 1);
+		labels_.emplace_back(L"Unknown");
+		for (const Folder& folder : trainDataSet_) {
+			labels_.emplace_back(folder.name);
+		}
+
+		if (indexPath.empty() || !loadIndex(indexPath)) {
+			scanFolders(trainDataSet_);
+			scanFolders(testDataSet_);
+			if (!indexPath.empty()) {
+				SaveIndex(indexPath);
+			}
+		}
+		testOffsets_.reserve(testDataSet_.size());
+		std::size_t amount = 0;
+		for (const Folder& folder : testDataSet_) {
+			testOffsets_.push_back(amount);
+			amount += folder.images.size();
+		}
+	}
+
+	bool LfwLoader::ReadFolderNames(const std::wstring& listPath, std::vector<std::wstring>& dst)
+	{
+		// boost stream opens wide paths on every platform
+		boost::filesystem::wifstream in{ boost::filesystem::path(listPath) };
+		if (!in.is_open())
+			return false;
+		std::size_t folders_amount;
+		in >> folders_amount;
+		dst.reserve(folders_amount);
+		std::wstring folder_name;
+		// the image amount of the list isn't used, folders are indexed instead
+		arma::uword image_amount;
+		while (in >> folder_name >> image_amount) {
+			dst.push_back(folder_name);
+		}
+		return true;
+	}
+
+	bool LfwLoader::readFolderList(const std::wstring& listPath, std::vector<Folder>& dst)
+	{
+		std::vector<std::wstring> names;
+		if (!ReadFolderNames(listPath, names))
+			return false;
+		dst.reserve(names.size());
+		for (std::wstring& name : names) {
+			dst.push_back(Folder{ std::move(name), {} });
+		}
+		return true;
+	}
+
+	void LfwLoader::scanFolders(std::vector<Folder>& folders) const
+	{
+		namespace fs = boost::filesystem;
+		for (Folder& folder : folders) {
+			folder.images.clear();
+			fs::path dir_path = dataset_dir_ / folder.name;
+			if (!fs::is_directory(dir_path))
+				continue;
+			for (fs::directory_iterator it(dir_path), end; it != end; ++it) {
+				if (fs::is_regular_file(it->status())
+					&& it->path().filename() != fs::path("Thumbs.db")) {
+					folder.images.push_back(it->path());
+				}
+			}
+			// directory order isn't specified, keep the index reproducible
+			std::sort(folder.images.begin(), folder.images.end());
+		}
+	}
+
+	bool LfwLoader::SaveIndex(const std::wstring& indexPath) const
+	{
+		namespace fs = boost::filesystem;
+		fs::wofstream out(fs::path(indexPath), std::ios::trunc);
+		if (!out.is_open())
+			return false;
+		imbueUtf8(out);
+		out << index_magic << L" " << index_version << L"\n";
+		for (const std::vector<Folder>* set : { &trainDataSet_, &testDataSet_ }) {
+			out << set->size() << L"\n";
+			for (const Folder& folder : *set) {
+				out << folder.name << L" " << folder.images.size() << L"\n";
+				// file names may contain spaces, one per line
+				for (const fs::path& image : folder.images) {
+					out << image.filename().wstring() << L"\n";
+				}
+			}
+		}
+		return static_cast<bool>(out);
+	}
+
+	bool LfwLoader::loadIndex(const std::wstring& indexPath)
+	{
+		namespace fs = boost::filesystem;
+		fs::wifstream in{ fs::path(indexPath) };
+		if (!in.is_open())
+			return false;
+		imbueUtf8(in);
+		std::wstring magic;
+		int version;
+		if (!(in >> magic >> version) || magic != index_magic || version != index_version)
+			return false;
+
+		std::vector<Folder> train = trainDataSet_;
+		std::vector<Folder> test = testDataSet_;
+		for (std::vector<Folder>* set : { &train, &test }) {
+			std::size_t folders_amount;
+			if (!(in >> folders_amount) || folders_amount != set->size())
+				return false;
+			for (Folder& folder : *set) {
+				std::wstring name;
+				std::size_t image_amount;
+				// the index is stale if folders were changed in the lists
+				if (!(in >> name >> image_amount) || name != folder.name)
+					return false;
+				in.ignore(std::numeric_limits<std::streamsize>::max(), L'\n');
+				fs::path dir_path = dataset_dir_ / folder.name;
+				folder.images.reserve(image_amount);
+				std::wstring file_name;
+				for (std::size_t i = 0; i < image_amount; ++i) {
+					if (!std::getline(in, file_name))
+						return false;
+					folder.images.push_back(dir_path / file_name);
+				}
+			}
+		}
+		trainDataSet_ = std::move(train);
+		testDataSet_ = std::move(test);
+		return true;
+	}
+
+	bool LfwLoader::WriteCache(const std::wstring& cachePath) const
+	{
+		DatasetCacheWriter writer;
+		bool opened = false;
+		std::shared_ptr<arma::Cube<double>> image;
+		// train images are labeled by folder, test ones are unknown persons
+		for (const std::vector<Folder>* set : { &trainDataSet_, &testDataSet_ }) {
+			bool test = set == &testDataSet_;
+			for (std::size_t id = 0; id < set->size(); ++id) {
+				std::uint32_t label = test ? 0 : static_cast<std::uint32_t>(id + 1);
+				for (const boost::filesystem::path& path : (*set)[id].images) {
+					if (!loadImage(path, image, nullptr))
+						continue;
+					if (!opened) {
+						if (!writer.Open(cachePath, image->n_rows, image->n_cols, image->n_slices))
+							return false;
+						opened = true;
+					}
+					if (!writer.Append(*image, label, test))
+						return false;
+				}
+			}
+		}
+		return opened && writer.Close(labels_);
+	}
+
+	std::size_t LfwLoader::countImages(const std::vector<Folder>& folders) noexcept
+	{
+		std::size_t amount = 0;
+		for (const Folder& folder : folders) {
+			amount += folder.images.size();
+		}
+		return amount;
+	}
+
 	bool LfwLoader::LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst, 
 								  arma::Col<double> &labels)
 	{
 		if (testDataSet_.empty())
 			return false;
 		std::size_t amount = testDataSet_.size();
-		static std::mt19937 gen(std::random_device().operator()());
-		std::uniform_int_distribution<std::size_t> uid(0, amount);
+		std::uniform_int_distribution<std::size_t> uid(0, amount - 1);
 
-		arma::uword id = uid(gen);
-		labels.set_size(trainDataSet_.size());
+		const Folder& folder = testDataSet_[uid(gen_)];
+		if (folder.images.empty())
+			return false;
+		std::uniform_int_distribution<std::size_t> image(0, folder.images.size() - 1);
+		labels.set_size(labels_.size());
 		labels.fill(0);
 		labels[0] = 1;
-		return loadImage(testDataSet_[id].first, dst);
+		return loadImage(folder.images[image(gen_)], dst, nullptr);
+	}
+
+	bool LfwLoader::LoadTestSample(std::size_t idx, std::shared_ptr<arma::Cube<double>>& dst,
+	                               arma::uword& label) const
+	{
+		if (testDataSet_.empty() || idx >= testOffsets_.back() + testDataSet_.back().images.size())
+			return false;
+		std::size_t id = std::upper_bound(testOffsets_.begin(), testOffsets_.end(), idx)
+			- testOffsets_.begin() - 1;
+		label = 0;
+		return loadImage(testDataSet_[id].images[idx - testOffsets_[id]], dst, nullptr);
 	}
 
 	bool LfwLoader::LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst, 
 								   arma::Col<double> &labels)
 	{
-		if (trainDataSet_.empty())
+		arma::uword id;
+		if (reader_ || !readyImages_.empty()) {
+			std::shared_ptr<arma::Cube<double>> image = std::make_shared<arma::Cube<double>>(
+				scaleSize_.width, scaleSize_.height, 3);
+			if (!loadTrainAsync(*image, id))
+				return false;
+			dst = std::move(image);
+		} else {
+			const boost::filesystem::path* path = pickTrainImage(id);
+			if (!path || !loadImage(*path, dst, augment_ ? &gen_ : nullptr))
+				return false;
+		}
+		labels.set_size(labels_.size());
+		labels.fill(0);
+		labels(id + 1) = 1;
+		return true;
+	}
+
+	bool LfwLoader::LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+								   arma::Col<arma::uword>& labels)
+	{
+		// cvMat2armaCube gives (width, height, 3) cubes
+		const arma::uword depth = 3;
+		if (buffer.n_rows != arma::uword(scaleSize_.width)
+			|| buffer.n_cols != arma::uword(scaleSize_.height) || buffer.n_slices != depth * n) {
+			buffer.set_size(scaleSize_.width, scaleSize_.height, depth * n);
+		}
+		labels.set_size(n);
+		for (std::size_t i = 0; i < n; ++i) {
+			arma::uword id;
+			// view of the buffer, nothing is allocated for the image
+			arma::Cube<double> image(buffer.slice_memptr(i * depth), buffer.n_rows,
+									 buffer.n_cols, depth, false, true);
+			if (reader_ || !readyImages_.empty()) {
+				if (!loadTrainAsync(image, id))
+					return false;
+			} else {
+				const boost::filesystem::path* path = pickTrainImage(id);
+				if (!path || !loadImage(*path, image, augment_ ? &gen_ : nullptr))
+					return false;
+			}
+			labels(i) = id + 1;
+		}
+		return true;
+	}
+
+	bool LfwLoader::fillReadWindow()
+	{
+		std::mt19937* augment = augment_ ? &gen_ : nullptr;
+		while (pendingReads_.size() + readyImages_.size() < reader_->Depth()) {
+			arma::uword id;
+			const boost::filesystem::path* path = pickTrainImage(id);
+			if (!path)
+				return false;
+			if (cache_ && !augment) {
+				arma::Cube<double> image(scaleSize_.width, scaleSize_.height, 3);
+				if (cache_->Get(cacheKey(*path), image)) {
+					readyImages_.emplace_back(std::move(image), id);
+					continue;
+				}
+			}
+			std::size_t tag = nextReadTag_++;
+			pendingReads_.emplace(tag, PendingRead{ id, path });
+			reader_->Submit(*path, tag);
+		}
+		return true;
+	}
+
+	bool LfwLoader::loadTrainAsync(arma::Cube<double>& dst, arma::uword& id)
+	{
+		if (!readyImages_.empty()) {
+			// a view of a batch buffer gets a copy, a new image takes the memory
+			dst = std::move(readyImages_.front().first);
+			id = readyImages_.front().second;
+			readyImages_.pop_front();
+			if (reader_) {
+				fillReadWindow();
+			}
+			return true;
+		}
+		if (!reader_ || (!fillReadWindow() && pendingReads_.empty()))
 			return false;
+		ReadResult result;
+		if (!reader_->Wait(result))
+			return false;
+		PendingRead read = takeRead(result);
+		// the next read starts before this image is decoded
+		fillReadWindow();
+		return decodeRead(result, read, dst, id);
+	}
+
+	LfwLoader::PendingRead LfwLoader::takeRead(const ReadResult& result)
+	{
+		auto it = pendingReads_.find(result.tag);
+		PendingRead read = it->second;
+		pendingReads_.erase(it);
+		return read;
+	}
+
+	bool LfwLoader::decodeRead(const ReadResult& result, const PendingRead& read,
+	                           arma::Cube<double>& dst, arma::uword& id)
+	{
+		CNN_TRACE_SCOPE("decode", "loader");
+		// settings may have changed since the read was submitted, the image is
+		// decoded and cached with the current ones
+		std::mt19937* augment = augment_ ? &gen_ : nullptr;
+		cv::Mat scaled;
+		if (!result.ok || !scaleImage(cv::imdecode(result.data, decodeFlag_), scaled, augment))
+			return false;
+		convertImage(scaled, cache_ && !augment ? cacheKey(*read.path) : std::string(),
+		             dst, augment);
+		id = read.id;
+		return true;
+	}
+
+	void LfwLoader::SetAsyncReading(std::size_t depth)
+	{
+		// the sampler has handed out the images in flight already, so they are
+		// decoded and returned before the next picked ones. failed reads are lost
+		// as they would be otherwise
+		if (reader_) {
+			ReadResult result;
+			while (!pendingReads_.empty() && reader_->Wait(result)) {
+				arma::Cube<double> image(scaleSize_.width, scaleSize_.height, 3);
+				arma::uword id;
+				if (decodeRead(result, takeRead(result), image, id)) {
+					readyImages_.emplace_back(std::move(image), id);
+				}
+			}
+			pendingReads_.clear();
+		}
+		if (depth) {
+			reader_ = std::make_unique<AsyncFileReader>(depth);
+		} else {
+			reader_.reset();
+		}
+	}
+
+	void LfwLoader::SetEpochSampling(std::uint32_t seed, std::size_t rank, std::size_t ranks)
+	{
+		trainOffsets_.clear();
+		trainOffsets_.reserve(trainDataSet_.size());
+		std::size_t amount = 0;
+		for (const Folder& folder : trainDataSet_) {
+			trainOffsets_.push_back(amount);
+			amount += folder.images.size();
+		}
+		sampler_ = EpochSampler(amount, seed, rank, ranks);
+	}
+
+	const boost::filesystem::path* LfwLoader::pickTrainImage(arma::uword& id)
+	{
+		if (!sampler_.empty()) {
+			std::size_t idx = sampler_.Next();
+			// the last folder starting at idx or before is the non-empty one
+			id = std::upper_bound(trainOffsets_.begin(), trainOffsets_.end(), idx)
+				- trainOffsets_.begin() - 1;
+			return &trainDataSet_[id].images[idx - trainOffsets_[id]];
+		}
+		if (trainDataSet_.empty())
+			return nullptr;
 		std::size_t amount = trainDataSet_.size();
-		static std::mt19937 gen(std::random_device().operator()());
 		std::uniform_int_distribution<std::size_t> uid(0, amount - 1);
 
-		arma::uword id = uid(gen);
-		labels.set_size(labels_.size());
-		labels.fill(0);
-		labels(id + 1) = 1;
-		return loadImage(trainDataSet_[id].first, dst);
+		id = uid(gen_);
+		const Folder& folder = trainDataSet_[id];
+		if (folder.images.empty())
+			return nullptr;
+		std::uniform_int_distribution<std::size_t> image(0, folder.images.size() - 1);
+		return &folder.images[image(gen_)];
 	}
 
-	bool LfwLoader::loadImage(const std::wstring &folder,
-							  std::shared_ptr<arma::Cube<double>>& dst) const
+	void LfwLoader::SetReducedDecoding(bool enable) noexcept
 	{
-		namespace fs = boost::filesystem;
-		fs::path dir_path(dataset_dir_ + folder);
-		if (!fs::is_directory(dir_path))
+		reducedDecode_ = enable;
+		decodeFlag_ = cv::IMREAD_COLOR;
+		decodeROI_ = face_roi;
+		if (!enable)
+			return;
+		// the largest reduction that keeps the region at least as large as the
+		// scaled image, so resize still only shrinks it
+		const int flags[] = { cv::IMREAD_REDUCED_COLOR_8, cv::IMREAD_REDUCED_COLOR_4,
+		                      cv::IMREAD_REDUCED_COLOR_2 };
+		const int factors[] = { 8, 4, 2 };
+		for (int i = 0; i < 3; ++i) {
+			int factor = factors[i];
+			if (face_roi.width / factor >= scaleSize_.width
+				&& face_roi.height / factor >= scaleSize_.height) {
+				decodeFlag_ = flags[i];
+				decodeROI_ = cv::Rect(face_roi.x / factor, face_roi.y / factor,
+				                      face_roi.width / factor, face_roi.height / factor);
+				return;
+			}
+		}
+	}
+
+	bool LfwLoader::decodeImage(const boost::filesystem::path& path, cv::Mat& dst,
+								 std::mt19937* augment) const
+	{
+		CNN_TRACE_SCOPE("decode", "loader");
+		// reduced jpeg decoding skips most of idct work
+		return scaleImage(cv::imread(path.string(), decodeFlag_), dst, augment);
+	}
+
+	bool LfwLoader::scaleImage(const cv::Mat& image, cv::Mat& dst, std::mt19937* augment) const
+	{
+		if (image.empty())
 			return false;
-		fs::directory_iterator begin(dir_path);
-		fs::directory_iterator end;
-		arma::uword amount = std::distance(begin, end);
-		std::vector<fs::directory_entry> imagesPath;
-		imagesPath.reserve(amount);
-		std::copy_if(fs::directory_iterator(dir_path), fs::directory_iterator(),
-					 std::back_inserter(imagesPath), [](fs::directory_entry &x)
-		{
-			return fs::is_regular_file(x.path())
-				&& x.path().filename().string() != std::string("Thumbs.db");
-		});
-
-
-		static std::mt19937 gen(std::random_device().operator()());
-		std::uniform_int_distribution<std::size_t> uid(0, imagesPath.size() - 1);
-
-		std::size_t number = uid(gen);
-		std::string image_path = imagesPath[number].path().string();
-		cv::Mat image = cv::imread(image_path, CV_LOAD_IMAGE_COLOR);
-		// my region of interest
-		cv::Rect ROI(70, 78, 125, 94);
-		// Note that this doesn't copy the data
-		cv::Mat croppedImage = image(ROI);
-		cv::Mat scaleImage;
-		cv::resize(croppedImage, scaleImage, scaleSize_, 0, 0, CV_INTER_LINEAR);
-		dst = std::make_shared<arma::Cube<double>>(cvMat2armaCube(scaleImage));
-		//feature scaling
-		dst->transform([](double val)
-		{
-			return val / 255.0;
-		});
+		cv::Rect ROI = decodeROI_ & cv::Rect(0, 0, image.cols, image.rows);
+		if (ROI.width <= 0 || ROI.height <= 0)
+			return false;
+		if (augment) {
+			// crop, resize, flip and rotation in one warp
+			augmenter_.Warp(image, ROI, scaleSize_, *augment, dst);
+		} else {
+			// crop doesn't copy the data, so crop and resize is one pass over the pixels
+			cv::resize(image(ROI), dst, scaleSize_, 0, 0, CV_INTER_LINEAR);
+		}
+		return true;
+	}
+
+	bool LfwLoader::loadImage(const boost::filesystem::path& path,
+							  std::shared_ptr<arma::Cube<double>>& dst,
+							  std::mt19937* augment) const
+	{
+		std::shared_ptr<arma::Cube<double>> image = std::make_shared<arma::Cube<double>>(
+			scaleSize_.width, scaleSize_.height, 3);
+		if (!loadImage(path, *image, augment))
+			return false;
+		dst = std::move(image);
+		return true;
+	}
+
+	std::string LfwLoader::cacheKey(const boost::filesystem::path& path) const
+	{
+		std::string key = path.string();
+		// settings are appended as raw bytes, the key is compared as a whole
+		int params[] = { scaleSize_.width, scaleSize_.height, decodeFlag_, decodeROI_.x,
+		                 decodeROI_.y, decodeROI_.width, decodeROI_.height };
+		key.push_back('\0');
+		key.append(reinterpret_cast<const char*>(params), sizeof(params));
+		key.append(reinterpret_cast<const char*>(converter_.Mean().data()), 3 * sizeof(double));
+		key.append(reinterpret_cast<const char*>(converter_.StdDev().data()), 3 * sizeof(double));
+		return key;
+	}
+
+	bool LfwLoader::loadImage(const boost::filesystem::path& path, arma::Cube<double>& dst,
+							  std::mt19937* augment) const
+	{
+		std::string key;
+		if (cache_ && !augment) {
+			key = cacheKey(path);
+			if (cache_->Get(key, dst))
+				return true;
+		}
+		cv::Mat scaled;
+		if (!decodeImage(path, scaled, augment))
+			return false;
+		convertImage(scaled, key, dst, augment);
+		return true;
+	}
+
+	void LfwLoader::convertImage(const cv::Mat& scaled, const std::string& key,
+								 arma::Cube<double>& dst, std::mt19937* augment) const
+	{
+		// feature scaling and normalization are fused into the conversion
+		if (augment) {
+			ColorJitter jitter = augmenter_.Jitter(*augment);
+			ImageConverter(converter_, jitter.contrast, jitter.brightness).Convert(scaled, dst);
+		} else {
+			converter_.Convert(scaled, dst);
+			if (cache_ && !key.empty()) {
+				cache_->Put(key, dst);
+			}
+		}
+	}
+
+	bool BaseImageLoader::LoadTrainBatch(std::size_t n, arma::Cube<double>& buffer,
+										 arma::Col<arma::uword>& labels)
+	{
+		std::shared_ptr<arma::Cube<double>> image;
+		arma::Col<double> oneHot;
+		labels.set_size(n);
+		for (std::size_t i = 0; i < n; ++i) {
+			if (!LoadTrainImage(image, oneHot))
+				return false;
+			arma::uword depth = image->n_slices;
+			if (i == 0 && (buffer.n_rows != image->n_rows || buffer.n_cols != image->n_cols
+						   || buffer.n_slices != depth * n)) {
+				buffer.set_size(image->n_rows, image->n_cols, depth * n);
+			}
+			if (image->n_rows != buffer.n_rows || image->n_cols != buffer.n_cols
+				|| depth * n != buffer.n_slices)
+				return false;
+			std::copy(image->begin(), image->end(), buffer.slice_memptr(i * depth));
+			labels(i) = oneHot.index_max();
+		}
 		return true;
 	}
 }
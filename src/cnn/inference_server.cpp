@@ -0,0 +1,434 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "inference_server.hpp"
+#include <algorithm>
+#include <atomic>
+#include <codecvt>
+#include <cstring>
+#include <locale>
+#include <numeric>
+#include <stdexcept>
+#include <system_error>
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define CNN_HAS_UNIX_SOCKETS
+#endif
+
+namespace cnn
+{
+	namespace serving
+	{
+		namespace
+		{
+			const std::uint32_t rejected_response = 0xFFFFFFFF;
+			// refuse images larger than 64M values from the socket
+			const std::uint64_t max_request_size = 1 << 26;
+
+#ifdef CNN_HAS_UNIX_SOCKETS
+			bool ReadAll(int fd, void* data, std::size_t size)
+			{
+				char* pos = static_cast<char*>(data);
+				while (size != 0) {
+					ssize_t done = ::recv(fd, pos, size, 0);
+					if (done <= 0)
+						return false;
+					pos += done;
+					size -= static_cast<std::size_t>(done);
+				}
+				return true;
+			}
+
+			bool WriteAll(int fd, const void* data, std::size_t size)
+			{
+#ifdef MSG_NOSIGNAL
+				const int flags = MSG_NOSIGNAL;
+#else
+				const int flags = 0;
+#endif
+				const char* pos = static_cast<const char*>(data);
+				while (size != 0) {
+					ssize_t done = ::send(fd, pos, size, flags);
+					if (done <= 0)
+						return false;
+					pos += done;
+					size -= static_cast<std::size_t>(done);
+				}
+				return true;
+			}
+#endif
+
+			template <typename T>
+			void Append(std::vector<char>& dst, const T& value)
+			{
+				const char* src = reinterpret_cast<const char*>(&value);
+				dst.insert(dst.end(), src, src + sizeof(T));
+			}
+		}
+
+		std::vector<Prediction> TopK(const nn::NeuralNetwork& net,
+		                             const arma::Cube<double>& hypothesis, std::size_t top_k)
+		{
+			std::vector<std::size_t> idx(hypothesis.n_elem);
+			std::iota(idx.begin(), idx.end(), 0);
+			top_k = std::min(top_k, idx.size());
+			std::partial_sort(idx.begin(), idx.begin() + top_k, idx.end(),
+			                  [&hypothesis](std::size_t a, std::size_t b)
+			{
+				return hypothesis[a] > hypothesis[b];
+			});
+			std::vector<Prediction> result;
+			result.reserve(top_k);
+			for (std::size_t i = 0; i < top_k; ++i) {
+				result.push_back(Prediction{ idx[i], hypothesis[idx[i]], net.LabelName(idx[i]) });
+			}
+			return result;
+		}
+
+		InferenceServer::InferenceServer(std::shared_ptr<const nn::NeuralNetwork> net,
+		                                 ServerOptions options)
+			: net_(net), options_(options), stop_(false),
+			stats_{ 0, 0, 0, std::chrono::microseconds(0) },
+			workers_(std::max<std::size_t>(1, options.workers)),
+			listenFd_(-1), listening_(false)
+		{
+#ifndef NDEBUG
+			assert(net_ && net_->is_initialized());
+#endif
+			options_.workers = workers_.Size();
+			options_.max_batch = std::max<std::size_t>(1, options_.max_batch);
+			contexts_.reserve(options_.workers);
+			for (std::size_t i = 0; i < options_.workers; ++i) {
+				contexts_.push_back(net_->CreateContext());
+			}
+			batcher_ = std::thread(&InferenceServer::Batch, this);
+		}
+
+		InferenceServer::~InferenceServer()
+		{
+			Stop();
+		}
+
+		std::future<std::vector<Prediction>> InferenceServer::Submit(
+			std::shared_ptr<arma::Cube<double>> image, std::size_t top_k)
+		{
+			Request request;
+			request.image = std::move(image);
+			request.top_k = top_k;
+			request.enqueued = std::chrono::steady_clock::now();
+			std::future<std::vector<Prediction>> result = request.result.get_future();
+			if (!request.image || !net_->AcceptsInput(request.image->n_rows, request.image->n_cols,
+													  request.image->n_slices)) {
+				Reject(request, "image shape doesn't match the network input");
+				return result;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (stop_ || queue_.size() >= options_.max_queue) {
+					++stats_.rejected;
+					request.result.set_exception(std::make_exception_ptr(
+						std::runtime_error("inference server rejected the request")));
+					return result;
+				}
+				++stats_.requests;
+				queue_.emplace_back(std::move(request));
+			}
+			ready_.notify_one();
+			return result;
+		}
+
+		void InferenceServer::Reject(Request& request, const char* reason)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				++stats_.rejected;
+			}
+			request.result.set_exception(std::make_exception_ptr(std::invalid_argument(reason)));
+		}
+
+		ServerStats InferenceServer::Stats() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return stats_;
+		}
+
+		void InferenceServer::Batch()
+		{
+			typedef std::chrono::steady_clock clock;
+			std::vector<Request> batch;
+			batch.reserve(options_.max_batch);
+			for (;;) {
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					// wait until the batch is full or the oldest request can't wait any more
+					for (;;) {
+						if (queue_.empty()) {
+							// queued requests are finished even after Stop
+							if (stop_)
+								return;
+							ready_.wait(lock);
+							continue;
+						}
+						if (stop_ || queue_.size() >= options_.max_batch)
+							break;
+						clock::time_point deadline = queue_.front().enqueued + options_.max_latency;
+						if (clock::now() >= deadline)
+							break;
+						ready_.wait_until(lock, deadline);
+					}
+					clock::time_point now = clock::now();
+					std::size_t amount = std::min(options_.max_batch, queue_.size());
+					for (std::size_t i = 0; i < amount; ++i) {
+						stats_.queue_time += std::chrono::duration_cast<std::chrono::microseconds>(
+							now - queue_.front().enqueued);
+						batch.emplace_back(std::move(queue_.front()));
+						queue_.pop_front();
+					}
+					++stats_.batches;
+				}
+				Run(batch);
+				batch.clear();
+			}
+		}
+
+		void InferenceServer::Run(std::vector<Request>& batch)
+		{
+			std::atomic<std::size_t> next(0);
+			std::size_t tasks = std::min(batch.size(), workers_.Size());
+			std::size_t finished = 0;
+			std::mutex doneMutex;
+			std::condition_variable done;
+			for (std::size_t task = 0; task < tasks; ++task) {
+				workers_.Post([&](std::size_t worker)
+				{
+					nn::ExecutionContext& ctx = contexts_[worker];
+					// every request is answered as soon as it is done
+					for (std::size_t i = next++; i < batch.size(); i = next++) {
+						Request& request = batch[i];
+						try {
+							ctx.SetInput(request.image);
+							net_->Forward(ctx);
+							request.result.set_value(TopK(*net_, *net_->Hypothesis(ctx), request.top_k));
+						} catch (...) {
+							request.result.set_exception(std::current_exception());
+						}
+					}
+					// notified under the lock, the batch outlives this task
+					std::lock_guard<std::mutex> lock(doneMutex);
+					++finished;
+					done.notify_one();
+				});
+			}
+			std::unique_lock<std::mutex> lock(doneMutex);
+			done.wait(lock, [&] { return finished == tasks; });
+		}
+
+		void InferenceServer::Stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+			ready_.notify_all();
+#ifdef CNN_HAS_UNIX_SOCKETS
+			if (listening_.exchange(false)) {
+				acceptor_.join();
+				::close(listenFd_);
+				::unlink(socketPath_.c_str());
+				// wake up connections blocked on reading and wait until they close
+				std::unique_lock<std::mutex> lock(connectionsMutex_);
+				for (int fd : connections_) {
+					::shutdown(fd, SHUT_RDWR);
+				}
+				connectionsClosed_.wait(lock, [this] { return connections_.empty(); });
+			}
+#endif
+			if (batcher_.joinable()) {
+				batcher_.join();
+			}
+		}
+
+		bool InferenceServer::Listen(const std::string& socketPath)
+		{
+#ifdef CNN_HAS_UNIX_SOCKETS
+			sockaddr_un addr;
+			std::memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			if (listening_ || socketPath.size() >= sizeof(addr.sun_path))
+				return false;
+			std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+			int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd < 0)
+				return false;
+			::unlink(socketPath.c_str());
+			if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+				|| ::listen(fd, 64) != 0) {
+				::close(fd);
+				return false;
+			}
+			socketPath_ = socketPath;
+			listenFd_ = fd;
+			listening_ = true;
+			acceptor_ = std::thread(&InferenceServer::Accept, this);
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		void InferenceServer::Accept()
+		{
+#ifdef CNN_HAS_UNIX_SOCKETS
+			while (listening_) {
+				pollfd item{ listenFd_, POLLIN, 0 };
+				// check the stop flag every 100 ms
+				if (::poll(&item, 1, 100) <= 0)
+					continue;
+				int fd = ::accept(listenFd_, nullptr, nullptr);
+				if (fd < 0)
+					continue;
+				std::lock_guard<std::mutex> lock(connectionsMutex_);
+				try {
+					// the thread removes fd from connections_ when the client is gone
+					std::thread(&InferenceServer::Serve, this, fd).detach();
+					connections_.push_back(fd);
+				} catch (const std::system_error&) {
+					::close(fd);
+				}
+			}
+#endif
+		}
+
+		void InferenceServer::Serve(int fd)
+		{
+#ifdef CNN_HAS_UNIX_SOCKETS
+			std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8;
+			std::vector<char> response;
+			std::uint32_t header[4];
+			while (ReadAll(fd, header, sizeof(header))) {
+				std::uint64_t size = std::uint64_t(header[0]) * header[1] * header[2];
+				if (size == 0 || size > max_request_size)
+					break;
+				std::shared_ptr<arma::Cube<double>> image = std::make_shared<arma::Cube<double>>(
+					header[0], header[1], header[2]);
+				if (!ReadAll(fd, image->memptr(), size * sizeof(double)))
+					break;
+				response.clear();
+				try {
+					std::vector<Prediction> result = Submit(image, header[3]).get();
+					Append(response, static_cast<std::uint32_t>(result.size()));
+					for (const Prediction& item : result) {
+						std::string name = utf8.to_bytes(item.name);
+						Append(response, static_cast<std::uint32_t>(item.label));
+						Append(response, item.score);
+						Append(response, static_cast<std::uint32_t>(name.size()));
+						response.insert(response.end(), name.begin(), name.end());
+					}
+				} catch (const std::exception&) {
+					response.clear();
+					Append(response, rejected_response);
+				}
+				if (!WriteAll(fd, response.data(), response.size()))
+					break;
+			}
+			std::lock_guard<std::mutex> lock(connectionsMutex_);
+			connections_.erase(std::find(connections_.begin(), connections_.end(), fd));
+			::close(fd);
+			// notified under the lock, Stop can't return and destroy the
+			// server before this thread is done with its members
+			connectionsClosed_.notify_all();
+#endif
+		}
+
+		SocketClient::SocketClient()
+			: fd_(-1)
+		{}
+
+		SocketClient::~SocketClient()
+		{
+			Close();
+		}
+
+		bool SocketClient::Connect(const std::string& socketPath)
+		{
+#ifdef CNN_HAS_UNIX_SOCKETS
+			Close();
+			sockaddr_un addr;
+			std::memset(&addr, 0, sizeof(addr));
+			addr.sun_family = AF_UNIX;
+			if (socketPath.size() >= sizeof(addr.sun_path))
+				return false;
+			std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+			fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+			if (fd_ < 0)
+				return false;
+			if (::connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+				Close();
+				return false;
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool SocketClient::Infer(const arma::Cube<double>& image, std::size_t top_k,
+		                         std::vector<Prediction>& result)
+		{
+#ifdef CNN_HAS_UNIX_SOCKETS
+			if (fd_ < 0)
+				return false;
+			std::uint32_t header[4] = {
+				static_cast<std::uint32_t>(image.n_rows), static_cast<std::uint32_t>(image.n_cols),
+				static_cast<std::uint32_t>(image.n_slices), static_cast<std::uint32_t>(top_k)
+			};
+			if (!WriteAll(fd_, header, sizeof(header))
+				|| !WriteAll(fd_, image.memptr(), image.n_elem * sizeof(double)))
+				return false;
+			std::uint32_t count;
+			if (!ReadAll(fd_, &count, sizeof(count)) || count == rejected_response)
+				return false;
+			std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8;
+			result.clear();
+			result.reserve(count);
+			for (std::uint32_t i = 0; i < count; ++i) {
+				std::uint32_t label, length;
+				double score;
+				if (!ReadAll(fd_, &label, sizeof(label)) || !ReadAll(fd_, &score, sizeof(score))
+					|| !ReadAll(fd_, &length, sizeof(length)))
+					return false;
+				std::string name(length, '\0');
+				if (length != 0 && !ReadAll(fd_, &name[0], length))
+					return false;
+				result.push_back(Prediction{ label, score, utf8.from_bytes(name) });
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		void SocketClient::Close()
+		{
+#ifdef CNN_HAS_UNIX_SOCKETS
+			if (fd_ >= 0) {
+				::close(fd_);
+				fd_ = -1;
+			}
+#endif
+		}
+	}
+}
@@ -0,0 +1,235 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "model_file.hpp"
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/fstream.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <algorithm>
+#include <utility>
+#include <cstring>
+#include <vector>
+
+namespace cnn
+{
+	namespace nn
+	{
+		namespace
+		{
+			const char model_magic[8] = { 'C', 'N', 'N', 'M', 'O', 'D', 'E', 'L' };
+			const std::uint32_t model_version = 1;
+			// blobs start on page boundaries, mapped cubes are aligned for simd loads
+			const std::uint64_t model_alignment = 4096;
+
+			std::uint64_t AlignUp(std::uint64_t value) noexcept
+			{
+				return (value + model_alignment - 1) / model_alignment * model_alignment;
+			}
+
+			std::uint64_t BlobSize(const tensor4d& tensor) noexcept
+			{
+				std::uint64_t size = 0;
+				for (const arma::Cube<double>& cube : tensor.data) {
+					size += cube.n_elem * sizeof(double);
+				}
+				return size;
+			}
+
+			void Describe(const tensor4d& tensor, std::uint64_t& count, std::uint64_t& rows,
+			              std::uint64_t& cols, std::uint64_t& slices) noexcept
+			{
+				count = tensor.data.size();
+				rows = count ? tensor.data[0].n_rows : 0;
+				cols = count ? tensor.data[0].n_cols : 0;
+				slices = count ? tensor.data[0].n_slices : 0;
+			}
+
+			std::uint32_t Crc(const void* data, std::size_t size)
+			{
+				boost::crc_32_type crc;
+				crc.process_bytes(data, size);
+				return crc.checksum();
+			}
+		}
+
+		bool CaptureModel(const NeuralNetwork& net, ModelSnapshot& dst)
+		{
+			std::size_t values = 0;
+			for (std::size_t n = 0; n < net.Size(); ++n) {
+				values += (BlobSize(net.Layer(n).Weights()) + BlobSize(net.Layer(n).BiasWeights()))
+					/ sizeof(double);
+			}
+			dst.records.resize(net.Size());
+			dst.data.resize(values);
+			double* pos = dst.data.data();
+			for (std::size_t n = 0; n < net.Size(); ++n) {
+				const BaseLayer& layer = net.Layer(n);
+				ModelLayerRecord& record = dst.records[n];
+				std::memset(&record, 0, sizeof(record));
+				std::strncpy(record.type, layer.Type(), sizeof(record.type) - 1);
+				Describe(layer.Weights(), record.count, record.rows, record.cols, record.slices);
+				Describe(layer.BiasWeights(), record.bias_count, record.bias_rows,
+				         record.bias_cols, record.bias_slices);
+				for (const arma::Cube<double>& cube : layer.Weights().data) {
+					if (cube.n_rows != record.rows || cube.n_cols != record.cols
+						|| cube.n_slices != record.slices)
+						return false;
+					pos = std::copy(cube.begin(), cube.end(), pos);
+				}
+				for (const arma::Cube<double>& cube : layer.BiasWeights().data) {
+					if (cube.n_rows != record.bias_rows || cube.n_cols != record.bias_cols
+						|| cube.n_slices != record.bias_slices)
+						return false;
+					pos = std::copy(cube.begin(), cube.end(), pos);
+				}
+			}
+			return true;
+		}
+
+		bool SaveModel(const ModelSnapshot& snapshot, const std::wstring& path)
+		{
+			ModelFileHeader header;
+			std::memset(&header, 0, sizeof(header));
+			std::memcpy(header.magic, model_magic, sizeof(model_magic));
+			header.version = model_version;
+			header.dtype = model_dtype_float64;
+			header.alignment = model_alignment;
+			header.layers = snapshot.records.size();
+
+			std::vector<ModelLayerRecord> records = snapshot.records;
+			std::vector<std::pair<const char*, std::uint64_t>> blobs;
+			blobs.reserve(2 * records.size());
+			const char* src = reinterpret_cast<const char*>(snapshot.data.data());
+			std::uint64_t pos = AlignUp(sizeof(header) + records.size() * sizeof(ModelLayerRecord));
+			for (ModelLayerRecord& record : records) {
+				std::uint64_t weights_size = record.count * record.rows * record.cols
+					* record.slices * sizeof(double);
+				std::uint64_t bias_size = record.bias_count * record.bias_rows * record.bias_cols
+					* record.bias_slices * sizeof(double);
+				record.offset = pos;
+				pos = AlignUp(pos + weights_size);
+				record.bias_offset = pos;
+				pos = AlignUp(pos + bias_size);
+				record.crc = Crc(src, weights_size + bias_size);
+				blobs.emplace_back(src, weights_size);
+				blobs.emplace_back(src + weights_size, bias_size);
+				src += weights_size + bias_size;
+			}
+			if (src != reinterpret_cast<const char*>(snapshot.data.data() + snapshot.data.size()))
+				return false;
+			header.records_crc = Crc(records.data(), records.size() * sizeof(ModelLayerRecord));
+
+			// the target may be mapped by MapModel, truncating it in place would
+			// pull pages from under the mapping. the new file replaces it by rename
+			boost::filesystem::path target(path);
+			boost::filesystem::path temporary(path + L".tmp");
+			boost::system::error_code error;
+			{
+				boost::filesystem::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+				if (!out.is_open())
+					return false;
+				out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+				out.write(reinterpret_cast<const char*>(records.data()),
+				          records.size() * sizeof(ModelLayerRecord));
+				const std::vector<char> padding(model_alignment, 0);
+				auto pad = [&out, &padding]()
+				{
+					std::uint64_t size = static_cast<std::uint64_t>(out.tellp());
+					out.write(padding.data(), AlignUp(size) - size);
+				};
+				for (const std::pair<const char*, std::uint64_t>& blob : blobs) {
+					pad();
+					out.write(blob.first, blob.second);
+				}
+				pad();
+				out.close();
+				if (!out) {
+					boost::filesystem::remove(temporary, error);
+					return false;
+				}
+			}
+			boost::filesystem::rename(temporary, target, error);
+			return !error;
+		}
+
+		bool SaveModel(const NeuralNetwork& net, const std::wstring& path)
+		{
+			ModelSnapshot snapshot;
+			return CaptureModel(net, snapshot) && SaveModel(snapshot, path);
+		}
+
+		std::shared_ptr<void> MapModel(NeuralNetwork& net, const std::wstring& path, bool verify)
+		{
+			namespace ipc = boost::interprocess;
+			std::shared_ptr<ipc::mapped_region> region;
+			try {
+				ipc::file_mapping file(boost::filesystem::path(path).string().c_str(), ipc::read_only);
+				// private pages: training a loaded network doesn't change the file
+				region = std::make_shared<ipc::mapped_region>(file, ipc::copy_on_write);
+			} catch (const ipc::interprocess_exception&) {
+				return nullptr;
+			}
+			char* begin = static_cast<char*>(region->get_address());
+			std::size_t size = region->get_size();
+
+			ModelFileHeader header;
+			if (size < sizeof(header))
+				return nullptr;
+			std::memcpy(&header, begin, sizeof(header));
+			if (std::memcmp(header.magic, model_magic, sizeof(model_magic)) != 0
+				|| header.version != model_version || header.dtype != model_dtype_float64
+				|| header.alignment % sizeof(double) != 0 || header.layers != net.Size()
+				|| size < sizeof(header) + header.layers * sizeof(ModelLayerRecord))
+				return nullptr;
+			std::vector<ModelLayerRecord> records(header.layers);
+			std::memcpy(records.data(), begin + sizeof(header), records.size() * sizeof(ModelLayerRecord));
+			if (Crc(records.data(), records.size() * sizeof(ModelLayerRecord)) != header.records_crc)
+				return nullptr;
+
+			// check everything before the first layer is changed
+			for (std::size_t n = 0; n < net.Size(); ++n) {
+				const ModelLayerRecord& record = records[n];
+				const BaseLayer& layer = net.Layer(n);
+				std::uint64_t count, rows, cols, slices;
+				std::uint64_t bias_count, bias_rows, bias_cols, bias_slices;
+				Describe(layer.Weights(), count, rows, cols, slices);
+				Describe(layer.BiasWeights(), bias_count, bias_rows, bias_cols, bias_slices);
+				std::uint64_t weights_size = BlobSize(layer.Weights());
+				std::uint64_t bias_size = BlobSize(layer.BiasWeights());
+				if (std::strncmp(record.type, layer.Type(), sizeof(record.type)) != 0
+					|| record.count != count || record.rows != rows || record.cols != cols
+					|| record.slices != slices || record.bias_count != bias_count
+					|| record.bias_rows != bias_rows || record.bias_cols != bias_cols
+					|| record.bias_slices != bias_slices
+					|| record.offset % sizeof(double) != 0 || record.bias_offset % sizeof(double) != 0
+					|| record.offset > size || size - record.offset < weights_size
+					|| record.bias_offset > size || size - record.bias_offset < bias_size)
+					return nullptr;
+				if (verify) {
+					boost::crc_32_type crc;
+					crc.process_bytes(begin + record.offset, weights_size);
+					crc.process_bytes(begin + record.bias_offset, bias_size);
+					if (crc.checksum() != record.crc)
+						return nullptr;
+				}
+			}
+			for (std::size_t n = 0; n < net.Size(); ++n) {
+				net.Layer(n).MapWeights(reinterpret_cast<double*>(begin + records[n].offset),
+				                        reinterpret_cast<double*>(begin + records[n].bias_offset));
+			}
+			return region;
+		}
+	}
+}
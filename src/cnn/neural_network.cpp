@@ -12,30 +12,73 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "neural_network.hpp"
+#include "model_file.hpp"
+#include "trace.hpp"
+#include <algorithm>
 
 namespace cnn
 {
 	namespace nn
 	{
 
-		void NeuralNetwork::Forward()
+		bool NeuralNetwork::LoadWeights(const std::wstring& path, bool verify)
+		{
+			std::shared_ptr<void> mapping = MapModel(*this, path, verify);
+			if (!mapping)
+				return false;
+			// the previous mapping isn't used by any layer anymore
+			weightsMapping_ = std::move(mapping);
+			initialized_ = true;
+			return true;
+		}
+
+		bool NeuralNetwork::SaveWeights(const std::wstring& path) const
+		{
+			if (!initialized_ || layers_.empty())
+				return false;
+			return SaveModel(*this, path);
+		}
+
+		void NeuralNetwork::Forward(ExecutionContext& ctx) const
 		{
 #ifndef NDEBUG
-			assert(!in_->is_empty());
+			assert(ctx.Input() && !ctx.Input()->is_empty());
 			assert(!layers_.empty());
 #endif
-			layers_[0]->Forward(in_->Output());
-			std::size_t amount = layers_.size();
-			for (std::size_t i = 1; i < amount; ++i) {
-				layers_[i]->Forward(layers_[i - 1]->Output());
+			Forward(ctx, 0, layers_.size(), ctx.Input());
+			if (profiler_) {
+				profiler_->EndIteration();
 			}
 		}
 
-		std::vector<std::pair<tensor4d, tensor4d>> NeuralNetwork::Backpropagation()
+		void NeuralNetwork::Forward(ExecutionContext& ctx, std::size_t first, std::size_t last,
+									std::shared_ptr<arma::Cube<double>> input) const
+		{
+#ifndef NDEBUG
+			assert(input);
+			assert(first < last && last <= layers_.size());
+			assert(ctx.Size() == layers_.size());
+#endif
+			{
+				CNN_TRACE_SCOPE(layers_[first]->Type(), "forward", first);
+				profiling::LayerScope profile(profiler_.get(), first, layers_[first]->Type(),
+				                              profiling::forward);
+				layers_[first]->Forward(input, ctx.Layer(first));
+			}
+			for (std::size_t i = first + 1; i < last; ++i) {
+				CNN_TRACE_SCOPE(layers_[i]->Type(), "forward", i);
+				profiling::LayerScope profile(profiler_.get(), i, layers_[i]->Type(),
+				                              profiling::forward);
+				layers_[i]->Forward(ctx.Layer(i - 1).output, ctx.Layer(i));
+			}
+		}
+
+		std::vector<std::pair<tensor4d, tensor4d>> NeuralNetwork::Backpropagation(
+			ExecutionContext& ctx) const
 		{
 			
-			std::shared_ptr<arma::Cube<double>> hypothesis = layers_.back()->Output();
-			const arma::Col<double> &labels = in_->Labels();
+			std::shared_ptr<arma::Cube<double>> hypothesis = Hypothesis(ctx);
+			const arma::Col<double> &labels = ctx.Labels();
 			std::shared_ptr<arma::Cube<double>> loss = std::make_shared<arma::Cube<double>>(
 				labels.n_rows, 1, 1);
 			for (arma::uword i = 0; i < labels.n_rows; ++i) {
@@ -44,34 +87,121 @@ namespace cnn
 
 			arma::uword size = layers_.size();
 			std::vector<std::pair<tensor4d, tensor4d>> result(size);
-			result[size - 1] = layers_[size - 1]->Backward(loss);
+			{
+				CNN_TRACE_SCOPE(layers_[size - 1]->Type(), "backward", size - 1);
+				profiling::LayerScope profile(profiler_.get(), size - 1, layers_[size - 1]->Type(),
+				                              profiling::backward);
+				result[size - 1] = layers_[size - 1]->Backward(loss, ctx.Layer(size - 1));
+			}
 			for (arma::sword i = size - 1; i > 0; --i) {
-				loss = layers_[i]->LocalLoss();
-				result[i - 1] = layers_[i - 1]->Backward(loss);
+				CNN_TRACE_SCOPE(layers_[i - 1]->Type(), "backward", i - 1);
+				profiling::LayerScope profile(profiler_.get(), i - 1, layers_[i - 1]->Type(),
+				                              profiling::backward);
+				loss = ctx.Layer(i).localLoss;
+				result[i - 1] = layers_[i - 1]->Backward(loss, ctx.Layer(i - 1));
 			}
 			return result;
 		}
 
 		
-		std::vector<std::pair<tensor4d, tensor4d>> NeuralNetwork::Backpropagation_2nd()
+		std::vector<std::pair<tensor4d, tensor4d>> NeuralNetwork::Backpropagation_2nd(
+			ExecutionContext& ctx) const
 		{
 			//TODO:
 			std::shared_ptr<arma::Cube<double>> loss = std::make_shared<arma::Cube<double>>(
-				in_->Labels().n_rows, 1, 1);
-			std::shared_ptr<arma::Cube<double>> hypothesis = layers_.back()->Output();
-			const arma::Col<double> &labels = in_->Labels();
+				ctx.Labels().n_rows, 1, 1);
+			std::shared_ptr<arma::Cube<double>> hypothesis = Hypothesis(ctx);
+			const arma::Col<double> &labels = ctx.Labels();
 			for (arma::uword i = 0; i < labels.n_rows; ++i) {
 				loss->slice(0)(i, 0) = costFunc_->SecondDerivative(labels(i),
 																   hypothesis->slice(0)(i, 0));
 			}
 			arma::uword size = layers_.size();
 			std::vector<std::pair<tensor4d, tensor4d>> result(size);
-			result[size - 1] = layers_[size - 1]->Backward2nd(loss);
+			{
+				CNN_TRACE_SCOPE(layers_[size - 1]->Type(), "backward2nd", size - 1);
+				profiling::LayerScope profile(profiler_.get(), size - 1, layers_[size - 1]->Type(),
+				                              profiling::backward2nd);
+				result[size - 1] = layers_[size - 1]->Backward2nd(loss, ctx.Layer(size - 1));
+			}
 			for (arma::sword i = size - 1; i > 0; --i) {
-				loss = layers_[i]->LocalLoss();
-				result[i - 1] = layers_[i - 1]->Backward2nd(loss);
+				CNN_TRACE_SCOPE(layers_[i - 1]->Type(), "backward2nd", i - 1);
+				profiling::LayerScope profile(profiler_.get(), i - 1, layers_[i - 1]->Type(),
+				                              profiling::backward2nd);
+				loss = ctx.Layer(i).localLoss;
+				result[i - 1] = layers_[i - 1]->Backward2nd(loss, ctx.Layer(i - 1));
 			}
 			return result;
 		}
+
+		std::future<std::shared_ptr<arma::Cube<double>>> NeuralNetwork::InferAsync(
+			std::shared_ptr<arma::Cube<double>> image)
+		{
+			// std::function needs a copyable callable, so share the promise
+			std::shared_ptr<std::promise<std::shared_ptr<arma::Cube<double>>>> result =
+				std::make_shared<std::promise<std::shared_ptr<arma::Cube<double>>>>();
+			std::future<std::shared_ptr<arma::Cube<double>>> future = result->get_future();
+			InferAsync(std::move(image), [result](std::shared_ptr<arma::Cube<double>> hypothesis,
+												  std::exception_ptr error)
+			{
+				if (error) {
+					result->set_exception(error);
+				} else {
+					result->set_value(std::move(hypothesis));
+				}
+			});
+			return future;
+		}
+
+		void NeuralNetwork::InferAsync(std::shared_ptr<arma::Cube<double>> image,
+									   infer_callback_t callback)
+		{
+#ifndef NDEBUG
+			assert(image && callback);
+			assert(initialized_);
+#endif
+			Executor().Post([this, image, callback](std::size_t worker)
+			{
+				std::shared_ptr<arma::Cube<double>> hypothesis;
+				std::exception_ptr error;
+				try {
+					hypothesis = Infer(asyncContexts_[worker], image);
+				} catch (...) {
+					error = std::current_exception();
+				}
+				callback(std::move(hypothesis), error);
+			});
+		}
+
+		std::shared_ptr<arma::Cube<double>> NeuralNetwork::Infer(
+			ExecutionContext& ctx, std::shared_ptr<arma::Cube<double>> image) const
+		{
+			ctx.SetInput(std::move(image));
+			Forward(ctx);
+			// the top layer would overwrite its output on the next call,
+			// detach the buffer so it may be handed to the caller
+			LayerContext& top = ctx.Layer(layers_.size() - 1);
+			std::shared_ptr<arma::Cube<double>> hypothesis = std::move(top.output);
+			top.receptiveField.reset();
+			ctx.SetInput(nullptr);
+			return hypothesis;
+		}
+
+		ThreadPool& NeuralNetwork::Executor()
+		{
+			std::lock_guard<std::mutex> lock(asyncMutex_);
+			if (!executor_) {
+				std::size_t threads = asyncThreads_;
+				if (threads == 0) {
+					threads = std::max(1u, std::thread::hardware_concurrency());
+				}
+				asyncContexts_.clear();
+				for (std::size_t i = 0; i < threads; ++i) {
+					asyncContexts_.emplace_back(CreateContext());
+				}
+				executor_ = std::make_unique<ThreadPool>(threads);
+			}
+			return *executor_;
+		}
 	}
-}
\ No newline at end of file
+}
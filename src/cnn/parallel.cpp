@@ -0,0 +1,213 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "parallel.hpp"
+#include <algorithm>
+#if defined(CNN_USE_MKL)
+#include <mkl.h>
+#elif defined(CNN_USE_OPENBLAS)
+#include <cblas.h>
+#endif
+
+namespace cnn
+{
+	namespace
+	{
+		// set on pool workers, nested ParallelFor calls run serially
+		thread_local bool in_worker = false;
+
+		std::unique_ptr<WorkStealingPool> shared_pool;
+		std::atomic<WorkStealingPool*> active_pool(nullptr);
+		// BLAS threads before the pool was enabled, 0 if they weren't changed
+		int saved_blas_threads = 0;
+
+		void SetBlasThreads(int threads)
+		{
+#if defined(CNN_USE_MKL)
+			if (saved_blas_threads == 0)
+				saved_blas_threads = mkl_get_max_threads();
+			mkl_set_num_threads(threads);
+#elif defined(CNN_USE_OPENBLAS)
+			if (saved_blas_threads == 0)
+				saved_blas_threads = openblas_get_num_threads();
+			openblas_set_num_threads(threads);
+#else
+			(void)threads;
+#endif
+		}
+
+		void RestoreBlasThreads()
+		{
+			if (saved_blas_threads != 0) {
+#if defined(CNN_USE_MKL)
+				mkl_set_num_threads(saved_blas_threads);
+#elif defined(CNN_USE_OPENBLAS)
+				openblas_set_num_threads(saved_blas_threads);
+#endif
+				saved_blas_threads = 0;
+			}
+		}
+	}
+
+	WorkStealingPool::WorkStealingPool(std::size_t concurrency)
+		: queued_(0), stop_(false)
+	{
+		std::size_t workers = std::max<std::size_t>(1, concurrency) - 1;
+		for (std::size_t i = 0; i < workers; ++i) {
+			queues_.emplace_back(std::make_unique<Queue>());
+		}
+		workers_.reserve(workers);
+		for (std::size_t i = 0; i < workers; ++i) {
+			workers_.emplace_back(&WorkStealingPool::Run, this, i);
+		}
+	}
+
+	WorkStealingPool::~WorkStealingPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(sleepMutex_);
+			stop_ = true;
+		}
+		wake_.notify_all();
+		for (std::thread& worker : workers_) {
+			worker.join();
+		}
+	}
+
+	void WorkStealingPool::ParallelFor(std::size_t begin, std::size_t end, const body_t& body)
+	{
+		if (begin >= end)
+			return;
+		std::size_t size = end - begin;
+		if (workers_.empty() || in_worker || size == 1) {
+			body(begin, end);
+			return;
+		}
+		// a few chunks per thread let fast threads steal from slow ones
+		std::size_t chunks = std::min(size, Concurrency() * 4);
+		Job job;
+		job.body = &body;
+		job.pending.store(chunks);
+		{
+			// count chunks before they are visible, so pops never go below zero
+			std::lock_guard<std::mutex> lock(sleepMutex_);
+			queued_.fetch_add(chunks);
+		}
+		for (std::size_t i = 0; i < chunks; ++i) {
+			Task task{ &job, begin + size * i / chunks, begin + size * (i + 1) / chunks };
+			Queue& queue = *queues_[i % queues_.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			queue.tasks.push_back(task);
+		}
+		wake_.notify_all();
+
+		Task task;
+		while (job.pending.load() != 0) {
+			// the task may belong to another caller, it still has to be done
+			if (TryPop(queues_.size(), task)) {
+				Execute(task);
+			} else {
+				std::this_thread::yield();
+			}
+		}
+		if (job.error)
+			std::rethrow_exception(job.error);
+	}
+
+	bool WorkStealingPool::TryPop(std::size_t own, Task& task)
+	{
+		if (own < queues_.size()) {
+			Queue& queue = *queues_[own];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				task = queue.tasks.back();
+				queue.tasks.pop_back();
+				queued_.fetch_sub(1);
+				return true;
+			}
+		}
+		for (std::size_t i = 1; i <= queues_.size(); ++i) {
+			Queue& queue = *queues_[(own + i) % queues_.size()];
+			std::lock_guard<std::mutex> lock(queue.mutex);
+			if (!queue.tasks.empty()) {
+				task = queue.tasks.front();
+				queue.tasks.pop_front();
+				queued_.fetch_sub(1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void WorkStealingPool::Execute(const Task& task)
+	{
+		Job& job = *task.job;
+		try {
+			(*job.body)(task.first, task.last);
+		} catch (...) {
+			std::lock_guard<std::mutex> lock(job.errorMutex);
+			if (!job.error)
+				job.error = std::current_exception();
+		}
+		// the caller may destroy the job right after the last decrement
+		job.pending.fetch_sub(1);
+	}
+
+	void WorkStealingPool::Run(std::size_t idx)
+	{
+		in_worker = true;
+		Task task;
+		for (;;) {
+			if (TryPop(idx, task)) {
+				Execute(task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(sleepMutex_);
+			wake_.wait(lock, [this]() { return stop_ || queued_.load() != 0; });
+			if (stop_)
+				return;
+		}
+	}
+
+	void SetIntraOpThreads(std::size_t threads)
+	{
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		active_pool.store(nullptr);
+		shared_pool.reset();
+		if (threads > 1) {
+			shared_pool = std::make_unique<WorkStealingPool>(threads);
+			active_pool.store(shared_pool.get());
+			SetBlasThreads(1);
+		} else {
+			RestoreBlasThreads();
+		}
+	}
+
+	std::size_t IntraOpThreads() noexcept
+	{
+		WorkStealingPool* pool = active_pool.load();
+		return pool ? pool->Concurrency() : 1;
+	}
+
+	void ParallelFor(std::size_t begin, std::size_t end, const WorkStealingPool::body_t& body)
+	{
+		WorkStealingPool* pool = active_pool.load();
+		if (pool) {
+			pool->ParallelFor(begin, end, body);
+		} else if (begin < end) {
+			body(begin, end);
+		}
+	}
+}
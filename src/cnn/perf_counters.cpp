@@ -0,0 +1,277 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "perf_counters.hpp"
+#include <boost/format.hpp>
+#include <memory>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <cstring>
+#include <unistd.h>
+#define CNN_HAS_PERF_EVENTS
+#endif
+
+namespace cnn
+{
+	namespace profiling
+	{
+		namespace
+		{
+			const char* const phase_names[phase_count] = { "forward", "backward", "backward2nd" };
+
+#ifdef CNN_HAS_PERF_EVENTS
+			int Open(Counter counter, int group)
+			{
+				perf_event_attr attr;
+				std::memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				switch (counter) {
+				case cycles:
+					attr.type = PERF_TYPE_HARDWARE;
+					attr.config = PERF_COUNT_HW_CPU_CYCLES;
+					break;
+				case instructions:
+					attr.type = PERF_TYPE_HARDWARE;
+					attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+					break;
+				case l1d_misses:
+					attr.type = PERF_TYPE_HW_CACHE;
+					attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+						| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+					break;
+				case llc_misses:
+					attr.type = PERF_TYPE_HW_CACHE;
+					attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+						| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+					break;
+				default:
+					attr.type = PERF_TYPE_HARDWARE;
+					attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+					break;
+				}
+				attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+					| PERF_FORMAT_TOTAL_TIME_RUNNING;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				// the calling thread on any CPU
+				return static_cast<int>(::syscall(__NR_perf_event_open, &attr, 0, -1, group, 0));
+			}
+#endif
+
+			// every thread needs its own group
+			PerfGroup& ThreadGroup()
+			{
+				thread_local std::unique_ptr<PerfGroup> group;
+				if (!group) {
+					group = std::make_unique<PerfGroup>();
+				}
+				return *group;
+			}
+
+			double PerKilo(std::uint64_t value, std::uint64_t instructions)
+			{
+				return instructions ? 1000.0 * value / instructions : 0.0;
+			}
+		}
+
+		PerfGroup::PerfGroup()
+			: leader_(-1)
+		{
+			fds_.fill(-1);
+#ifdef CNN_HAS_PERF_EVENTS
+			// cycles lead the group, every other counter is optional
+			leader_ = Open(cycles, -1);
+			if (leader_ < 0)
+				return;
+			fds_[cycles] = leader_;
+			order_.push_back(cycles);
+			for (int counter = instructions; counter < counter_count; ++counter) {
+				int fd = Open(static_cast<Counter>(counter), leader_);
+				if (fd < 0)
+					continue;
+				fds_[counter] = fd;
+				order_.push_back(static_cast<Counter>(counter));
+			}
+#endif
+		}
+
+		PerfGroup::~PerfGroup()
+		{
+#ifdef CNN_HAS_PERF_EVENTS
+			for (int fd : fds_) {
+				if (fd >= 0) {
+					::close(fd);
+				}
+			}
+#endif
+		}
+
+		bool PerfGroup::Read(PerfReading& dst) const
+		{
+			dst.counters.fill(0);
+			dst.enabled = 0;
+			dst.running = 0;
+#ifdef CNN_HAS_PERF_EVENTS
+			if (leader_ < 0)
+				return false;
+			// nr, time enabled, time running, then one value per counter
+			std::uint64_t values[counter_count + 3];
+			ssize_t size = ::read(leader_, values, sizeof(values));
+			if (size < static_cast<ssize_t>(3 * sizeof(std::uint64_t)) || values[0] != order_.size()
+				|| static_cast<std::size_t>(size) < (order_.size() + 3) * sizeof(std::uint64_t))
+				return false;
+			dst.enabled = values[1];
+			dst.running = values[2];
+			for (std::size_t i = 0; i < order_.size(); ++i) {
+				dst.counters[order_[i]] = values[i + 3];
+			}
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		LayerProfiler::LayerProfiler(std::size_t report_interval, std::ostream* out)
+			: reportInterval_(report_interval), out_(out), iterations_(0), hasCounters_(false)
+		{}
+
+		void LayerProfiler::Begin(PerfReading& reading,
+		                          std::chrono::steady_clock::time_point& start)
+		{
+			ThreadGroup().Read(reading);
+			start = std::chrono::steady_clock::now();
+		}
+
+		void LayerProfiler::End(std::size_t layer, const char* type, Phase phase,
+		                        const PerfReading& reading,
+		                        std::chrono::steady_clock::time_point start)
+		{
+			std::chrono::steady_clock::time_point finish = std::chrono::steady_clock::now();
+			PerfReading current;
+			bool counted = ThreadGroup().Read(current);
+			std::uint64_t enabled = current.enabled - reading.enabled;
+			std::uint64_t running = current.running - reading.running;
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::size_t idx = layer * phase_count + phase;
+			if (layers_.size() <= idx) {
+				layers_.resize(idx + 1, LayerCounters{ 0, nullptr, forward, 0,
+				                                       std::chrono::nanoseconds(0), counters_t(), 0, 0 });
+			}
+			LayerCounters& item = layers_[idx];
+			item.layer = layer;
+			item.type = type;
+			item.phase = phase;
+			++item.calls;
+			item.time += std::chrono::duration_cast<std::chrono::nanoseconds>(finish - start);
+			if (!counted)
+				return;
+			hasCounters_ = true;
+			if (running == 0) {
+				// another group had the counters for the whole call
+				++item.uncounted;
+				return;
+			}
+			// counts are estimated for the time the group wasn't running
+			double scale = 1.0;
+			if (running < enabled) {
+				scale = static_cast<double>(enabled) / running;
+				++item.scaled;
+			}
+			for (std::size_t c = 0; c < counter_count; ++c) {
+				std::uint64_t delta = current.counters[c] - reading.counters[c];
+				item.counters[c] += scale == 1.0 ? delta
+					: static_cast<std::uint64_t>(delta * scale + 0.5);
+			}
+		}
+
+		void LayerProfiler::EndIteration()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			++iterations_;
+			if (reportInterval_ == 0 || out_ == nullptr || iterations_ % reportInterval_ != 0)
+				return;
+			lock.unlock();
+			Print(*out_);
+		}
+
+		std::vector<LayerCounters> LayerProfiler::Layers() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			std::vector<LayerCounters> result;
+			for (const LayerCounters& item : layers_) {
+				if (item.calls != 0) {
+					result.push_back(item);
+				}
+			}
+			return result;
+		}
+
+		std::size_t LayerProfiler::Iterations() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return iterations_;
+		}
+
+		bool LayerProfiler::HasCounters() const
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			return hasCounters_;
+		}
+
+		void LayerProfiler::Reset()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			layers_.clear();
+			iterations_ = 0;
+			hasCounters_ = false;
+		}
+
+		void LayerProfiler::Print(std::ostream& out) const
+		{
+			std::vector<LayerCounters> layers = Layers();
+			out << boost::format("layer profile after %u iterations\n") % Iterations();
+			if (!HasCounters()) {
+				out << "hardware counters aren't available, only time is measured\n";
+			}
+			// scaled: calls with counters estimated from a multiplexed part of the
+			// call, lost: calls while the counters belonged to other events
+			out << boost::format("%5s %-16s %-11s %8s %10s %12s %6s %8s %8s %8s %8s %8s\n")
+				% "layer" % "type" % "phase" % "calls" % "time us" % "cycles" % "IPC"
+				% "L1D/ki" % "LLC/ki" % "br/ki" % "scaled" % "lost";
+			bool multiplexed = false;
+			for (const LayerCounters& item : layers) {
+				const counters_t& c = item.counters;
+				out << boost::format("%5u %-16s %-11s %8u %10.1f %12u %6.2f %8.2f %8.2f %8.2f %8u %8u\n")
+					% item.layer % item.type % phase_names[item.phase] % item.calls
+					% (item.time.count() / 1000.0) % c[cycles]
+					% (c[cycles] ? static_cast<double>(c[instructions]) / c[cycles] : 0.0)
+					% PerKilo(c[l1d_misses], c[instructions])
+					% PerKilo(c[llc_misses], c[instructions])
+					% PerKilo(c[branch_misses], c[instructions])
+					% item.scaled % item.uncounted;
+				multiplexed = multiplexed || item.scaled != 0 || item.uncounted != 0;
+			}
+			if (multiplexed) {
+				out << "counters were multiplexed with other events, the values are estimates\n";
+			}
+		}
+
+		std::ostream& operator<<(std::ostream& os, const LayerProfiler& profiler)
+		{
+			profiler.Print(os);
+			return os;
+		}
+	}
+}
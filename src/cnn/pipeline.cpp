@@ -0,0 +1,195 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "pipeline.hpp"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace cnn
+{
+	namespace nn
+	{
+		namespace
+		{
+			// spin shortly, then give the core to other stages
+			void Backoff(unsigned& spins)
+			{
+				if (++spins < 64) {
+					std::this_thread::yield();
+				} else {
+					std::this_thread::sleep_for(std::chrono::microseconds(50));
+				}
+			}
+		}
+
+		PipelineExecutor::PipelineExecutor(std::shared_ptr<NeuralNetwork> net,
+		                                   std::vector<std::size_t> boundaries,
+		                                   std::size_t queueCapacity)
+			: net_(net), boundaries_(std::move(boundaries)), stop_(false)
+		{
+#ifndef NDEBUG
+			assert(net_);
+			assert(boundaries_.size() >= 2);
+			assert(boundaries_.front() == 0 && boundaries_.back() == net_->Size());
+			assert(std::is_sorted(boundaries_.begin(), boundaries_.end()));
+#endif
+			std::size_t stages = boundaries_.size() - 1;
+			for (std::size_t s = 0; s <= stages; ++s) {
+				queues_.emplace_back(std::make_unique<queue_t>(queueCapacity));
+			}
+			contexts_.reserve(stages);
+			for (std::size_t s = 0; s < stages; ++s) {
+				contexts_.emplace_back(net_->CreateContext());
+			}
+			workers_.reserve(stages);
+			for (std::size_t s = 0; s < stages; ++s) {
+				workers_.emplace_back(&PipelineExecutor::Run, this, s);
+			}
+		}
+
+		PipelineExecutor::~PipelineExecutor()
+		{
+			stop_.store(true);
+			for (std::thread& worker : workers_) {
+				worker.join();
+			}
+		}
+
+		std::vector<std::size_t> PipelineExecutor::UniformStages(std::size_t layers,
+		                                                         std::size_t stages)
+		{
+			stages = std::max<std::size_t>(1, std::min(stages, layers));
+			std::vector<std::size_t> boundaries(stages + 1);
+			for (std::size_t s = 0; s <= stages; ++s) {
+				boundaries[s] = s * layers / stages;
+			}
+			return boundaries;
+		}
+
+		std::vector<std::size_t> PipelineExecutor::BalancedStages(
+			const NeuralNetwork& net, std::shared_ptr<arma::Cube<double>> sample, std::size_t stages)
+		{
+			typedef std::chrono::steady_clock clock;
+			std::size_t layers = net.Size();
+			stages = std::max<std::size_t>(1, std::min(stages, layers));
+			// the first pass warms up caches and allocates buffers
+			const std::size_t runs = 4;
+			std::vector<double> cost(layers, 0.0);
+			ExecutionContext ctx = net.CreateContext();
+			for (std::size_t run = 0; run < runs; ++run) {
+				std::shared_ptr<arma::Cube<double>> input = sample;
+				for (std::size_t i = 0; i < layers; ++i) {
+					clock::time_point start = clock::now();
+					net.Forward(ctx, i, i + 1, input);
+					if (run != 0) {
+						cost[i] += std::chrono::duration<double>(clock::now() - start).count();
+					}
+					input = net.Output(ctx, i);
+				}
+			}
+			// prefix[i] = cost of layers [0, i)
+			std::vector<double> prefix(layers + 1, 0.0);
+			for (std::size_t i = 0; i < layers; ++i) {
+				prefix[i + 1] = prefix[i] + cost[i];
+			}
+			// best[s][i] = minimal cost of the slowest stage when
+			// the first i layers are split to s stages
+			const double inf = std::numeric_limits<double>::infinity();
+			std::vector<std::vector<double>> best(stages + 1, std::vector<double>(layers + 1, inf));
+			std::vector<std::vector<std::size_t>> split(stages + 1,
+			                                            std::vector<std::size_t>(layers + 1, 0));
+			best[0][0] = 0.0;
+			for (std::size_t s = 1; s <= stages; ++s) {
+				for (std::size_t i = s; i <= layers; ++i) {
+					for (std::size_t j = s - 1; j < i; ++j) {
+						double value = std::max(best[s - 1][j], prefix[i] - prefix[j]);
+						if (value < best[s][i]) {
+							best[s][i] = value;
+							split[s][i] = j;
+						}
+					}
+				}
+			}
+			std::vector<std::size_t> boundaries(stages + 1);
+			boundaries[stages] = layers;
+			for (std::size_t s = stages; s > 0; --s) {
+				boundaries[s - 1] = split[s][boundaries[s]];
+			}
+			return boundaries;
+		}
+
+		void PipelineExecutor::Push(std::shared_ptr<arma::Cube<double>> image)
+		{
+			unsigned spins = 0;
+			while (!TryPush(image)) {
+				Backoff(spins);
+			}
+		}
+
+		bool PipelineExecutor::TryPush(std::shared_ptr<arma::Cube<double>>& image)
+		{
+#ifndef NDEBUG
+			assert(image);
+#endif
+			return queues_.front()->TryPush(std::move(image));
+		}
+
+		std::shared_ptr<arma::Cube<double>> PipelineExecutor::Pop()
+		{
+			std::shared_ptr<arma::Cube<double>> hypothesis;
+			unsigned spins = 0;
+			while (!TryPop(hypothesis)) {
+				Backoff(spins);
+			}
+			return hypothesis;
+		}
+
+		bool PipelineExecutor::TryPop(std::shared_ptr<arma::Cube<double>>& hypothesis)
+		{
+			return queues_.back()->TryPop(hypothesis);
+		}
+
+		void PipelineExecutor::Run(std::size_t stage)
+		{
+			queue_t& in = *queues_[stage];
+			queue_t& out = *queues_[stage + 1];
+			ExecutionContext& ctx = contexts_[stage];
+			std::size_t first = boundaries_[stage];
+			std::size_t last = boundaries_[stage + 1];
+			std::shared_ptr<arma::Cube<double>> item;
+			unsigned spins = 0;
+			while (!stop_.load(std::memory_order_relaxed)) {
+				if (!in.TryPop(item)) {
+					Backoff(spins);
+					continue;
+				}
+				spins = 0;
+				if (first != last) {
+					net_->Forward(ctx, first, last, item);
+					// layers reuse their output buffers on the next call. detach them
+					// from the context, the layer allocates new ones next time
+					LayerContext& top = ctx.Layer(last - 1);
+					item = std::move(top.output);
+					top.receptiveField.reset();
+				}
+				while (!out.TryPush(std::move(item))) {
+					if (stop_.load(std::memory_order_relaxed))
+						return;
+					Backoff(spins);
+				}
+				spins = 0;
+			}
+		}
+	}
+}
@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "pooling_layer.hpp"
+#include "parallel.hpp"
 #include <armadillo>
 #include <cmath>
 
@@ -19,13 +20,14 @@ namespace cnn
 {
 	namespace nn
 	{
-		void MaxPoolingLayer::Forward(std::shared_ptr<arma::Cube<double>> input)
+		void MaxPoolingLayer::Forward(std::shared_ptr<arma::Cube<double>> input,
+									LayerContext& ctx) const
 		{
 			using namespace arma;
 
-			input_ = input;
-			uword output_height = (input_->n_rows - kernel_size_.height);
-			uword output_width = (input_->n_cols - kernel_size_.width);
+			ctx.input = input;
+			uword output_height = (ctx.input->n_rows - kernel_size_.height);
+			uword output_width = (ctx.input->n_cols - kernel_size_.width);
 
 #ifndef NDEBUG
 			assert(output_height % stride_ == 0);
@@ -35,51 +37,61 @@ namespace cnn
 #endif
 			output_height = output_height / stride_ + 1;
 			output_width = output_width / stride_ + 1;
-			if (!receptiveField_) {
-				receptiveField_ = std::make_shared<Cube<double>>(output_height, output_width,
-				                                                input_->n_slices, fill::zeros);
+			if (!ctx.receptiveField) {
+				ctx.receptiveField = std::make_shared<Cube<double>>(output_height, output_width,
+				                                                ctx.input->n_slices, fill::zeros);
 			} else {
-				receptiveField_->set_size(output_height, output_width, input_->n_slices);
-				receptiveField_->zeros();
+				ctx.receptiveField->set_size(output_height, output_width, ctx.input->n_slices);
+				ctx.receptiveField->zeros();
 			}
 
-			connectIndexes_.set_size(input_->n_rows, input_->n_cols, input_->n_slices);
-			connectIndexes_.zeros();
-			double maxVal;
-			uword rowIdx, colIdx;
+			ctx.connectIndexes.set_size(ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices);
+			ctx.connectIndexes.zeros();
 
-			for (uword d = 0; d < input_->n_slices; ++d) {
-				uword out_col = 0;
-				for (uword c = 0; c < input_->n_cols; c += stride_) {
-					uword out_row = 0;
-					for (uword r = 0; r < input_->n_rows; r += stride_) {
-						maxVal = input_->slice(d)(span(r, r + kernel_size_.height - 1),
-						                          span(c, c + kernel_size_.height - 1)).max(rowIdx, colIdx);
-						(*receptiveField_)(out_row, out_col, d) = maxVal;
-						connectIndexes_(r + rowIdx, c + colIdx, d) = 1;
-						++out_row;
+			// work is split by channels and by strips of output columns.
+			// overlapping windows of neighbour strips would write the same
+			// connect indexes, so then only whole channels are split
+			uword strips = stride_ >= kernel_size_.height ? output_width : 1;
+			ParallelFor(0, ctx.input->n_slices * strips, [&](std::size_t first, std::size_t last)
+			{
+				double maxVal;
+				uword rowIdx, colIdx;
+				for (uword tile = first; tile < last; ++tile) {
+					uword d = tile / strips;
+					uword strip = tile % strips;
+					uword col_first = strip * output_width / strips;
+					uword col_last = (strip + 1) * output_width / strips;
+					for (uword out_col = col_first; out_col < col_last; ++out_col) {
+						uword c = out_col * stride_;
+						for (uword out_row = 0; out_row < output_height; ++out_row) {
+							uword r = out_row * stride_;
+							maxVal = ctx.input->slice(d)(span(r, r + kernel_size_.height - 1),
+							                          span(c, c + kernel_size_.height - 1)).max(rowIdx, colIdx);
+							(*ctx.receptiveField)(out_row, out_col, d) = maxVal;
+							ctx.connectIndexes(r + rowIdx, c + colIdx, d) = 1;
+						}
 					}
-					++out_col;
 				}
-			}
+			});
 
 			// currently common to use the activation function after convolution layer
 			// instead of a subsample layer
 			if (!activFunc_) {
-				output_ = receptiveField_;
+				ctx.output = ctx.receptiveField;
 			} else {
-				if (!output_) {
-					output_ = std::make_shared<Cube<double>>(output_height, output_width,
-					                                        input_->n_slices);
+				if (!ctx.output) {
+					ctx.output = std::make_shared<Cube<double>>(output_height, output_width,
+					                                        ctx.input->n_slices);
 				} else {
-					output_->set_size(output_height, output_width, input_->n_slices);
+					ctx.output->set_size(output_height, output_width, ctx.input->n_slices);
 				}
-				activFunc_->Compute(receptiveField_, output_);
+				activFunc_->Compute(ctx.receptiveField, ctx.output);
 			}
 		}
 
 		std::pair<tensor4d, tensor4d> MaxPoolingLayer::Backward(
-			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss)
+			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+			LayerContext& ctx) const
 		{
 			using namespace arma;
 #ifndef NDEBUG
@@ -87,28 +99,28 @@ namespace cnn
 #endif
 			// top layer was 1d. we need reshape error to 3d
 			if (prevLocalLoss->n_slices == 1 && prevLocalLoss->n_cols == 1) {
-				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), output_->n_rows,
-				                               output_->n_cols, output_->n_slices);
+				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), ctx.output->n_rows,
+				                               ctx.output->n_cols, ctx.output->n_slices);
 			}
 
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<Cube<double>>(
-					input_->n_rows, input_->n_cols, input_->n_slices, fill::zeros);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<Cube<double>>(
+					ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices, fill::zeros);
 			} else {
-				localLoss_->set_size(input_->n_rows, input_->n_cols, input_->n_slices);
-				localLoss_->zeros();
+				ctx.localLoss->set_size(ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices);
+				ctx.localLoss->zeros();
 			}
 			uword rowIdx, colIdx;
-			for (uword d = 0; d < input_->n_slices; ++d) {
+			for (uword d = 0; d < ctx.input->n_slices; ++d) {
 				uword lossCol = 0;
-				for (uword c = 0; c < input_->n_cols; c += stride_) {
+				for (uword c = 0; c < ctx.input->n_cols; c += stride_) {
 					uword lossRow = 0;
-					for (uword r = 0; r < input_->n_rows; r += stride_) {
+					for (uword r = 0; r < ctx.input->n_rows; r += stride_) {
 						// from top to bottom propagates only connected losses
-						connectIndexes_.slice(d)(span(r, r + kernel_size_.height - 1),
+						ctx.connectIndexes.slice(d)(span(r, r + kernel_size_.height - 1),
 						                         span(c, c + kernel_size_.height - 1)
 						               ).max(rowIdx, colIdx);
-						(*localLoss_)(r + rowIdx, c + colIdx, d) = (*prevLocalLoss)(
+						(*ctx.localLoss)(r + rowIdx, c + colIdx, d) = (*prevLocalLoss)(
 							lossRow, lossCol, d);
 						++lossRow;
 					}
@@ -117,7 +129,7 @@ namespace cnn
 			}
 
 			if (activFunc_) {
-				localLoss_->transform([&] (double value) {
+				ctx.localLoss->transform([&] (double value) {
 					if (!value) {
 						return value;
 					} else
@@ -131,7 +143,8 @@ namespace cnn
 		}
 
 		std::pair<tensor4d, tensor4d> MaxPoolingLayer::Backward2nd(
-			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss)
+			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+			LayerContext& ctx) const
 		{
 			using namespace arma;
 #ifndef NDEBUG
@@ -139,28 +152,28 @@ namespace cnn
 #endif
 			// top layer was 1d. we need reshape error to 3d
 			if (prevLocalLoss->n_slices == 1 && prevLocalLoss->n_cols == 1) {
-				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), output_->n_rows,
-											   output_->n_cols, output_->n_slices);
+				(*prevLocalLoss) = unvectorise(prevLocalLoss->get_ref(), ctx.output->n_rows,
+											   ctx.output->n_cols, ctx.output->n_slices);
 			}
 
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<Cube<double>>(
-					input_->n_rows, input_->n_cols, input_->n_slices, fill::zeros);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<Cube<double>>(
+					ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices, fill::zeros);
 			} else {
-				localLoss_->set_size(input_->n_rows, input_->n_cols, input_->n_slices);
-				localLoss_->zeros();
+				ctx.localLoss->set_size(ctx.input->n_rows, ctx.input->n_cols, ctx.input->n_slices);
+				ctx.localLoss->zeros();
 			}
 			uword rowIdx, colIdx;
-			for (uword d = 0; d < input_->n_slices; ++d) {
+			for (uword d = 0; d < ctx.input->n_slices; ++d) {
 				uword lossCol = 0;
-				for (uword c = 0; c < input_->n_cols; c += stride_) {
+				for (uword c = 0; c < ctx.input->n_cols; c += stride_) {
 					uword lossRow = 0;
-					for (uword r = 0; r < input_->n_rows; r += stride_) {
+					for (uword r = 0; r < ctx.input->n_rows; r += stride_) {
 						// from top to bottom propagates only connected losses
-						connectIndexes_.slice(d)(span(r, r + kernel_size_.height - 1),
+						ctx.connectIndexes.slice(d)(span(r, r + kernel_size_.height - 1),
 												 span(c, c + kernel_size_.height - 1)
 												 ).max(rowIdx, colIdx);
-						(*localLoss_)(r + rowIdx, c + colIdx, d) = (*prevLocalLoss)(
+						(*ctx.localLoss)(r + rowIdx, c + colIdx, d) = (*prevLocalLoss)(
 							lossRow, lossCol, d);
 						++lossRow;
 					}
@@ -169,7 +182,7 @@ namespace cnn
 			}
 
 			if (activFunc_) {
-				localLoss_->transform([&](double value) {
+				ctx.localLoss->transform([&](double value) {
 					if (!value) {
 						return value;
 					} else
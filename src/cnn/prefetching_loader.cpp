@@ -0,0 +1,139 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "prefetching_loader.hpp"
+#include <algorithm>
+
+namespace cnn
+{
+	namespace
+	{
+		// a worker gives up after this many failed loads in a row
+		const std::size_t max_failures = 16;
+		// the delay before a retry doubles after every failure
+		const std::chrono::milliseconds min_backoff(1);
+		const std::chrono::milliseconds max_backoff(500);
+	}
+
+	PrefetchingLoader::PrefetchingLoader(factory_t factory, std::size_t workers,
+	                                     std::size_t capacity, std::uint32_t seed)
+		: capacity_(std::max<std::size_t>(1, capacity)), stop_(false),
+		stats_{ 0, 0, std::chrono::microseconds(0), 0, 0, 0 }
+	{
+		workers = std::max<std::size_t>(1, workers);
+		liveWorkers_ = workers;
+		loaders_.reserve(workers + 1);
+		for (std::size_t i = 0; i <= workers; ++i) {
+			loaders_.emplace_back(factory());
+#ifndef NDEBUG
+			assert(loaders_.back());
+#endif
+			loaders_.back()->Seed(seed + static_cast<std::uint32_t>(i));
+		}
+		workers_.reserve(workers);
+		for (std::size_t i = 0; i < workers; ++i) {
+			workers_.emplace_back(&PrefetchingLoader::Run, this, i);
+		}
+	}
+
+	PrefetchingLoader::~PrefetchingLoader()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		notFull_.notify_all();
+		notEmpty_.notify_all();
+		stopping_.notify_all();
+		for (std::thread& worker : workers_) {
+			worker.join();
+		}
+	}
+
+	bool PrefetchingLoader::LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                      arma::Col<double>& labels)
+	{
+		std::lock_guard<std::mutex> lock(testMutex_);
+		return loaders_.back()->LoadTestImage(dst, labels);
+	}
+
+	bool PrefetchingLoader::LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                                       arma::Col<double>& labels)
+	{
+		typedef std::chrono::steady_clock clock;
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (queue_.empty()) {
+			++stats_.consumerStalls;
+			clock::time_point start = clock::now();
+			notEmpty_.wait(lock, [this]() { return stop_ || !queue_.empty() || liveWorkers_ == 0; });
+			stats_.consumerWait += std::chrono::duration_cast<std::chrono::microseconds>(
+				clock::now() - start);
+			if (queue_.empty())
+				return false;
+		}
+		Sample& sample = queue_.front();
+		dst = std::move(sample.image);
+		labels = std::move(sample.labels);
+		queue_.pop_front();
+		++stats_.served;
+		lock.unlock();
+		notFull_.notify_one();
+		return true;
+	}
+
+	PrefetchStats PrefetchingLoader::Stats() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return stats_;
+	}
+
+	void PrefetchingLoader::Run(std::size_t worker)
+	{
+		BaseImageLoader& loader = *loaders_[worker];
+		Sample sample;
+		std::size_t failures = 0;
+		std::chrono::milliseconds backoff = min_backoff;
+		for (;;) {
+			// decode outside of the lock
+			if (!loader.LoadTrainImage(sample.image, sample.labels)) {
+				std::unique_lock<std::mutex> lock(mutex_);
+				++stats_.failed;
+				if (++failures >= max_failures) {
+					++stats_.deadWorkers;
+					// the last worker wakes up consumers, nobody will fill the queue
+					if (--liveWorkers_ == 0) {
+						lock.unlock();
+						notEmpty_.notify_all();
+					}
+					return;
+				}
+				if (stopping_.wait_for(lock, backoff, [this]() { return stop_; }))
+					return;
+				backoff = std::min(backoff * 2, max_backoff);
+				continue;
+			}
+			failures = 0;
+			backoff = min_backoff;
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (queue_.size() >= capacity_) {
+				++stats_.producerStalls;
+				notFull_.wait(lock, [this]() { return stop_ || queue_.size() < capacity_; });
+			}
+			if (stop_)
+				return;
+			queue_.emplace_back(std::move(sample));
+			lock.unlock();
+			notEmpty_.notify_one();
+		}
+	}
+}
@@ -0,0 +1,102 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "sampler.hpp"
+#include <numeric>
+#include <sstream>
+#include <random>
+#include <utility>
+#include <cassert>
+
+namespace cnn
+{
+	EpochSampler::EpochSampler() noexcept
+		: size_(0), seed_(0), rank_(0), ranks_(1), shuffle_(false), epoch_(0), position_(0)
+	{}
+
+	EpochSampler::EpochSampler(std::size_t size, std::uint32_t seed, std::size_t rank,
+	                           std::size_t ranks, bool shuffle)
+		: size_(size), seed_(seed), rank_(rank), ranks_(ranks), shuffle_(shuffle),
+		epoch_(0), position_(0)
+	{
+#ifndef NDEBUG
+		assert(ranks != 0 && rank < ranks);
+#endif
+		permute();
+	}
+
+	void EpochSampler::permute()
+	{
+		std::vector<std::size_t> all(size_);
+		std::iota(all.begin(), all.end(), std::size_t(0));
+		if (shuffle_) {
+			// mt19937, seed_seq and this fisher-yates are fully specified, unlike
+			// std::shuffle and distributions, so every platform gets the same order
+			std::seed_seq seq{ seed_, static_cast<std::uint32_t>(epoch_),
+			                   static_cast<std::uint32_t>(static_cast<std::uint64_t>(epoch_) >> 32) };
+			std::mt19937 gen(seq);
+			for (std::size_t i = size_; i > 1; --i) {
+				std::size_t j = static_cast<std::size_t>((static_cast<std::uint64_t>(gen()) * i) >> 32);
+				std::swap(all[i - 1], all[j]);
+			}
+		}
+		order_.clear();
+		order_.reserve(size_ / ranks_ + 1);
+		for (std::size_t i = rank_; i < size_; i += ranks_) {
+			order_.push_back(all[i]);
+		}
+	}
+
+	std::size_t EpochSampler::Next()
+	{
+#ifndef NDEBUG
+		assert(!order_.empty());
+#endif
+		if (position_ == order_.size()) {
+			++epoch_;
+			position_ = 0;
+			permute();
+		}
+		return order_[position_++];
+	}
+
+	std::string SamplingState(const std::mt19937& gen, const EpochSampler& sampler)
+	{
+		std::ostringstream out;
+		out << gen << ' ' << sampler.Epoch() << ' ' << sampler.Position();
+		return out.str();
+	}
+
+	bool SetSamplingState(const std::string& state, std::mt19937& gen, EpochSampler& sampler)
+	{
+		std::istringstream in(state);
+		std::mt19937 restored;
+		std::size_t epoch, position;
+		if (!(in >> restored >> epoch >> position))
+			return false;
+		gen = restored;
+		if (!sampler.empty()) {
+			sampler.SetEpoch(epoch, position);
+		}
+		return true;
+	}
+
+	void EpochSampler::SetEpoch(std::size_t epoch, std::size_t position)
+	{
+		if (epoch != epoch_) {
+			epoch_ = epoch;
+			permute();
+		}
+		position_ = position < order_.size() ? position : order_.size();
+	}
+}
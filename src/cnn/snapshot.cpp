@@ -0,0 +1,117 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "snapshot.hpp"
+#include <boost/filesystem.hpp>
+
+namespace cnn
+{
+	SnapshotWriter::SnapshotWriter(std::size_t keep)
+		: used_{ false, false }, keep_(keep), written_(0), failed_(0), stop_(false),
+		thread_(&SnapshotWriter::Run, this)
+	{}
+
+	SnapshotWriter::~SnapshotWriter()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		changed_.notify_all();
+		thread_.join();
+	}
+
+	void SnapshotWriter::Write(const nn::NeuralNetwork& net, const std::wstring& path)
+	{
+		std::size_t buffer;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			changed_.wait(lock, [this]() { return !used_[0] || !used_[1]; });
+			buffer = used_[0] ? 1 : 0;
+			used_[buffer] = true;
+		}
+		// the copy is the only work done on the caller thread
+		bool captured = nn::CaptureModel(net, buffers_[buffer]);
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (captured) {
+			jobs_.push_back(Job{ buffer, path });
+		} else {
+			used_[buffer] = false;
+			++failed_;
+		}
+		changed_.notify_all();
+	}
+
+	void SnapshotWriter::Run()
+	{
+		namespace fs = boost::filesystem;
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;) {
+			changed_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+			if (jobs_.empty())
+				return;
+			Job job = jobs_.front();
+			jobs_.pop_front();
+			lock.unlock();
+
+			// SaveModel never leaves a partial file
+			bool ok = nn::SaveModel(buffers_[job.buffer], job.path);
+			boost::system::error_code error;
+
+			lock.lock();
+			used_[job.buffer] = false;
+			if (ok) {
+				++written_;
+				// the same path written again is kept once
+				for (auto it = kept_.begin(); it != kept_.end(); ++it) {
+					if (*it == job.path) {
+						kept_.erase(it);
+						break;
+					}
+				}
+				kept_.push_back(job.path);
+				while (keep_ != 0 && kept_.size() > keep_) {
+					fs::remove(fs::path(kept_.front()), error);
+					kept_.pop_front();
+				}
+			} else {
+				++failed_;
+			}
+			changed_.notify_all();
+		}
+	}
+
+	void SnapshotWriter::Flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this]() { return !used_[0] && !used_[1]; });
+	}
+
+	void SnapshotWriter::SetKeep(std::size_t keep)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		keep_ = keep;
+	}
+
+	std::size_t SnapshotWriter::Written() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return written_;
+	}
+
+	std::size_t SnapshotWriter::Failed() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return failed_;
+	}
+}
@@ -17,7 +17,8 @@ namespace cnn
 {
 	namespace nn
 	{
-		void SoftMaxLayer::Forward(std::shared_ptr<arma::Cube<double>> input)
+		void SoftMaxLayer::Forward(std::shared_ptr<arma::Cube<double>> input,
+									LayerContext& ctx) const
 		{
 #ifndef NDEBUG
 			assert(initialized_);
@@ -26,30 +27,31 @@ namespace cnn
 #endif
 			// check is previous layer was fully-connected
 			if (input->n_slices == 1 && input->n_cols == 1) {
-				input_ = input;
+				ctx.input = input;
 			} else {
-				input_ = std::make_shared<arma::Cube<double>>(vectorise(input->get_ref()));
+				ctx.input = std::make_shared<arma::Cube<double>>(vectorise(input->get_ref()));
 			}
 
 
-			if (!receptiveField_) {
-				receptiveField_ = std::make_shared<arma::Cube<double>>(weights_.n_cols, 1, 1);
+			if (!ctx.receptiveField) {
+				ctx.receptiveField = std::make_shared<arma::Cube<double>>(weights_.n_cols, 1, 1);
 			} else {
-				receptiveField_->set_size(weights_.n_cols, 1, 1);
+				ctx.receptiveField->set_size(weights_.n_cols, 1, 1);
 			}
 
-			receptiveField_->slice(0).col(0) = weights_.data[0].slice(0).t()
-				* input_->slice(0).col(0);
-			receptiveField_->slice(0).col(0) += biasWeights_.data[0].slice(0).col(0);
+			ctx.receptiveField->slice(0).col(0) = weights_.data[0].slice(0).t()
+				* ctx.input->slice(0).col(0);
+			ctx.receptiveField->slice(0).col(0) += biasWeights_.data[0].slice(0).col(0);
 
-			if (!output_) {
-				output_ = std::make_shared<arma::Cube<double>>(weights_.n_cols, 1, 1);
+			if (!ctx.output) {
+				ctx.output = std::make_shared<arma::Cube<double>>(weights_.n_cols, 1, 1);
 			}
-			ComputeOutput();
+			ComputeOutput(ctx);
 		}
 
 		std::pair<tensor4d, tensor4d> SoftMaxLayer::Backward(
-			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss)
+			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+			LayerContext& ctx) const
 		{
 			using namespace arma;
 #ifndef NDEBUG
@@ -57,21 +59,21 @@ namespace cnn
 			assert(prevLocalLoss->n_slices == 1 && prevLocalLoss->n_cols == 1);
 #endif
 
-			arma::uword input_height = input_->n_rows;
+			arma::uword input_height = ctx.input->n_rows;
 			//propogate current delta to previous layer:
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<arma::Cube<double>>(input_height, 1, 1);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<arma::Cube<double>>(input_height, 1, 1);
 			} else {
-				localLoss_->set_size(input_height, 1, 1);
+				ctx.localLoss->set_size(input_height, 1, 1);
 			}
-			localLoss_->slice(0) = weights_.data[0].slice(0) * prevLocalLoss->slice(0);
+			ctx.localLoss->slice(0) = weights_.data[0].slice(0) * prevLocalLoss->slice(0);
 
-			arma::uword output_height = receptiveField_->n_rows;
+			arma::uword output_height = ctx.receptiveField->n_rows;
 			//compute gradients
 			std::pair<tensor4d, tensor4d> result = std::make_pair(
 				tensor4d(input_height, output_height, 1, 1),
 				tensor4d(output_height, 1, 1, 1));
-			result.first.data[0].slice(0) = input_->slice(0).col(0)
+			result.first.data[0].slice(0) = ctx.input->slice(0).col(0)
 				* prevLocalLoss->slice(0).col(0).t();
 			result.second.data[0].slice(0).col(0) = prevLocalLoss->slice(0).col(0);
 
@@ -79,7 +81,8 @@ namespace cnn
 		}
 
 		std::pair<tensor4d, tensor4d> SoftMaxLayer::Backward2nd(
-			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss)
+			const std::shared_ptr<arma::Cube<double>>& prevLocalLoss,
+			LayerContext& ctx) const
 		{
 			using namespace arma;
 #ifndef NDEBUG
@@ -87,22 +90,22 @@ namespace cnn
 			assert(prevLocalLoss->n_slices == 1 && prevLocalLoss->n_cols == 1);
 #endif
 
-			arma::uword input_height = input_->n_rows;
+			arma::uword input_height = ctx.input->n_rows;
 			//propogate current delta to previous layer:
-			if (!localLoss_) {
-				localLoss_ = std::make_shared<arma::Cube<double>>(input_height, 1, 1);
+			if (!ctx.localLoss) {
+				ctx.localLoss = std::make_shared<arma::Cube<double>>(input_height, 1, 1);
 			} else {
-				localLoss_->set_size(input_height, 1, 1);
+				ctx.localLoss->set_size(input_height, 1, 1);
 			}
-			localLoss_->slice(0) = arma::square(weights_.data[0].slice(0))
+			ctx.localLoss->slice(0) = arma::square(weights_.data[0].slice(0))
 				* prevLocalLoss->slice(0);
 
-			arma::uword output_height = receptiveField_->n_rows;
+			arma::uword output_height = ctx.receptiveField->n_rows;
 			//compute gradients
 			std::pair<tensor4d, tensor4d> result = std::make_pair(
 				tensor4d(input_height, output_height, 1, 1),
 				tensor4d(output_height, 1, 1, 1));
-			result.first.data[0].slice(0) = arma::square(input_->slice(0).col(0))
+			result.first.data[0].slice(0) = arma::square(ctx.input->slice(0).col(0))
 				* prevLocalLoss->slice(0).col(0).t();
 			result.second.data[0].slice(0).col(0) = prevLocalLoss->slice(0).col(0);
 
@@ -0,0 +1,325 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "tar_loader.hpp"
+#include "trace.hpp"
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <codecvt>
+#include <locale>
+#include <numeric>
+#include <stdexcept>
+
+namespace cnn
+{
+	namespace
+	{
+		const std::size_t tar_block = 512;
+
+		// octal field or gnu base-256 one for large sizes
+		std::uint64_t ParseNumber(const char* field, std::size_t size)
+		{
+			std::uint64_t value = 0;
+			if (static_cast<unsigned char>(field[0]) & 0x80) {
+				for (std::size_t i = 1; i < size; ++i) {
+					value = (value << 8) | static_cast<unsigned char>(field[i]);
+				}
+				return value;
+			}
+			std::size_t i = 0;
+			while (i < size && field[i] == ' ') {
+				++i;
+			}
+			for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+				value = (value << 3) | static_cast<std::uint64_t>(field[i] - '0');
+			}
+			return value;
+		}
+
+		// the checksum field holds the sum of header bytes with the field itself
+		// taken as spaces. old archivers summed signed chars
+		bool VerifyChecksum(const char* header)
+		{
+			std::uint64_t expected = ParseNumber(header + 148, 8);
+			std::uint64_t sum = 0;
+			std::int64_t signedSum = 0;
+			for (std::size_t i = 0; i < tar_block; ++i) {
+				char value = i >= 148 && i < 156 ? ' ' : header[i];
+				sum += static_cast<unsigned char>(value);
+				signedSum += static_cast<signed char>(value);
+			}
+			return expected == sum || static_cast<std::int64_t>(expected) == signedSum;
+		}
+
+		std::string ParseString(const char* field, std::size_t size)
+		{
+			return std::string(field, std::find(field, field + size, '\0'));
+		}
+
+		// pax records are "<length> <key>=<value>\n"
+		bool ParsePaxPath(const char* data, std::size_t size, std::string& path)
+		{
+			std::size_t pos = 0;
+			while (pos < size) {
+				std::size_t length = 0;
+				std::size_t i = pos;
+				for (; i < size && data[i] >= '0' && data[i] <= '9'; ++i) {
+					length = length * 10 + static_cast<std::size_t>(data[i] - '0');
+				}
+				if (length == 0 || pos + length > size || i >= size || data[i] != ' ')
+					return false;
+				std::string record(data + i + 1, data + pos + length - 1);
+				if (record.compare(0, 5, "path=") == 0) {
+					path = record.substr(5);
+					return true;
+				}
+				pos += length;
+			}
+			return false;
+		}
+	}
+
+	TarLoader::TarLoader(const std::vector<std::wstring>& trainShards,
+	                     const std::vector<std::wstring>& testShards,
+	                     const std::wstring& trainPath, cv::Size scaleSize,
+	                     const TarLoaderOptions& options)
+		: scaleSize_(scaleSize), options_(options), open_(false),
+		gen_(std::random_device().operator()())
+	{
+		options_.shuffle_buffer = std::max<std::size_t>(1, options_.shuffle_buffer);
+		std::vector<std::wstring> folders;
+		open_ = LfwLoader::ReadFolderNames(trainPath, folders);
+#ifndef NDEBUG
+		assert(open_);
+#endif
+		labels_.reserve(folders.size() + 1);
+		labels_.emplace_back(L"Unknown");
+		for (const std::wstring& folder : folders) {
+			labelIds_.emplace(folder, static_cast<std::uint32_t>(labels_.size()));
+			labels_.push_back(folder);
+		}
+		initStream(train_, trainShards);
+		initStream(test_, testShards);
+		if (options_.shuffle_shards) {
+			std::shuffle(train_.order.begin(), train_.order.end(), gen_);
+		}
+	}
+
+	void TarLoader::initStream(Stream& stream, const std::vector<std::wstring>& shards)
+	{
+		stream.shards.assign(shards.begin(), shards.end());
+		stream.order.resize(shards.size());
+		std::iota(stream.order.begin(), stream.order.end(), std::size_t(0));
+		stream.next = 0;
+		stream.produced = false;
+		stream.epochs = 0;
+		stream.length = 0;
+		stream.buffer.resize(std::max<std::size_t>(tar_block, options_.buffer_size));
+	}
+
+	bool TarLoader::readMember(std::istream& in, std::uint64_t length, std::string& name,
+	                           std::vector<unsigned char>& data)
+	{
+		// gnu long name or pax path of the next member
+		std::string longName;
+		std::vector<char> extended;
+		char header[tar_block];
+		while (in.read(header, tar_block)) {
+			// a zero block ends the archive
+			if (header[0] == '\0')
+				return false;
+			// sizes are used for allocations, so a damaged header ends the shard
+			std::streamoff pos = in.tellg();
+			if (!VerifyChecksum(header) || pos < 0)
+				return false;
+			std::uint64_t size = ParseNumber(header + 124, 12);
+			if (size > length - std::min<std::uint64_t>(length, static_cast<std::uint64_t>(pos)))
+				return false;
+			std::uint64_t padded = (size + tar_block - 1) / tar_block * tar_block;
+			char type = header[156];
+			if (type == 'L' || type == 'x') {
+				extended.resize(static_cast<std::size_t>(padded));
+				if (!in.read(extended.data(), static_cast<std::streamsize>(padded)))
+					return false;
+				if (type == 'L') {
+					longName = ParseString(extended.data(), static_cast<std::size_t>(size));
+				} else {
+					ParsePaxPath(extended.data(), static_cast<std::size_t>(size), longName);
+				}
+				continue;
+			}
+			if (type != '0' && type != '\0') {
+				// directories, links and global headers
+				in.seekg(static_cast<std::streamoff>(padded), std::ios::cur);
+				longName.clear();
+				continue;
+			}
+			if (!longName.empty()) {
+				name.swap(longName);
+			} else {
+				name = ParseString(header, 100);
+				std::string prefix = ParseString(header + 345, 155);
+				if (std::equal(header + 257, header + 262, "ustar") && !prefix.empty()) {
+					name = prefix + "/" + name;
+				}
+			}
+			data.resize(static_cast<std::size_t>(size));
+			if (!in.read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(size)))
+				return false;
+			in.ignore(static_cast<std::streamsize>(padded - size));
+			return true;
+		}
+		return false;
+	}
+
+	bool TarLoader::readSample(Stream& stream, bool test, Sample& sample)
+	{
+		std::string name;
+		for (;;) {
+			if (!stream.file.is_open()) {
+				if (stream.next == stream.order.size()) {
+					if (!stream.produced)
+						return false;
+					// next pass over the shards
+					++stream.epochs;
+					stream.next = 0;
+					stream.produced = false;
+					if (!test && options_.shuffle_shards) {
+						std::shuffle(stream.order.begin(), stream.order.end(), gen_);
+					}
+				}
+				// the buffer has to be set before the file is opened
+				stream.file.rdbuf()->pubsetbuf(stream.buffer.data(),
+				                               static_cast<std::streamsize>(stream.buffer.size()));
+				const boost::filesystem::path& shard = stream.shards[stream.order[stream.next++]];
+				boost::system::error_code error;
+				stream.length = boost::filesystem::file_size(shard, error);
+				if (error)
+					continue;
+				stream.file.open(shard, std::ios::binary);
+				if (!stream.file.is_open()) {
+					stream.file.clear();
+					continue;
+				}
+			}
+			if (!readMember(stream.file, stream.length, name, sample.data)) {
+				stream.file.close();
+				stream.file.clear();
+				continue;
+			}
+			sample.label = test ? 0 : labelOf(name);
+			return true;
+		}
+	}
+
+	bool TarLoader::decodeSample(Stream& stream, const Sample& sample,
+	                             std::shared_ptr<arma::Cube<double>>& dst)
+	{
+		std::shared_ptr<arma::Cube<double>> image = std::make_shared<arma::Cube<double>>(
+			scaleSize_.width, scaleSize_.height, 3);
+		if (!decode(sample.data, *image))
+			return false;
+		stream.produced = true;
+		dst = std::move(image);
+		return true;
+	}
+
+	bool TarLoader::decode(const std::vector<unsigned char>& data, arma::Cube<double>& dst) const
+	{
+		CNN_TRACE_SCOPE("decode", "loader");
+		if (data.empty())
+			return false;
+		cv::Mat image = cv::imdecode(cv::Mat(1, static_cast<int>(data.size()), CV_8UC1,
+		                                     const_cast<unsigned char*>(data.data())),
+		                             cv::IMREAD_COLOR);
+		if (image.empty())
+			return false;
+		cv::Rect ROI = cv::Rect(0, 0, image.cols, image.rows);
+		if (options_.roi.width > 0 && options_.roi.height > 0) {
+			ROI = options_.roi & ROI;
+			if (ROI.width <= 0 || ROI.height <= 0)
+				return false;
+		}
+		cv::Mat scaleImage;
+		cv::resize(image(ROI), scaleImage, scaleSize_, 0, 0, CV_INTER_LINEAR);
+		converter_.Convert(scaleImage, dst);
+		return true;
+	}
+
+	std::uint32_t TarLoader::labelOf(const std::string& name) const
+	{
+		// folder is the path component before the file name
+		std::size_t end = name.find_last_of('/');
+		if (end == std::string::npos)
+			return 0;
+		std::size_t begin = name.find_last_of('/', end == 0 ? 0 : end - 1);
+		begin = begin == std::string::npos || begin >= end ? 0 : begin + 1;
+		std::wstring folder;
+		try {
+			// member names are utf-8
+			folder = std::wstring_convert<std::codecvt_utf8<wchar_t>>().from_bytes(
+				name.substr(begin, end - begin));
+		} catch (const std::range_error&) {
+			return 0;
+		}
+		auto it = labelIds_.find(folder);
+		return it == labelIds_.end() ? 0 : it->second;
+	}
+
+	void TarLoader::setLabels(std::uint32_t label, arma::Col<double>& labels) const
+	{
+		labels.set_size(labels_.size());
+		labels.fill(0);
+		labels(label) = 1;
+	}
+
+	bool TarLoader::LoadTestImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                              arma::Col<double>& labels)
+	{
+		// test shards are read in order without shuffling, members which
+		// aren't images are skipped
+		Sample sample;
+		do {
+			if (!readSample(test_, true, sample))
+				return false;
+		} while (!decodeSample(test_, sample, dst));
+		setLabels(sample.label, labels);
+		return true;
+	}
+
+	bool TarLoader::LoadTrainImage(std::shared_ptr<arma::Cube<double>>& dst,
+	                               arma::Col<double>& labels)
+	{
+		for (;;) {
+			// the buffer is filled once and then topped up by one member per
+			// taken one. only the taken member is decoded
+			while (shuffle_.size() < options_.shuffle_buffer) {
+				Sample sample;
+				if (!readSample(train_, false, sample))
+					break;
+				shuffle_.push_back(std::move(sample));
+			}
+			if (shuffle_.empty())
+				return false;
+			std::uniform_int_distribution<std::size_t> uid(0, shuffle_.size() - 1);
+			std::swap(shuffle_[uid(gen_)], shuffle_.back());
+			Sample sample = std::move(shuffle_.back());
+			shuffle_.pop_back();
+			if (decodeSample(train_, sample, dst)) {
+				setLabels(sample.label, labels);
+				return true;
+			}
+		}
+	}
+}
@@ -0,0 +1,252 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "test_evaluation.hpp"
+#include "thread_pool.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <boost/format.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <chrono>
+#include <codecvt>
+#include <condition_variable>
+#include <iomanip>
+#include <locale>
+#include <mutex>
+#include <numeric>
+
+namespace cnn
+{
+	namespace evaluation
+	{
+		namespace
+		{
+			// JSON has no nan or infinity
+			void WriteNumber(std::ostream& out, double value)
+			{
+				if (std::isfinite(value)) {
+					out << value;
+				} else {
+					out << "null";
+				}
+			}
+
+			void WriteString(std::ostream& out, const std::string& value)
+			{
+				out << '"';
+				for (char c : value) {
+					if (c == '"' || c == '\\') {
+						out << '\\' << c;
+					} else if (static_cast<unsigned char>(c) < 0x20) {
+						out << boost::format("\\u%04x") % static_cast<int>(c);
+					} else {
+						out << c;
+					}
+				}
+				out << '"';
+			}
+		}
+
+		void Tally::Merge(const Tally& other)
+		{
+			evaluated += other.evaluated;
+			failed += other.failed;
+			loss += other.loss;
+			top1 += other.top1;
+			top_k += other.top_k;
+			if (other.confusion.is_empty())
+				return;
+			if (confusion.is_empty()) {
+				confusion = other.confusion;
+			} else {
+				confusion += other.confusion;
+			}
+		}
+
+		Tally EvaluateSamples(const nn::NeuralNetwork& net, ThreadPool& pool,
+		                      std::vector<nn::ExecutionContext>& contexts, std::size_t amount,
+		                      const sample_loader_t& load, std::size_t top_k, std::size_t chunk)
+		{
+#ifndef NDEBUG
+			assert(contexts.size() >= pool.Size());
+#endif
+			chunk = std::max<std::size_t>(1, chunk);
+			top_k = std::max<std::size_t>(1, top_k);
+			std::vector<Tally> partial(pool.Size());
+			std::atomic<std::size_t> next(0);
+			std::size_t finished = 0;
+			std::mutex doneMutex;
+			std::condition_variable done;
+			for (std::size_t task = 0; task < partial.size(); ++task) {
+				pool.Post([&, task](std::size_t worker)
+				{
+					nn::ExecutionContext& ctx = contexts[worker];
+					Tally& part = partial[task];
+					std::vector<arma::uword> order;
+					for (;;) {
+						std::size_t first = next.fetch_add(chunk);
+						if (first >= amount)
+							break;
+						std::size_t last = std::min(amount, first + chunk);
+						for (std::size_t idx = first; idx < last; ++idx) {
+							arma::uword label;
+							try {
+								if (!load(idx, ctx, label)) {
+									++part.failed;
+									continue;
+								}
+								net.Forward(ctx);
+							} catch (...) {
+								++part.failed;
+								continue;
+							}
+							const arma::Cube<double>& hypothesis = *net.Hypothesis(ctx);
+							if (label >= hypothesis.n_elem) {
+								++part.failed;
+								continue;
+							}
+							order.resize(hypothesis.n_elem);
+							std::iota(order.begin(), order.end(), 0);
+							std::size_t k = std::min<std::size_t>(top_k, order.size());
+							std::partial_sort(order.begin(), order.begin() + k, order.end(),
+							                  [&hypothesis](arma::uword a, arma::uword b)
+							{
+								return hypothesis[a] > hypothesis[b];
+							});
+							if (part.confusion.is_empty()) {
+								part.confusion.zeros(hypothesis.n_elem, hypothesis.n_elem);
+							}
+							++part.confusion(label, order[0]);
+							part.top1 += order[0] == label ? 1 : 0;
+							part.top_k += std::find(order.begin(), order.begin() + k, label)
+								!= order.begin() + k ? 1 : 0;
+							ctx.Labels().zeros(hypothesis.n_elem);
+							ctx.Labels()(label) = 1;
+							part.loss += net.Error(ctx);
+							++part.evaluated;
+						}
+					}
+					std::lock_guard<std::mutex> lock(doneMutex);
+					++finished;
+					done.notify_one();
+				});
+			}
+			{
+				std::unique_lock<std::mutex> lock(doneMutex);
+				done.wait(lock, [&]() { return finished == partial.size(); });
+			}
+			Tally total;
+			for (const Tally& part : partial) {
+				total.Merge(part);
+			}
+			return total;
+		}
+
+		TestSetReport EvaluateTestSet(const nn::NeuralNetwork& net, const EvaluationOptions& options)
+		{
+#ifndef NDEBUG
+			assert(net.is_initialized());
+#endif
+			typedef std::chrono::steady_clock clock;
+			clock::time_point start = clock::now();
+			std::size_t images = net.TestImages();
+			std::size_t top_k = std::max<std::size_t>(1, options.top_k);
+
+			ThreadPool pool(options.threads);
+			std::vector<nn::ExecutionContext> contexts;
+			for (std::size_t i = 0; i < pool.Size(); ++i) {
+				contexts.emplace_back(net.CreateContext());
+			}
+			Tally tally = EvaluateSamples(net, pool, contexts, images,
+			                              [&net](std::size_t idx, nn::ExecutionContext& ctx,
+			                                     arma::uword& label)
+			{
+				return net.LoadTestSample(idx, ctx, label);
+			}, top_k, options.chunk);
+
+			TestSetReport report;
+			report.images = images;
+			report.evaluated = tally.evaluated;
+			report.failed = tally.failed;
+			report.top_k = top_k;
+			report.confusion = std::move(tally.confusion);
+			double evaluated = report.evaluated ? static_cast<double>(report.evaluated) : 1.0;
+			report.loss = tally.loss / evaluated;
+			report.accuracy = tally.top1 / evaluated;
+			report.top_k_accuracy = tally.top_k / evaluated;
+			for (arma::uword c = 0; c < report.confusion.n_rows; ++c) {
+				ClassReport item;
+				item.support = arma::accu(report.confusion.row(c));
+				item.predicted = arma::accu(report.confusion.col(c));
+				item.correct = report.confusion(c, c);
+				item.precision = item.predicted ? static_cast<double>(item.correct) / item.predicted : 0.0;
+				item.recall = item.support ? static_cast<double>(item.correct) / item.support : 0.0;
+				report.classes.push_back(item);
+			}
+			report.seconds = std::chrono::duration<double>(clock::now() - start).count();
+			return report;
+		}
+
+		bool WriteJson(const nn::NeuralNetwork& net, const TestSetReport& report,
+		               const std::wstring& path)
+		{
+			boost::filesystem::ofstream out(boost::filesystem::path(path), std::ios::trunc);
+			if (!out.is_open())
+				return false;
+			std::wstring_convert<std::codecvt_utf8<wchar_t>> utf8;
+			out << std::setprecision(10);
+			out << "{\n  \"images\": " << report.images
+				<< ",\n  \"evaluated\": " << report.evaluated
+				<< ",\n  \"failed\": " << report.failed
+				<< ",\n  \"seconds\": " << report.seconds
+				<< ",\n  \"loss\": ";
+			WriteNumber(out, report.loss);
+			out << ",\n  \"accuracy\": " << report.accuracy
+				<< ",\n  \"top_k\": " << report.top_k
+				<< ",\n  \"top_k_accuracy\": " << report.top_k_accuracy
+				<< ",\n  \"classes\": [";
+			for (std::size_t c = 0; c < report.classes.size(); ++c) {
+				const ClassReport& item = report.classes[c];
+				out << (c ? ",\n" : "\n") << "    {\"label\": " << c << ", \"name\": ";
+				// the hypothesis may have more outputs than the loader has names
+				if (c < net.Labels()) {
+					WriteString(out, utf8.to_bytes(net.LabelName(c)));
+				} else {
+					out << "null";
+				}
+				out << ", \"support\": " << item.support << ", \"predicted\": " << item.predicted
+					<< ", \"precision\": " << item.precision << ", \"recall\": " << item.recall << "}";
+			}
+			out << "\n  ],\n  \"confusion\": [";
+			for (arma::uword row = 0; row < report.confusion.n_rows; ++row) {
+				out << (row ? ",\n" : "\n") << "    [";
+				for (arma::uword col = 0; col < report.confusion.n_cols; ++col) {
+					out << (col ? ", " : "") << report.confusion(row, col);
+				}
+				out << "]";
+			}
+			out << "\n  ]\n}\n";
+			return static_cast<bool>(out);
+		}
+
+		std::ostream& operator<<(std::ostream& os, const TestSetReport& report)
+		{
+			return os << boost::format(
+				"evaluated %u of %u test images (%u failed) in %.3f s\n"
+				"loss: %.6f, accuracy: %.4f, top-%u accuracy: %.4f\n")
+				% report.evaluated % report.images % report.failed % report.seconds
+				% report.loss % report.accuracy % report.top_k % report.top_k_accuracy;
+		}
+	}
+}
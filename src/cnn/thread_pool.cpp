@@ -0,0 +1,67 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "thread_pool.hpp"
+#include <algorithm>
+
+namespace cnn
+{
+	ThreadPool::ThreadPool(std::size_t threads)
+		: stop_(false)
+	{
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		workers_.reserve(threads);
+		for (std::size_t i = 0; i < threads; ++i) {
+			workers_.emplace_back(&ThreadPool::Run, this, i);
+		}
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		ready_.notify_all();
+		for (std::thread& worker : workers_) {
+			worker.join();
+		}
+	}
+
+	void ThreadPool::Post(task_t task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			tasks_.emplace_back(std::move(task));
+		}
+		ready_.notify_one();
+	}
+
+	void ThreadPool::Run(std::size_t worker)
+	{
+		for (;;) {
+			task_t task;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				ready_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+				if (tasks_.empty())
+					return;
+				task = std::move(tasks_.front());
+				tasks_.pop_front();
+			}
+			task(worker);
+		}
+	}
+}
@@ -0,0 +1,155 @@
+﻿// Copyright 2016 by Glukhov V. O. All Rights Reserved.
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "trace.hpp"
+#include <boost/filesystem/fstream.hpp>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace cnn
+{
+	namespace trace
+	{
+		namespace detail
+		{
+			std::atomic<bool> enabled(false);
+		}
+
+		namespace
+		{
+			struct Event
+			{
+				const char* name;
+				const char* category;
+				std::int64_t index;
+				clock::time_point begin;
+				clock::time_point end;
+			};
+
+			// events of one thread. the lock is taken by the writer only,
+			// so the recording thread practically never waits for it
+			struct Buffer
+			{
+				std::mutex mutex;
+				std::vector<Event> events;
+				std::size_t thread;
+			};
+
+			struct Registry
+			{
+				std::mutex mutex;
+				// buffers stay here after their threads exit
+				std::vector<std::shared_ptr<Buffer>> buffers;
+				clock::time_point origin = clock::now();
+			};
+
+			Registry& Instance()
+			{
+				static Registry registry;
+				return registry;
+			}
+
+			Buffer& ThreadBuffer()
+			{
+				thread_local std::shared_ptr<Buffer> buffer;
+				if (!buffer) {
+					buffer = std::make_shared<Buffer>();
+					buffer->events.reserve(4096);
+					Registry& registry = Instance();
+					std::lock_guard<std::mutex> lock(registry.mutex);
+					buffer->thread = registry.buffers.size() + 1;
+					registry.buffers.push_back(buffer);
+				}
+				return *buffer;
+			}
+
+			void WriteString(std::ostream& out, const char* value)
+			{
+				out << '"';
+				for (; *value; ++value) {
+					if (*value == '"' || *value == '\\')
+						out << '\\';
+					out << *value;
+				}
+				out << '"';
+			}
+		}
+
+		void Start()
+		{
+			Instance();
+			detail::enabled.store(true);
+		}
+
+		void Stop()
+		{
+			detail::enabled.store(false);
+		}
+
+		void Clear()
+		{
+			Registry& registry = Instance();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			for (const std::shared_ptr<Buffer>& buffer : registry.buffers) {
+				std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+				buffer->events.clear();
+			}
+			registry.origin = clock::now();
+		}
+
+		void Record(const char* name, const char* category, std::int64_t index,
+		            clock::time_point begin, clock::time_point end) noexcept
+		{
+			try {
+				Buffer& buffer = ThreadBuffer();
+				std::lock_guard<std::mutex> lock(buffer.mutex);
+				buffer.events.push_back(Event{ name, category, index, begin, end });
+			} catch (...) {
+			}
+		}
+
+		bool WriteChromeTrace(const std::wstring& path)
+		{
+			boost::filesystem::ofstream out(boost::filesystem::path(path), std::ios::trunc);
+			if (!out.is_open())
+				return false;
+			typedef std::chrono::duration<double, std::micro> microseconds;
+			Registry& registry = Instance();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+			bool first = true;
+			for (const std::shared_ptr<Buffer>& buffer : registry.buffers) {
+				std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+				for (const Event& event : buffer->events) {
+					out << (first ? "\n" : ",\n") << "{\"name\": ";
+					WriteString(out, event.name);
+					out << ", \"cat\": ";
+					WriteString(out, event.category);
+					// complete events, ts and dur are in microseconds
+					out << ", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->thread
+						<< ", \"ts\": " << microseconds(event.begin - registry.origin).count()
+						<< ", \"dur\": " << microseconds(event.end - event.begin).count();
+					if (event.index >= 0) {
+						out << ", \"args\": {\"index\": " << event.index << "}";
+					}
+					out << "}";
+					first = false;
+				}
+			}
+			out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+			return static_cast<bool>(out);
+		}
+	}
+}
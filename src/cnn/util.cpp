@@ -13,6 +13,8 @@
 // limitations under the License.
 
 #include "util.hpp"
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
 
 namespace cnn
 {
@@ -63,18 +65,109 @@ namespace cnn
 
 	arma::Cube<double> cvMat2armaCube(const cv::Mat& src)
 	{
+		arma::Cube<double> cube(src.cols, src.rows, 3);
+		cvMat2armaCube(src, cube);
+		return cube;
+	}
+
+	void cvMat2armaCube(const cv::Mat& src, arma::Cube<double>& dst)
+	{
+		arma::uword n_channels = 3;
+#ifndef NDEBUG
+		assert(dst.n_rows == arma::uword(src.cols) && dst.n_cols == arma::uword(src.rows));
+		assert(dst.n_slices == n_channels);
+#endif
 		cv::Mat f_image;
 		src.convertTo(f_image, CV_64FC3);
-		arma::uword n_channels = 3;
 		std::vector<cv::Mat_<double>> channels;
 		channels.reserve(n_channels);
 
-		arma::Cube<double> cube(f_image.cols, f_image.rows, n_channels);
 		for (arma::uword channel = 0; channel < n_channels; ++channel)
-			channels.emplace_back(f_image.rows, f_image.cols, cube.slice(channel).memptr());
+			channels.emplace_back(f_image.rows, f_image.cols, dst.slice_memptr(channel));
 		cv::split(f_image, channels);
+	}
 
-		return cube;
+	ImageConverter::ImageConverter(const std::array<double, 3>& mean,
+	                               const std::array<double, 3>& stddev)
+		: mean_(mean), stddev_(stddev)
+	{
+		fill(1.0, 0.0);
+	}
+
+	ImageConverter::ImageConverter(const ImageConverter& base, double contrast, double brightness)
+		: mean_(base.mean_), stddev_(base.stddev_)
+	{
+		fill(contrast, brightness);
+	}
+
+	void ImageConverter::fill(double contrast, double brightness)
+	{
+		for (std::size_t c = 0; c < 3; ++c) {
+#ifndef NDEBUG
+			assert(stddev_[c] != 0.0);
+#endif
+			for (int value = 0; value < 256; ++value) {
+				double x = value / 255.0;
+				if (contrast != 1.0 || brightness != 0.0) {
+					x = std::min(1.0, std::max(0.0, (x - 0.5) * contrast + 0.5 + brightness));
+				}
+				lut_[c][value] = (x - mean_[c]) / stddev_[c];
+			}
+		}
+	}
+
+	void ImageConverter::Convert(const cv::Mat& src, arma::Cube<double>& dst) const
+	{
+		cv::Mat bgr = src;
+		if (bgr.depth() != CV_8U) {
+			// integer images are scaled by their range, floating point ones
+			// are taken as [0, 1]. negative values saturate to 0
+			double scale = 1.0;
+			switch (bgr.depth()) {
+			case CV_8S: scale = 255.0 / 127.0; break;
+			case CV_16U: scale = 255.0 / 65535.0; break;
+			case CV_16S: scale = 255.0 / 32767.0; break;
+			case CV_32S: scale = 255.0 / 2147483647.0; break;
+			default: scale = 255.0; break;
+			}
+			cv::Mat scaled;
+			bgr.convertTo(scaled, CV_MAKETYPE(CV_8U, bgr.channels()), scale);
+			bgr = scaled;
+		}
+		if (bgr.channels() == 1) {
+			cv::Mat color;
+			cv::cvtColor(bgr, color, cv::COLOR_GRAY2BGR);
+			bgr = color;
+		} else if (bgr.channels() == 4) {
+			cv::Mat color;
+			cv::cvtColor(bgr, color, cv::COLOR_BGRA2BGR);
+			bgr = color;
+		}
+#ifndef NDEBUG
+		assert(bgr.type() == CV_8UC3);
+#endif
+		arma::uword width = bgr.cols;
+		arma::uword height = bgr.rows;
+		if (dst.n_rows != width || dst.n_cols != height || dst.n_slices != 3) {
+			dst.set_size(width, height, 3);
+		}
+		// pixel (y, x) goes to (x, y) of every slice, so rows of the image
+		// are contiguous in every slice as well
+		double* blue = dst.slice_memptr(0);
+		double* green = dst.slice_memptr(1);
+		double* red = dst.slice_memptr(2);
+		const double* lut_b = lut_[0];
+		const double* lut_g = lut_[1];
+		const double* lut_r = lut_[2];
+		for (arma::uword y = 0; y < height; ++y) {
+			const unsigned char* row = bgr.ptr<unsigned char>(static_cast<int>(y));
+			arma::uword offset = y * width;
+			for (arma::uword x = 0; x < width; ++x) {
+				blue[offset + x] = lut_b[row[3 * x]];
+				green[offset + x] = lut_g[row[3 * x + 1]];
+				red[offset + x] = lut_r[row[3 * x + 2]];
+			}
+		}
 	}
 
 	cv::Mat armaMat2cvMat(const arma::Mat<double> &src)